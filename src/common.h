@@ -1,6 +1,8 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 #include <errno.h>
 
@@ -9,11 +11,91 @@
 #define SCROLLBACK_BUFFER 200
 #define SCROLLBACK_INPUT 15
 #define BUFFSIZE 512
+#define TAGSIZE 8191
+#define TAGS_MAX 32
 #define NICKSIZE 256
 #define CHANSIZE 256
 #define MAX_INPUT 256
 #define RECONNECT_DELTA 15
-#define MODE_SIZE (26 * 2) + 1 /* Supports modes [az-AZ] */
+
+/* In channels with more users than config.join_part_quit_threshold, JOIN/PART/
+ * QUIT/NICK lines are only shown for the last SPEAKERS_MAX users to have
+ * spoken in the channel within SPEAKERS_WINDOW seconds */
+#define SPEAKERS_MAX 64
+#define SPEAKERS_WINDOW 900
+
+/* Seconds without further QUITs or JOINs before a netsplit or netjoin is printed */
+#define NETSPLIT_WINDOW 2
+
+/* Seconds after a netsplit's last QUIT or JOIN before its users are forgotten */
+#define NETSPLIT_TIMEOUT 900
+
+/* Bulk WHO and CHATHISTORY requests for joined channels are each sent one at a
+ * time, at most every REQUEST_DELAY seconds, and abandoned without a reply after
+ * REQUEST_TIMEOUT seconds */
+#define REQUEST_DELAY 2
+#define REQUEST_TIMEOUT 60
+
+/* Width of the nick sidebar, shown in channels of at least NICKLIST_COLS * 3 columns */
+#define NICKLIST_COLS 20
+
+/* Tables of nicks or masks print at most TABLE_ROWS rows, the rest are counted */
+#define TABLE_ROWS 16
+
+/* Lazy nicklists loaded on demand are dropped again after NICKLIST_IDLE seconds
+ * without being used */
+#define NICKLIST_IDLE 300
+
+/* Lazy nicklists count JOINs, but not the QUITs of users who haven't spoken
+ * recently, so their users are recounted every NICKLIST_RECOUNT seconds */
+#define NICKLIST_RECOUNT 600
+
+/* Inbound messages are rate limited by token buckets, each a burst and the
+ * seconds to refill one token: per sender for all messages and for CTCP
+ * requests, and per server for private messages and CTCP replies. Dropped
+ * messages are counted and printed once none were dropped for FLOOD_WINDOW
+ * seconds, or every FLOOD_REPORT seconds of a flood. With config.flood_ignore
+ * set, senders with FLOOD_IGNORE messages dropped are ignored for that many
+ * seconds */
+#define FLOOD_MESG_BURST     10
+#define FLOOD_MESG_REFILL    1
+#define FLOOD_CTCP_BURST     2
+#define FLOOD_CTCP_REFILL    10
+#define FLOOD_PRIVATE_BURST  20
+#define FLOOD_PRIVATE_REFILL 1
+#define FLOOD_REPLY_BURST    5
+#define FLOOD_REPLY_REFILL   3
+#define FLOOD_WINDOW 2
+#define FLOOD_REPORT 60
+#define FLOOD_IGNORE 20
+
+/* Pasted lines are queued and sent paced by RFC 1459's message timer: each
+ * message sent to a server advances it SENDQ_PENALTY seconds, and queued lines
+ * are held while it's more than SENDQ_BURST seconds ahead */
+#define SENDQ_PENALTY 2
+#define SENDQ_BURST   10
+
+/* Watched nicks the server can't MONITOR are polled with ISON every
+ * WATCH_ISON_INTERVAL seconds */
+#define WATCH_ISON_INTERVAL 60
+
+/* WHOX token identifying replies to rirc's bulk WHO requests */
+#define WHOX_TOKEN "734"
+
+/* IRCv3 capabilities requested when offered by a server */
+#define IRCV3_CAPS \
+	X(CAP_AWAY_NOTIFY,  "away-notify") \
+	X(CAP_BATCH,        "batch") \
+	X(CAP_CHATHISTORY,  "draft/chathistory") \
+	X(CAP_MESSAGE_TAGS, "message-tags") \
+	X(CAP_MULTI_PREFIX, "multi-prefix") \
+	X(CAP_SERVER_TIME,  "server-time")
+
+/* Maximum number of parameters stored for the set modes of a channel */
+#define MODE_PARAMS_MAX 4
+
+/* Maximum number of channel membership prefix modes, eg: (ov)@+ */
+#define PREFIX_MAX 8
 
 /* When tab completing a nick at the beginning of the line, append the following char */
 #define TAB_COMPLETE_DELIMITER ':'
@@ -70,6 +152,7 @@ typedef enum {
 	BUFFER_CHANNEL, /* IRC channel buffer */
 	BUFFER_SERVER,  /* Server message buffer */
 	BUFFER_PRIVATE, /* Private chat buffer */
+	BUFFER_LIST,    /* Channel directory buffer */
 	BUFFER_T_SIZE
 } buffer_t;
 
@@ -81,6 +164,40 @@ typedef enum {
 	ACTIVITY_T_SIZE
 } activity_t;
 
+/* Channel nicklist policies. Lazy nicklists keep only a count of users and the
+ * channel's recent speakers, and are loaded in full on demand */
+typedef enum {
+	NICKLIST_AUTO, /* Lazy with more than config.lazy_nicklist_threshold users */
+	NICKLIST_FULL,
+	NICKLIST_LAZY,
+	NICKLIST_T_SIZE
+} nicklist_t;
+
+/* Channel bulk WHO, NAMES and CHATHISTORY request states */
+typedef enum {
+	REQUEST_NONE,
+	REQUEST_QUEUED,
+	REQUEST_SENT,
+	REQUEST_DONE,
+	REQUEST_T_SIZE
+} request_t;
+
+/* Inbound message kinds, by the token buckets they're limited by */
+typedef enum {
+	FLOOD_MESG,    /* Channel messages, per sender */
+	FLOOD_PRIVATE, /* Private messages, per sender and server */
+	FLOOD_CTCP,    /* CTCP requests needing a reply, per sender and server */
+	FLOOD_T_SIZE
+} flood_t;
+
+/* IRCv3 capabilities, enabled as bits (1 << cap) of a server's caps */
+typedef enum {
+#define X(CAP, STR) CAP,
+	IRCV3_CAPS
+#undef X
+	CAP_T_SIZE
+} cap_t;
+
 /* Buffer line types */
 typedef enum {
 	LINE_DEFAULT,
@@ -89,37 +206,334 @@ typedef enum {
 	LINE_T_SIZE
 } line_t;
 
+/* Buffer line events, formatted as text only when drawn */
+typedef enum {
+	EVENT_NONE,
+	EVENT_JOIN, /* nick!host has joined chan */
+	EVENT_PART, /* nick!host has left chan [(arg)] */
+	EVENT_QUIT, /* nick!host has quit [(arg)] */
+	EVENT_NICK, /* nick  >>  arg */
+	EVENT_T_SIZE
+} event_t;
+
+/* Nick and channel name casemappings, as advertised by RPL_ISUPPORT CASEMAPPING */
+typedef enum {
+	CASEMAPPING_RFC1459,        /* Default; A-Z, []\~ equivalent to a-z, {}|^ */
+	CASEMAPPING_STRICT_RFC1459, /* A-Z, []\ equivalent to a-z, {}| */
+	CASEMAPPING_ASCII,          /* A-Z equivalent to a-z */
+	CASEMAPPING_T_SIZE
+} casemapping_t;
+
 /* Global configuration */
 struct config
 {
 	int join_part_quit_threshold;
+	int lazy_nicklist_threshold;
+	int flood_ignore; /* Seconds to ignore flooding senders, 0 to never */
 	char *username;
 	char *realname;
 	char *nicks;
+	char *highlights;
 	char *auto_connect;
 	char *auto_port;
 	char *auto_join;
 } config;
 
-/* Nicklist AVL tree node */
+/* Number of AVL node classes, a nicklist's nodes are classed by their
+ * membership's highest prefix mode */
+#define AVL_CLASSES (PREFIX_MAX + 1)
+
+/* Nicklist AVL tree node, augmented with the number of nodes of each class in
+ * its subtree for selecting nodes by rank */
 typedef struct avl_node
 {
 	int height;
+	unsigned char class;
+	size_t size; /* Allocated size of the node in its pool */
+	unsigned int count[AVL_CLASSES];
 	struct avl_node *l;
 	struct avl_node *r;
-	char *key;
+	const char *key; /* Borrowed from the caller, must outlive the node */
 	void *val;
+	char fkey[];     /* Key folded by the tree's casemapping */
 } avl_node;
 
+/* Key and value of a node, for building AVL trees in bulk */
+struct avl_entry
+{
+	const char *key;
+	void *val;
+	unsigned char class;
+};
+
+/* Node pool alignment and number of free list size classes */
+#define AVL_POOL_ALIGN   16
+#define AVL_POOL_CLASSES 8
+
+/* Slab of AVL tree nodes */
+struct avl_slab
+{
+	struct avl_slab *next;
+	size_t size;
+	size_t used;
+};
+
+/* Pool of AVL tree nodes, freed nodes are kept for reuse by size class */
+struct avl_pool
+{
+	struct avl_node *free[AVL_POOL_CLASSES];
+	struct avl_slab *slabs;
+};
+
+/* AVL tree, nodes are allocated from its pool and freed together with the tree */
+typedef struct avl_tree
+{
+	struct avl_node *root;
+	struct avl_pool pool;
+} avl_tree;
+
+/* Open addressing hash table of string keyed values, keys are owned by the caller */
+typedef struct hash_table
+{
+	size_t count;
+	size_t size;
+	struct hash_entry {
+		unsigned int hash;
+		const char *key;
+		void *val;
+	} *entries;
+} hash_table;
+
+/* Reference counted string, interned in a pool of unique strings */
+struct intern
+{
+	hash_table *pool;
+	int colour; /* Display colour, cached when first drawn */
+	unsigned int hash;
+	unsigned int refcount;
+	char str[];
+};
+
+/* Get the interned string entry for a string returned from intern() */
+#define INTERN(S) ((struct intern *)((S) - offsetof(struct intern, str)))
+
+/* Presence of a watched nick, see struct watch */
+typedef enum {
+	PRESENCE_UNKNOWN,
+	PRESENCE_ONLINE,
+	PRESENCE_OFFLINE
+} presence_t;
+
+/* IRC user, shared by the nicklists of all channels the user is a member of */
+typedef struct user
+{
+	const char *nick;
+	char *hostinfo;
+	char *realname; /* Set by WHO replies, NULL until then */
+	char *account;  /* NULL if not logged in */
+	int away;
+	presence_t presence; /* Known only for watched nicks */
+	struct membership *memberships;
+} user;
+
+/* Channel or user modes, a bitmask of the flags [A-Za-z] and the parameters
+ * of set flags taking one, eg: +k <key>, +l <limit> */
+struct mode
+{
+	uint64_t flags;
+	struct mode_param
+	{
+		char flag;
+		char *arg;
+	} params[MODE_PARAMS_MAX];
+};
+
+/* Channel modes by parameter type, from ISUPPORT CHANMODES=A,B,C,D */
+struct chanmodes
+{
+	uint64_t A; /* List modes, parameter always, eg: +b <mask> */
+	uint64_t B; /* Parameter always, eg: +k <key> */
+	uint64_t C; /* Parameter only when set, eg: +l <limit> */
+	uint64_t D; /* Never a parameter */
+};
+
+/* Ignore list of nick!user@host masks
+ *
+ * Masks without wildcards, and masks with wildcards only for the whole nick
+ * and user or user and host, are matched by hash lookup. All other masks are
+ * compiled to a matcher and tested in turn */
+struct ignore
+{
+	struct hash_table exact; /* nick!user@host */
+	struct hash_table hosts; /* *!*@host */
+	struct hash_table nicks; /* nick!*@* */
+	struct glob *globs;
+};
+
+/* Highlight words compiled into one case folded Aho-Corasick automaton, so
+ * that messages are scanned once however many words are watched */
+struct highlight
+{
+	casemapping_t cm;
+	char nick[NICKSIZE + 1]; /* Nick the automaton was compiled for */
+	size_t classes;
+	unsigned char class[256];
+	unsigned int *delta;     /* Transitions by state and character class */
+	struct highlight_state *states;
+	struct highlight_word *words;
+};
+
+/* Users quitting in a netsplit, and rejoining after it, are counted per
+ * channel and printed in one line per batch */
+struct netsplit
+{
+	char *servers;           /* QUIT message of the split, "<server> <server>" */
+	time_t quit_time;        /* Time of the last QUIT counted */
+	time_t join_time;        /* Time of the last JOIN counted */
+	struct hash_table nicks; /* Interned nicks of the users lost in the split */
+	struct netsplit_channel
+	{
+		struct channel *channel;
+		unsigned int quits;
+		unsigned int joins;
+		struct netsplit_channel *next;
+	} *channels;
+	struct netsplit *next;
+};
+
+/* Channel directory sort orders */
+typedef enum {
+	DIRECTORY_SORT_USERS, /* Most users first */
+	DIRECTORY_SORT_NAME,
+	DIRECTORY_SORT_T_SIZE
+} directory_sort_t;
+
+/* Channel directory streamed from RPL_LIST, stored by column. The view
+ * indexes the entries matching the filter, in sort order. Entries appended
+ * to the view are sorted and merged into it only when it's drawn */
+struct directory
+{
+	char *text;          /* Names and topics, NUL terminated */
+	char *fold;          /* Lowercase copy of text, for filtering */
+	size_t text_len;
+	size_t text_size;
+	size_t *names;       /* Offsets into text */
+	size_t *topics;      /* Offsets into text */
+	unsigned int *users;
+	size_t count;
+	size_t size;
+	size_t *view;
+	size_t *scratch;
+	size_t view_count;
+	size_t view_sorted;  /* Length of the view's sorted prefix */
+	size_t scroll;       /* First entry of the view drawn */
+	size_t name_width;   /* Widest name */
+	char filter[MAX_INPUT];
+	directory_sort_t sort;
+	int complete;        /* RPL_LISTEND received */
+};
+
+/* ISUPPORT limits of a server, 0 where not advertised. Messages are packed
+ * and split to fit them, see send_packed(), and nicks and channels longer
+ * than advertised are refused rather than truncated */
+#define ISUPPORT_LINELEN    512
+#define ISUPPORT_USERLEN    10
+#define ISUPPORT_HOSTLEN    63
+#define ISUPPORT_TARGMAX    1
+#define ISUPPORT(S, LIMIT, DEFAULT) ((S)->isupport.LIMIT ? (S)->isupport.LIMIT : (DEFAULT))
+struct isupport
+{
+	unsigned int linelen;         /* LINELEN, including CRLF */
+	unsigned int nicklen;         /* NICKLEN */
+	unsigned int channellen;      /* CHANNELLEN */
+	unsigned int userlen;         /* USERLEN */
+	unsigned int hostlen;         /* HOSTLEN */
+	unsigned int maxtargets;      /* MAXTARGETS */
+	unsigned int targmax_privmsg; /* TARGMAX PRIVMSG, UINT_MAX if unlimited */
+	unsigned int monitor;         /* MONITOR, UINT_MAX if unlimited */
+};
+
+/* Nicks watched for presence. Users of watched nicks are kept in the server's
+ * user table while sharing no channels, their presence tracked on the
+ * server's MONITOR list where supported, and otherwise by ISON polls. Both
+ * are packed with as many nicks as fit in a line, see watch_flush() */
+struct watch
+{
+	struct hash_table nicks;    /* Interned nicks, to their struct watch_nick */
+	struct watch_ison *ison;    /* ISON polls awaiting replies, oldest first */
+	time_t ison_time;           /* Time of the last ISON poll */
+	unsigned int monitored;     /* Nicks on the server's MONITOR list */
+	unsigned int pending;       /* Nicks added since the last flush */
+	int ready;                  /* Registered, the MOTD received */
+};
+
+/* Lines queued to send to a server, see SENDQ_PENALTY */
+struct sendq
+{
+	time_t time; /* Message timer, advanced by every message sent */
+	unsigned int count;
+	struct sendq_line *head;
+	struct sendq_line *tail;
+};
+
+/* Inbound flood limits of a server, see FLOOD_MESG_BURST. Each token bucket
+ * is kept as the time it's next full, a message taking a token by advancing
+ * it one refill, and refused while it's more than a burst ahead */
+struct flood
+{
+	time_t private;          /* Private messages from all senders */
+	time_t reply;            /* CTCP replies to all senders */
+	time_t first;            /* First and last drop over the server's limits */
+	time_t last;
+	unsigned int dropped;    /* Messages dropped over the server's limits */
+	unsigned int senders;    /* Senders of those messages */
+	struct hash_table table; /* Interned nick to flood_sender */
+	struct flood_sender *head;
+};
+
+/* Token bucket checked by flood_take() */
+struct flood_bucket
+{
+	time_t *time; /* Time the bucket is next full */
+	int burst;
+	int refill;
+};
+
+/* Users who spoke recently in a channel, most recent first */
+struct speakers
+{
+	struct hash_table table; /* Interned nick to speaker */
+	struct speaker *head;
+	struct speaker *tail;
+	size_t count;
+};
+
+/* A user's membership in a channel, the value of the channel's nicklist node */
+typedef struct membership
+{
+	struct channel *channel;
+	struct membership *next;
+	struct user *user;
+	unsigned char prefix; /* Bit n set for the server's nth highest prefix mode */
+} membership;
+
 /* Chat buffer line */
 typedef struct buffer_line
 {
 	int rows;
 	size_t len;
 	time_t time;
-	char *text;
-	char from[NICKSIZE + 1];
+	char *text;       /* NULL until an event line is formatted */
+	const char *from; /* Interned, NULL if the line is unused */
+	char *msgid;      /* IRCv3 msgid of the line's message, or NULL */
 	line_t type;
+	struct {
+		event_t kind;
+		const char *nick; /* Interned */
+		const char *host; /* Interned, or NULL */
+		const char *chan; /* Interned, or NULL */
+		const char *arg;  /* Interned, or NULL */
+	} event;
 } buffer_line;
 
 /* Channel input line */
@@ -149,7 +563,7 @@ typedef struct channel
 	buffer_t buffer_type;
 	char name[CHANSIZE];
 	char type_flag;
-	char chanmodes[MODE_SIZE];
+	int lazy; /* Only nick_count and speakers are kept, see nicklist_t */
 	int nick_count;
 	int parted;
 	int resized;
@@ -157,41 +571,105 @@ typedef struct channel
 	struct channel *prev;
 	struct buffer_line *buffer_head;
 	struct buffer_line buffer[SCROLLBACK_BUFFER];
-	struct avl_node *nicklist;
+	struct avl_tree nicklist;
+	struct mode chanmodes;
+	struct {
+		struct membership **memberships;
+		size_t count;
+		size_t size;
+		size_t counted; /* Users of a lazy nicklist */
+	} names; /* Staged from RPL_NAMREPLY until RPL_ENDOFNAMES */
+	nicklist_t nicklist_policy;
+	struct speakers speakers;
+	struct directory *directory; /* BUFFER_LIST only */
+	request_t who;
+	request_t history;
+	request_t load; /* NAMES reply loading a lazy nicklist */
+	int load_print; /* Print the nicklist once loaded, for /names */
+	request_t count; /* NAMES reply recounting a lazy nicklist */
+	time_t load_time; /* Last use of a loaded lazy nicklist */
+	time_t count_time; /* Last count of a lazy nicklist, 0 if uncounted */
+	time_t server_time; /* Newest server-time of the buffer's lines */
+	struct hash_table msgids; /* Case sensitive, msgids of the buffer's lines */
+	unsigned int msgid_seq; /* mesg_seq of the last message added to msgids */
 	struct server *server;
 	struct input *input;
 	struct {
 		size_t nick_pad;
+		size_t nicklist_scroll; /* First row of the nick sidebar */
 		struct buffer_line *scrollback;
 	} draw;
 } channel;
 
+/* Open IRCv3 BATCH. Nicklist changes and redraws of the messages tagged with
+ * its reference are held until the server's last open batch is closed */
+struct batch
+{
+	struct batch *next;
+	char *type;
+	char *target; /* First parameter, eg: the target of a chathistory batch */
+	char ref[];
+};
+
 /* Server */
 typedef struct server
 {
+	casemapping_t casemapping;
 	char *host;
-	char input[BUFFSIZE];
+	char input[TAGSIZE + BUFFSIZE];
 	char *iptr;
 	char nick[NICKSIZE + 1];
 	char *nptr;
 	char *port;
-	char usermodes[MODE_SIZE];
+	char prefix_chars[PREFIX_MAX + 1]; /* ISUPPORT PREFIX, eg: @+ */
+	char prefix_modes[PREFIX_MAX + 1]; /* ISUPPORT PREFIX, eg: ov */
 	int soc;
 	int pinging;
-	struct avl_node *ignore;
+	int whox; /* ISUPPORT WHOX */
+	int registering;      /* Until CAP END, see recv_cap() */
+	unsigned int caps;    /* Enabled IRCv3 capabilities */
+	unsigned int caps_ls; /* Requested capabilities offered by CAP LS */
+	unsigned int batch_draw;
+	struct batch *batch;  /* Batch of the message being handled */
+	struct batch *batches;
 	struct channel *channel;
+	struct chanmodes chanmodes;
+	struct hash_table chan_table;
+	struct hash_table user_table;
+	struct hash_table intern_pool;
+	struct ignore ignore;
+	struct isupport isupport;
+	struct highlight highlight;
+	struct netsplit *netsplits;
+	struct flood flood;
+	struct sendq sendq;
+	struct watch watch;
 	struct server *next;
 	struct server *prev;
+	struct mode usermodes;
 	time_t latency_delta;
 	time_t latency_time;
 	time_t reconnect_delta;
 	time_t reconnect_time;
+	time_t who_time;
+	time_t history_time;
+	time_t load_time;
+	time_t count_time;
+	time_t mesg_time; /* server-time of the message being handled */
+	const char *mesg_id; /* msgid of the message being handled */
+	unsigned int mesg_seq; /* Count of messages handled with a msgid */
+	unsigned int history_max; /* ISUPPORT CHATHISTORY, 0 if unlimited */
 	void *connecting;
 } server;
 
-/* Parsed IRC message */
+/* Parsed IRC message, tags are unescaped in place */
 typedef struct parsed_mesg
 {
+	struct mesg_tag {
+		const char *key;
+		const char *val;
+	} tags[TAGS_MAX];
+	unsigned int tag_count;
 	char *from;
 	char *hostinfo;
 	char *command;
@@ -229,26 +707,72 @@ void poll_input(void);
 char* getarg(char**, const char*);
 char* strdup(const char*);
 char* word_wrap(int, char**, char*);
-const avl_node* avl_get(avl_node*, const char*, size_t);
-int avl_add(avl_node**, const char*, void*);
-int avl_del(avl_node**, const char*);
-int check_pinged(const char*, const char*);
+size_t split_text(const char*, size_t, size_t);
+size_t flood_take(struct flood_bucket*, size_t, time_t);
+int check_netsplit(const char*);
+casemapping_t casemapping_get(const char*);
+const avl_node* avl_get(avl_tree*, casemapping_t, const char*, size_t);
+const avl_node* avl_select(avl_tree*, size_t, int);
+int avl_set_class(avl_tree*, casemapping_t, const char*, unsigned char);
+size_t avl_range(avl_tree*, size_t, int, const avl_node**, size_t);
+size_t avl_rank(avl_tree*, casemapping_t, const char*, int);
+size_t avl_prefix(avl_tree*, casemapping_t, const char*, size_t, size_t*);
+size_t avl_size(avl_tree*, int);
+int avl_add(avl_tree*, casemapping_t, const char*, void*);
+int avl_del(avl_tree*, casemapping_t, const char*, void**);
+size_t avl_build(avl_tree*, casemapping_t, struct avl_entry*, size_t, void (*)(void*));
 int count_line_rows(int, buffer_line*);
+char* buffer_line_text(buffer_line*);
+int irc_strcmp(casemapping_t, const char*, const char*);
+int irc_strncmp(casemapping_t, const char*, const char*, size_t);
 parsed_mesg* parse(parsed_mesg*, char*);
+const char* mesg_tag(const parsed_mesg*, const char*);
+int parse_time(const char*, time_t*);
+uint64_t mode_bit(char);
+int mode_set(struct mode*, char, int, const char*);
+void mode_reset(struct mode*);
+void mode_str(const struct mode*, char*, size_t);
+void directory_add(struct directory*, const char*, unsigned int, const char*);
+void directory_filter(struct directory*, const char*);
+void directory_reset(struct directory*);
+void directory_sort(struct directory*, directory_sort_t);
+void directory_update(struct directory*);
+void free_directory(struct directory*);
 void error(int status, const char*, ...);
-void free_avl(avl_node*);
+void avl_remap(avl_tree*, casemapping_t, void (*)(void*));
+void free_avl(avl_tree*, void (*)(void*));
+int hash_add(hash_table*, casemapping_t, const char*, void*);
+void free_hash(hash_table*);
+void hash_remap(hash_table*, casemapping_t, void (*)(void*));
+void* hash_del(hash_table*, casemapping_t, const char*);
+void* hash_get(hash_table*, casemapping_t, const char*);
+int hash_add_exact(hash_table*, const char*, void*);
+void* hash_del_exact(hash_table*, const char*);
+void* hash_get_exact(hash_table*, const char*);
+int ignore_add(struct ignore*, casemapping_t, const char*);
+int ignore_del(struct ignore*, casemapping_t, const char*);
+int ignore_match(struct ignore*, casemapping_t, const char*, const char*);
+size_t ignore_list(struct ignore*, const char**);
+void free_ignore(struct ignore*);
+void ignore_remap(struct ignore*, casemapping_t);
+int highlight_match(const struct highlight*, const char*);
+void highlight_compile(struct highlight*, casemapping_t, const char*, const char*);
+void free_highlight(struct highlight*);
+const char* intern(hash_table*, const char*);
+void free_intern_pool(hash_table*);
+void intern_release(const char*);
 
 /* Irrecoverable error */
 #define fatal(mesg) \
 	do { error(errno, "ERROR in %s: %s", __func__, mesg); } while (0)
 
 /* mesg.c */
-avl_node* commands;
+avl_tree commands;
 void init_mesg(void);
 void free_mesg(void);
 void recv_mesg(char*, int, server*);
 void send_mesg(char*, channel*);
-void send_paste(char*);
+void send_paste(char*, channel*);
 
 /* state.c */
 /* FIXME: terrible, until i remove references to ccur/rirc */
@@ -0,0 +1,16 @@
+/* Rirc configuration header */
+
+/* Colors */
+#define NEUTRAL_FG 239
+#define MSG_DEFAULT_FG 250
+#define MSG_GREEN_FG 113
+static int nick_colours[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14};
+
+/* Characters */
+#define QUOTE_CHAR '>'
+#define HORIZONTAL_SEPARATOR "-"
+//#define HORIZONTAL_SEPARATOR "-"
+#define VERTICAL_SEPARATOR " ~ "
+#define LINE_CONTINUATION "~"
+
+static int actv_cols[ACTIVITY_T_SIZE] = {239, 247, 3};
@@ -32,16 +32,21 @@
 #define CURSOR_SAVE    "\x1b[s"
 #define CURSOR_RESTORE "\x1b[u"
 
+/* Maximum width of channel names drawn in a directory */
+#define DIRECTORY_NAME_COLS 32
+
 #define SEPARATOR_FG_COL FG_R
 #define SEPARATOR_BG_COL BG_R
 
 static void resize(void);
 static void draw_buffer(channel*);
+static void draw_directory(channel*);
 static void draw_nav(struct state const*);
 static void draw_input(channel*);
+static void draw_nicklist(channel*);
 static void draw_status(channel*);
 
-static int nick_col(char*);
+static int nick_col(const char*);
 
 unsigned int term_rows, term_cols;
 
@@ -56,6 +61,7 @@ redraw(channel *c)
 
 	//TODO: pass st to other draw functions
 	if (draw & D_BUFFER) draw_buffer(c);
+	if (draw & (D_BUFFER | D_STATUS)) draw_nicklist(c);
 	if (draw & D_CHANS)  draw_nav(st);
 	if (draw & D_INPUT)  draw_input(c);
 	if (draw & D_STATUS) draw_status(c);
@@ -66,14 +72,20 @@ redraw(channel *c)
 }
 
 static int
-nick_col(char *nick)
+nick_col(const char *nick)
 {
+	/* Nicks are interned, so the colour is computed once per unique nick */
+
+	struct intern *i = INTERN(nick);
 	int colour = 0;
 
+	if (i->colour >= 0)
+		return i->colour;
+
 	while (*nick)
 		colour += *nick++;
 
-	return nick_colours[colour % sizeof(nick_colours) / sizeof(nick_colours[0])];
+	return (i->colour = nick_colours[colour % sizeof(nick_colours) / sizeof(nick_colours[0])]);
 }
 
 /* TODO: this sets some global state...
@@ -164,6 +176,11 @@ draw_buffer(channel *c)
 	 *    in the channel's buffer are insufficient to fill all rows
 	 */
 
+	if (c->buffer_type == BUFFER_LIST) {
+		draw_directory(c);
+		return;
+	}
+
 	printf(CURSOR_SAVE);
 
 	/* Establish current, min and max row for drawing */
@@ -180,8 +197,8 @@ draw_buffer(channel *c)
 
 	printf(FG_R BG_R);
 
-	/* (#terminal columns) - strlen((widest nick in c)) - strlen(" HH:MM   ~ ") */
-	int text_cols = term_cols - c->draw.nick_pad - 11;
+	/* (#terminal columns) - (nick sidebar) - strlen((widest nick in c)) - strlen(" HH:MM   ~ ") */
+	int text_cols = term_cols - nicklist_cols(c) - c->draw.nick_pad - 11;
 
 	/* Insufficient columns for drawing */
 	if (text_cols < 1)
@@ -191,7 +208,7 @@ draw_buffer(channel *c)
 
 
 	/* Empty buffer */
-	if (l->text == NULL)
+	if (l->from == NULL)
 		goto clear_remainder;
 
 	/* If the window has been resized, force all cached line rows to be recalculated */
@@ -216,7 +233,7 @@ draw_buffer(channel *c)
 
 		tmp = (l == c->buffer) ? &c->buffer[SCROLLBACK_BUFFER - 1] : l - 1;
 
-		if (tmp->text == NULL || tmp == c->buffer_head)
+		if (tmp->from == NULL || tmp == c->buffer_head)
 			break;
 
 		l = tmp;
@@ -224,8 +241,8 @@ draw_buffer(channel *c)
 
 	/* 2. Handle top-most line if it can't draw in full */
 	if (count_row > max_row) {
-		char *ptr1 = l->text;
-		char *ptr2 = l->text + l->len;
+		char *ptr1 = buffer_line_text(l);
+		char *ptr2 = ptr1 + l->len;
 		
 		int text_fg = (l->text[0] == QUOTE_CHAR ?
 				MSG_GREEN_FG : MSG_DEFAULT_FG);
@@ -250,7 +267,7 @@ draw_buffer(channel *c)
 
 		l = (l == &c->buffer[SCROLLBACK_BUFFER - 1]) ? c->buffer : l + 1;
 
-		if (l->text == NULL)
+		if (l->from == NULL)
 			goto clear_remainder;
 	}
 
@@ -292,8 +309,8 @@ draw_buffer(channel *c)
 		if (from_bg >= 0)
 			printf(BG(%d), from_bg);
 
-		char *ptr1 = l->text;
-		char *ptr2 = l->text + l->len;
+		char *ptr1 = buffer_line_text(l);
+		char *ptr2 = ptr1 + l->len;
 
 		char *print = ptr1;
 		char *wrap = word_wrap(text_cols, &ptr1, ptr2);
@@ -331,7 +348,7 @@ draw_buffer(channel *c)
 
 		l = (l == &c->buffer[SCROLLBACK_BUFFER - 1]) ? c->buffer : l + 1;
 
-		if (l->text == NULL)
+		if (l->from == NULL)
 			break;
 	}
 
@@ -344,6 +361,129 @@ clear_remainder:
 	printf(CURSOR_RESTORE);
 }
 
+static void
+draw_directory(channel *c)
+{
+	/* Draw a page of a channel directory's view from its scroll position.
+	 * Entries are never formatted in advance, only the rows drawn are */
+
+	struct directory *d = c->directory;
+
+	static const char *sort[DIRECTORY_SORT_T_SIZE] = {
+		[DIRECTORY_SORT_USERS] = "users",
+		[DIRECTORY_SORT_NAME]  = "name",
+	};
+
+	int buffer_start = 3, buffer_end = term_rows - 2;
+	int print_row = buffer_start;
+	int name_cols = (d->name_width < DIRECTORY_NAME_COLS) ? (int)d->name_width : DIRECTORY_NAME_COLS;
+	int topic_cols = term_cols - name_cols - 11;
+	size_t i, e;
+
+	directory_update(d);
+
+	if (d->scroll >= d->view_count)
+		d->scroll = d->view_count ? d->view_count - 1 : 0;
+
+	printf(CURSOR_SAVE FG_R BG_R);
+
+	if (print_row <= buffer_end) {
+		printf(MOVE(%d, 1) CLEAR_LINE FG(%d) " %zu of %zu channels%s, by %s",
+				print_row++, NEUTRAL_FG, d->view_count, d->count,
+				(d->complete ? "" : " (receiving)"), sort[d->sort]);
+
+		if (*d->filter)
+			printf(", matching '%s'", d->filter);
+
+		printf(FG_R);
+	}
+
+	for (i = d->scroll; i < d->view_count && print_row <= buffer_end; i++) {
+
+		e = d->view[i];
+
+		printf(MOVE(%d, 1) CLEAR_LINE " %6u  %-*.*s" FG(%d) VERTICAL_SEPARATOR FG_R,
+				print_row++, d->users[e], name_cols, name_cols, d->text + d->names[e], NEUTRAL_FG);
+
+		if (topic_cols > 0)
+			printf("%.*s", topic_cols, d->text + d->topics[e]);
+	}
+
+	while (print_row <= buffer_end)
+		printf(MOVE(%d, 1) CLEAR_LINE, print_row++);
+
+	printf(CURSOR_RESTORE);
+}
+
+static void
+draw_nicklist(channel *c)
+{
+	/* Draw the rows of a channel's nicklist visible in the nick sidebar, grouped
+	 * by the users' highest prefix mode. Only the nodes drawn are visited, so
+	 * drawing a page is O(log n + rows) for nicklists of any size */
+
+	int buffer_start = 3, buffer_end = term_rows - 2;
+	int print_row = buffer_start, col = term_cols - NICKLIST_COLS + 1;
+	int nick_cols = NICKLIST_COLS - (int)strlen(VERTICAL_SEPARATOR) - 1;
+	size_t class, count, i, n, skip, total, rows;
+	const membership *m;
+
+	if (!nicklist_cols(c) || buffer_end < buffer_start)
+		return;
+
+	/* Rows less the header row */
+	rows = buffer_end - buffer_start;
+	total = avl_size(&(c->nicklist), -1);
+
+	if (c->draw.nicklist_scroll + rows > total)
+		c->draw.nicklist_scroll = (total > rows) ? total - rows : 0;
+
+	const avl_node *nodes[rows + 1];
+
+	printf(CURSOR_SAVE FG_R BG_R);
+
+	printf(MOVE(%d, %d) CLEAR_RIGHT FG(%d) VERTICAL_SEPARATOR " %s%d users" FG_R,
+			print_row++, col, NEUTRAL_FG, (c->lazy ? "~" : ""), c->nick_count);
+
+	/* Groups of the server's prefix modes by rank, then users without a prefix */
+	skip = c->draw.nicklist_scroll;
+	class = (c->server && *c->server->prefix_chars) ? 1 : 0;
+
+	for (n = 0; n < rows; ) {
+
+		count = avl_size(&(c->nicklist), class);
+
+		if (skip >= count) {
+			skip -= count;
+		} else {
+			i = avl_range(&(c->nicklist), skip, class, nodes + n, rows - n);
+
+			skip = 0;
+
+			for (; i; i--, n++) {
+				m = nodes[n]->val;
+
+				printf(MOVE(%d, %d) CLEAR_RIGHT FG(%d) VERTICAL_SEPARATOR FG_R "%c" FG(%d) "%.*s" FG_R,
+						print_row++, col, NEUTRAL_FG,
+						(class ? c->server->prefix_chars[class - 1] : ' '),
+						nick_col(m->user->nick), nick_cols, m->user->nick);
+			}
+		}
+
+		if (class == 0)
+			break;
+
+		if (c->server->prefix_chars[class] == '\0')
+			class = 0;
+		else
+			class++;
+	}
+
+	while (print_row <= buffer_end)
+		printf(MOVE(%d, %d) CLEAR_RIGHT FG(%d) VERTICAL_SEPARATOR FG_R, print_row++, col, NEUTRAL_FG);
+
+	printf(CURSOR_RESTORE);
+}
 
 /* TODO
  *
@@ -534,6 +674,7 @@ draw_status(channel *c)
 
 	/* Print status to temporary buffer */
 	char status_buff[term_cols + 1];
+	char mode_buff[BUFFSIZE];
 
 	int ret;
 	unsigned int col = 0;
@@ -541,12 +682,14 @@ draw_status(channel *c)
 	memset(status_buff, 0, term_cols + 1);
 
 	/* -[usermodes] */
-	if (c->server && *c->server->usermodes) {
+	if (c->server && c->server->usermodes.flags) {
 		ret = snprintf(status_buff + col, term_cols - col + 1, "%s", HORIZONTAL_SEPARATOR "[+");
 		if (ret < 0 || (col += ret) >= term_cols)
 			goto print_status;
 
-		ret = snprintf(status_buff + col, term_cols - col + 1, "%s", c->server->usermodes);
+		mode_str(&(c->server->usermodes), mode_buff, sizeof(mode_buff));
+
+		ret = snprintf(status_buff + col, term_cols - col + 1, "%s", mode_buff);
 		if (ret < 0 || (col += ret) >= term_cols)
 			goto print_status;
 
@@ -555,19 +698,24 @@ draw_status(channel *c)
 			goto print_status;
 	}
 
-	/* If private chat buffer:
-	 * -[priv] */
+	/* If private chat buffer, with the presence of watched nicks:
+	 * -[priv] -[priv online] -[priv offline] */
 	if (c->buffer_type == BUFFER_PRIVATE) {
-		ret = snprintf(status_buff + col, term_cols - col + 1, "%s", HORIZONTAL_SEPARATOR "[priv]");
+		user *u = user_get(c->server, c->name);
+
+		ret = snprintf(status_buff + col, term_cols - col + 1, HORIZONTAL_SEPARATOR "[priv%s]",
+				(!u || u->presence == PRESENCE_UNKNOWN) ? "" :
+				(u->presence == PRESENCE_ONLINE) ? " online" : " offline");
 		if (ret < 0 || (col += ret) >= term_cols)
 			goto print_status;
 	}
 
-	/* If IRC channel buffer:
+	/* If IRC channel buffer, approximate counts of lazy nicklists prefixed by ~:
 	 * -[chancount chantype chanmodes] */
 	if (c->buffer_type == BUFFER_CHANNEL) {
 
-		ret = snprintf(status_buff + col, term_cols - col + 1, HORIZONTAL_SEPARATOR "[%d", c->nick_count);
+		ret = snprintf(status_buff + col, term_cols - col + 1, HORIZONTAL_SEPARATOR "[%s%d",
+				(c->lazy ? "~" : ""), c->nick_count);
 		if (ret < 0 || (col += ret) >= term_cols)
 			goto print_status;
 
@@ -577,8 +725,10 @@ draw_status(channel *c)
 				goto print_status;
 		}
 
-		if (*c->chanmodes) {
-			ret = snprintf(status_buff + col, term_cols - col + 1, " +%s", c->chanmodes);
+		if (c->chanmodes.flags) {
+			mode_str(&(c->chanmodes), mode_buff, sizeof(mode_buff));
+
+			ret = snprintf(status_buff + col, term_cols - col + 1, " +%s", mode_buff);
 			if (ret < 0 || (col += ret) >= term_cols)
 				goto print_status;
 		}
@@ -34,7 +34,7 @@
 static char input_buff[MAX_PASTE];
 
 /* Buffer to hold paste message while waiting for confirmation, includes room for \r\n */
-static char paste_buff[MAX_INPUT + MAX_PASTE + (2 * MAX_PASTE_LINES)];
+static char paste_buff[MAX_INPUT + MAX_PASTE + (2 * MAX_PASTE_LINES) + 1];
 static size_t paste_len;
 
 /* User input handlers */
@@ -56,6 +56,19 @@ static int action_find_channel(char);
 
 /* Case insensitive tab complete for commands and nicks */
 static void tab_complete(input*);
+static const char* tab_match(size_t);
+
+/* Tab completion state, successive tabs cycle through the matches */
+static struct {
+	input *inp;               /* Input being completed, NULL when not cycling */
+	char *head;               /* Cursor position following the last completion */
+	char word[MAX_INPUT + 1]; /* The word as typed, without a leading '/' */
+	size_t len;
+	size_t inserted;          /* Characters inserted by the last completion */
+	size_t n;                 /* Index of the last match */
+	int command;              /* Completing a command, otherwise a nick */
+	int first;                /* Completing the first word of the input */
+} completion;
 
 /* Send the current input to be parsed and handled */
 static void send_input(void);
@@ -156,6 +169,10 @@ poll_input(void)
 		if (count == 0)
 			fatal("stdin closed");
 
+		/* Anything but another tab ends cycling through completions */
+		if (count != 1 || *input_buff != 0x09)
+			completion.inp = NULL;
+
 		/* Waiting for user action, ignore everything else */
 		 if (action_message)
 			input_action(input_buff, count);
@@ -222,7 +239,18 @@ input_cchar(char c)
 
 		/* ^C */
 		case 0x03:
-			/* Cancel current input */
+			/* Cancel current input, or a paste still being sent */
+			if (ccur->input->head == ccur->input->line->text
+			 && ccur->input->tail == ccur->input->line->text + MAX_INPUT
+			 && ccur->server) {
+
+				unsigned int n;
+
+				if ((n = sendq_cancel(ccur->server, ccur)))
+					newlinef(ccur, 0, "--", "Paste cancelled, %u line%s not sent", n, (n == 1 ? "" : "s"));
+
+				break;
+			}
 			ccur->input->head = ccur->input->line->text;
 			ccur->input->tail = ccur->input->line->text + MAX_INPUT;
 			ccur->input->window = ccur->input->line->text;
@@ -271,6 +299,12 @@ input_cchar(char c)
 			/* Scoll buffer down */
 			buffer_scrollback_forw(ccur);
 			break;
+
+		/* ^T */
+		case 0x14:
+			/* Toggle nick sidebar */
+			nicklist_toggle();
+			break;
 	}
 }
 
@@ -311,6 +345,14 @@ input_cseq(char *input, ssize_t len)
 	/* page down */
 	else if (!strncmp(input, "[6~", len))
 		buffer_scrollback_forw(ccur);
+
+	/* shift + page up */
+	else if (!strncmp(input, "[5;2~", len))
+		nicklist_scroll(ccur, -(int)(term_rows - 4));
+
+	/* shift + page down */
+	else if (!strncmp(input, "[6;2~", len))
+		nicklist_scroll(ccur, (int)(term_rows - 4));
 }
 
 /* TODO:
@@ -337,11 +379,11 @@ input_paste(char *paste, ssize_t len)
 	/* Determine how many lines would be required for the paste, confirm with user
 	 *
 	 * Where each message will be:
-	 *   `PRIVMESG <target> :<mesg>\r\n`
+	 *   `PRIVMSG <target> :<mesg>\r\n`
 	 */
 
 	/* Max number of characters per message that can be sent to this target */
-	size_t max_len = BUFFSIZE - strlen("PRIVMESG  :\r\n") - strlen(ccur->name);
+	size_t max_len = BUFFSIZE - strlen("PRIVMSG  :\r\n") - strlen(ccur->name);
 
 	/* Get the number of characters currently on the input line's gap buffer */
 	size_t input_len = (ccur->input->head - ccur->input->line->text)
@@ -349,7 +391,7 @@ input_paste(char *paste, ssize_t len)
 
 	/* If there are no \n characters in the paste and (head + paste + tail) fits in one
 	 * input line, insert the paste and skip the rest of the processing */
-	if ((input_len + len) <= max_len && !strchr(paste, '\n')) {
+	if ((input_len + len) <= max_len && !memchr(paste, '\n', len) && !memchr(paste, '\r', len)) {
 
 		while (len && input_char(*paste))
 			len--, paste++;
@@ -375,22 +417,18 @@ input_paste(char *paste, ssize_t len)
 	/* Initial length is the input head's count */
 	size_t line_len = ccur->input->head - ccur->input->line->text;
 
-	/* Scan the paste for \n characters and count the length, if \n is encountered
-	 * or the max number of characters is encountered, insert message terminator */
+	/* Scan the paste for \r or \n characters and count the length, if either is
+	 * encountered or the max number of characters is encountered, insert message
+	 * terminator */
 	for (input_ptr = paste; input_ptr < &paste[len]; input_ptr++) {
 
-		if (*input_ptr == '\n' || line_len == max_len) {
-
-			/* Dedupe \n characters to avoid sending empty lines */
-			if (*paste_ptr == '\n')
-				continue;
+		int newline = (*input_ptr == '\r' || *input_ptr == '\n');
 
-			line_count++;
-
-			*paste_ptr++ = '\r';
-			*paste_ptr++ = '\n';
+		/* Dedupe newlines to avoid sending empty lines */
+		if (newline && line_len == 0)
+			continue;
 
-			line_len = 0;
+		if (newline || line_len == max_len) {
 
 			if (line_count == MAX_PASTE_LINES) {
 				newlinef(ccur, 0, "-!!-",
@@ -399,8 +437,18 @@ input_paste(char *paste, ssize_t len)
 				/* Goto send_paste to avoid adding the tail to the paste */
 				goto send_paste;
 			}
-		} else {
+
+			line_count++;
+
+			*paste_ptr++ = '\r';
+			*paste_ptr++ = '\n';
+
+			line_len = 0;
+		}
+
+		if (!newline) {
 			*paste_ptr++ = *input_ptr;
+			line_len++;
 		}
 	}
 
@@ -409,7 +457,7 @@ input_paste(char *paste, ssize_t len)
 	 * Since line_count is at least < MAX_PASTE_LINES there will always  be enough
 	 * for the tail, though it may be be split at least once more
 	 */
-	for (input_ptr = ccur->input->tail; input_ptr < ccur->input->head; input_ptr++) {
+	for (input_ptr = ccur->input->tail; input_ptr < ccur->input->line->text + MAX_INPUT; input_ptr++) {
 
 		if (line_len == max_len) {
 			line_count++;
@@ -426,6 +474,12 @@ input_paste(char *paste, ssize_t len)
 
 send_paste:
 
+	/* A trailing newline leaves no line to count */
+	if (line_len == 0 && line_count > 1)
+		line_count--;
+
+	*paste_ptr = 0;
+
 	/* Store the paste length */
 	paste_len = paste_ptr - paste_buff;
 
@@ -691,62 +745,101 @@ action_find_channel(char c)
 void
 tab_complete(input *inp)
 {
-	/* Case insensitive tab complete for commands and nicks */
+	/* Case insensitive tab complete for commands and nicks
+	 *
+	 * Successive tabs replace the completion with the next match, nicks
+	 * ordered by recent speakers first, wrapping back to the first match */
 
-	const avl_node *n;
 	const char *match, *str = inp->head;
 	size_t len = 0;
+	int restore = 0;
 
-	/* Don't tab complete at beginning of line or if previous character is space */
-	if (inp->head == inp->line->text || *(inp->head - 1) == ' ')
-		return;
+	if (completion.inp == inp && completion.head == inp->head) {
 
-	/* Don't tab complete if cursor is scrolled left and next character isn't space */
-	if (inp->tail < (inp->line->text + MAX_INPUT) && *inp->tail != ' ')
-		return;
+		while (completion.inserted--)
+			delete_left(inp);
 
-	/* Scan backwards for the point to tab complete from */
-	while (str > inp->line->text && *(str - 1) != ' ')
-		len++, str--;
+		if ((match = tab_match(++completion.n)) == NULL)
+			match = tab_match(completion.n = 0);
 
-	/* Check if tab completing a command at the beginning of the buffer */
-	if (*str == '/' && str == inp->line->text) {
-		/* Command tab completion */
+		/* The matches have since gone, restore the word as typed */
+		if (match == NULL) {
+			completion.word[completion.len] = 0;
+			match = completion.word;
+			completion.inp = NULL;
+			restore = 1;
+		}
+	} else {
 
-		if ((n = avl_get(commands, ++str, --len))) {
+		/* Don't tab complete at beginning of line or if previous character is space */
+		if (inp->head == inp->line->text || *(inp->head - 1) == ' ')
+			return;
 
-			match = n->key;
+		/* Don't tab complete if cursor is scrolled left and next character isn't space */
+		if (inp->tail < (inp->line->text + MAX_INPUT) && *inp->tail != ' ')
+			return;
 
-			/* Since matching is case insensitive, delete the prefix */
-			while (len--)
-				delete_left(inp);
+		/* Scan backwards for the point to tab complete from */
+		while (str > inp->line->text && *(str - 1) != ' ')
+			len++, str--;
 
-			/* Then insert the matching string */
-			while (*match && input_char(*match++))
-				; /* do nothing */
+		completion.first = (str == inp->line->text);
 
-			/* For commands, append a space */
-			input_char(' ');
-		}
-	} else if ((n = avl_get(ccur->nicklist, str, len))) {
-		/* Nick tab completion */
+		/* Check if tab completing a command at the beginning of the buffer */
+		if ((completion.command = (*str == '/' && completion.first)))
+			str++, len--;
+		else if (ccur->server)
+			nicklist_load(ccur);
+		else
+			return;
+
+		memcpy(completion.word, str, len);
+		completion.len = len;
+		completion.n = 0;
 
-		match = n->key;
+		if ((match = tab_match(0)) == NULL)
+			return;
 
 		/* Since matching is case insensitive, delete the prefix */
 		while (len--)
 			delete_left(inp);
 
-		/* Then insert the matching string */
-		while (*match && input_char(*match++))
-			; /* do nothing */
+		completion.inp = inp;
+	}
 
-		/* Tab completing first word in input, append delimiter and space */
-		if (str == inp->line->text) {
-			input_char(TAB_COMPLETE_DELIMITER);
-			input_char(' ');
-		}
+	/* Then insert the matching string */
+	for (completion.inserted = 0; *match && input_char(*match++); completion.inserted++)
+		; /* do nothing */
+
+	if (restore)
+		return;
+
+	/* For commands append a space, for nicks as the first word in input
+	 * append the delimiter and a space */
+	if (completion.command && input_char(' '))
+		completion.inserted++;
+
+	if (!completion.command && completion.first) {
+		completion.inserted += input_char(TAB_COMPLETE_DELIMITER);
+		completion.inserted += input_char(' ');
 	}
+
+	completion.head = inp->head;
+}
+
+static const char*
+tab_match(size_t n)
+{
+	/* Returns the nth match of the word being completed, or NULL */
+
+	size_t count, first;
+
+	if (!completion.command)
+		return nick_complete(ccur, completion.word, completion.len, n);
+
+	count = avl_prefix(&commands, CASEMAPPING_ASCII, completion.word, completion.len, &first);
+
+	return (n < count) ? avl_select(&commands, first + n, -1)->key : NULL;
 }
 
 /*
@@ -758,7 +851,13 @@ action_send_paste(char c)
 {
 	/* Confirmed send */
 	if (toupper(c) == 'Y') {
-		send_paste(paste_buff);
+		send_paste(paste_buff, ccur);
+
+		/* The paste included the input line */
+		ccur->input->head = ccur->input->line->text;
+		ccur->input->tail = ccur->input->line->text + MAX_INPUT;
+		ccur->input->window = ccur->input->line->text;
+		draw(D_INPUT);
 		return 1;
 	}
 
@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,18 +23,31 @@
 #define RPL_LUSERME          255
 #define RPL_LOCALUSERS       265
 #define RPL_GLOBALUSERS      266
+#define RPL_ISON             303
+#define RPL_ENDOFWHO         315
+#define RPL_LISTSTART        321
+#define RPL_LIST             322
+#define RPL_LISTEND          323
 #define RPL_CHANNEL_URL      328
 #define RPL_NOTOPIC          331
 #define RPL_TOPIC            332
 #define RPL_TOPICWHOTIME     333
+#define RPL_WHOREPLY         352
 #define RPL_NAMREPLY         353
+#define RPL_WHOSPCRPL        354
 #define RPL_ENDOFNAMES       366
 #define RPL_MOTD             372
 #define RPL_MOTDSTART        375
 #define RPL_ENDOFMOTD        376
 #define ERR_CANNOTSENDTOCHAN 404
+#define ERR_NOMOTD           422
 #define ERR_ERRONEUSNICKNAME 432
 #define ERR_NICKNAMEINUSE    433
+#define RPL_MONONLINE        730
+#define RPL_MONOFFLINE       731
+#define RPL_MONLIST          732
+#define RPL_ENDOFMONLIST     733
+#define ERR_MONLISTFULL      734
 
 /* Fail macros used in message sending/receiving handlers */
 #define fail(M) \
@@ -47,7 +61,7 @@
 #define fail_if(C) \
 	do { if (C) return 1; } while (0)
 
-#define IS_ME(X) !strcmp(X, s->nick)
+#define IS_ME(X) !irc_strcmp(s->casemapping, X, s->nick)
 
 /* List of common IRC commands with no explicit handling */
 #define UNHANDLED_SEND_CMDS \
@@ -55,8 +69,8 @@
 	X(encap)   X(help)     X(info) \
 	X(invite)  X(ison)     X(kick) \
 	X(kill)    X(knock)    X(links) \
-	X(list)    X(lusers)   X(mode) \
-	X(motd)    X(names)    X(namesx) \
+	X(lusers)  X(mode) \
+	X(motd)    X(namesx) \
 	X(notice)  X(oper)     X(pass) \
 	X(rehash)  X(restart)  X(rules) \
 	X(server)  X(service)  X(servlist) \
@@ -65,7 +79,7 @@
 	X(time)    X(trace)    X(uhnames) \
 	X(user)    X(userhost) X(userip) \
 	X(users)   X(wallops)  X(watch) \
-	X(who)     X(whois)    X(whowas)
+	X(who)     X(whowas)
 
 /* List of commands (some rirc-specific) which are explicitly handled */
 #define HANDLED_SEND_CMDS \
@@ -76,16 +90,23 @@
 	X(disconnect) \
 	X(ignore) \
 	X(join) \
+	X(list) \
 	X(me) \
 	X(msg) \
+	X(names) \
 	X(nick) \
+	X(nicklist) \
+	X(notify) \
 	X(part) \
 	X(privmsg) \
 	X(quit) \
 	X(raw) \
+	X(sort) \
 	X(topic) \
 	X(unignore) \
-	X(version)
+	X(unnotify) \
+	X(version) \
+	X(whois)
 
 /* Function prototypes for explicitly handled commands */
 #define X(cmd) static int send_##cmd(char*, char*, channel*);
@@ -95,6 +116,20 @@ HANDLED_SEND_CMDS
 /* Handler for errors deemed fatal to a server's state */
 static void server_fatal(server*, char*, ...);
 
+/* Check a message for highlights of the server's nick or configured words */
+static int check_pinged(server*, const char*);
+
+/* Filter JOIN/PART/QUIT/NICK lines of large channels to recent speakers */
+static int show_member(channel*, const char*);
+
+/* Drop users' messages over the flood limits */
+static int check_flood(parsed_mesg*, server*, channel*, flood_t);
+
+/* Send a message packed and split to fit the server's ISUPPORT limits */
+static int send_packed(char*, server*, const char*, const char*, int);
+static size_t send_room(server*, size_t, int);
+static void isupport_targmax(server*, char*);
+
 /* Special case handler for sending non-command input */
 static int send_default(char*, char*, channel*);
 
@@ -107,12 +142,17 @@ static struct command* new_command(int (*fptr)(char*, char*, channel*));
 
 //TODO: mimic the send handler macros and build/free a tree of handlers
 /* Message receiving handlers */
+static int recv_away(char*, parsed_mesg*, server*);
+static int recv_batch(char*, parsed_mesg*, server*);
+static int recv_cap(char*, parsed_mesg*, server*);
 static int recv_ctcp_req(char*, parsed_mesg*, server*);
-static int recv_ctcp_rpl(char*, parsed_mesg*);
+static int recv_ctcp_rpl(char*, parsed_mesg*, server*);
 static int recv_error(char*, parsed_mesg*, server*);
+static int recv_isupport(char*, parsed_mesg*, server*);
 static int recv_join(char*, parsed_mesg*, server*);
 static int recv_kick(char*, parsed_mesg*, server*);
 static int recv_mode(char*, parsed_mesg*, server*);
+static int recv_mode_channel(char*, parsed_mesg*, server*, channel*, char*);
 static int recv_nick(char*, parsed_mesg*, server*);
 static int recv_notice(char*, parsed_mesg*, server*);
 static int recv_numeric(char*, parsed_mesg*, server*);
@@ -122,6 +162,17 @@ static int recv_pong(char*, parsed_mesg*, server*);
 static int recv_priv(char*, parsed_mesg*, server*);
 static int recv_quit(char*, parsed_mesg*, server*);
 static int recv_topic(char*, parsed_mesg*, server*);
+static int recv_who(server*, char*, char*, char*, char*, char*, char*, char*, int);
+
+/* IRCv3 capability names, indexed by cap_t */
+static const char *const cap_names[] = {
+#define X(CAP, STR) STR,
+	IRCV3_CAPS
+#undef X
+};
+
+static int cap_get(const char*);
+static int cap_req(char*, server*);
 
 static void
 server_fatal(server *s, char *fmt, ...)
@@ -137,18 +188,67 @@ server_fatal(server *s, char *fmt, ...)
 	server_disconnect(s, 1, 0, errbuff);
 }
 
+static int
+check_pinged(server *s, const char *mesg)
+{
+	/* The highlight automaton is only recompiled after a nick or casemapping
+	 * change, otherwise each message is a single scan */
+
+	char words[BUFFSIZE];
+	struct highlight *h = &(s->highlight);
+
+	if (h->delta == NULL || h->cm != s->casemapping || strcmp(h->nick, s->nick)) {
+
+		/* Alternate nicks are highlighted as whole words, like the nick */
+		snprintf(words, sizeof(words), "%s %s",
+			(config.nicks ? config.nicks : ""),
+			(config.highlights ? config.highlights : ""));
+
+		highlight_compile(h, s->casemapping, s->nick, words);
+	}
+
+	if (highlight_match(h, mesg)) {
+
+		/* Messages played back by CHATHISTORY are highlighted silently */
+		if (!s->batch || strcmp(s->batch->type, "chathistory"))
+			putchar('\a');
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+show_member(channel *c, const char *nick)
+{
+	return (c->nick_count < config.join_part_quit_threshold || speaker_recent(c, nick));
+}
+
+static int
+check_flood(parsed_mesg *p, server *s, channel *c, flood_t kind)
+{
+	/* Returns 1 if a message should be dropped, see flood_check(). Servers'
+	 * messages and batched playback aren't limited */
+
+	if (p->hostinfo == NULL || s->batch)
+		return 0;
+
+	return flood_check(s, p->from, p->hostinfo, c, kind);
+}
+
 void
 init_mesg(void)
 {
 	/* Build and AVL tree of commands and function pointers to handlers */
 
 	/* Add the unhandled commands with no explicit handler */
-	#define X(cmd) avl_add(&commands, #cmd, NULL);
+	#define X(cmd) avl_add(&commands, CASEMAPPING_ASCII, #cmd, NULL);
 	UNHANDLED_SEND_CMDS
 	#undef X
 
 	/* Add the handled commands with explicit handlers */
-	#define X(cmd) avl_add(&commands, #cmd, new_command(send_##cmd));
+	#define X(cmd) avl_add(&commands, CASEMAPPING_ASCII, #cmd, new_command(send_##cmd));
 	HANDLED_SEND_CMDS
 	#undef X
 }
@@ -156,7 +256,7 @@ init_mesg(void)
 void
 free_mesg(void)
 {
-	free_avl(commands);
+	free_avl(&commands, free);
 }
 
 static struct command*
@@ -202,7 +302,9 @@ send_mesg(char *mesg, channel *chan)
 		else if (!(cmd_str = getarg(&mesg, " ")))
 			newline(chan, 0, "-!!-", "Messages beginning with '/' require a command");
 
-		else if (!(cmd = avl_get(commands, cmd_str, strlen(cmd_str))))
+		/* Exact commands first, eg: /nick rather than /nicklist, then abbreviations */
+		else if (!(cmd = avl_get(&commands, CASEMAPPING_ASCII, cmd_str, strlen(cmd_str) + 1))
+		      && !(cmd = avl_get(&commands, CASEMAPPING_ASCII, cmd_str, strlen(cmd_str))))
 			newlinef(chan, 0, "-!!-", "Unknown command: '%s'", cmd_str);
 
 		else {
@@ -223,11 +325,39 @@ send_mesg(char *mesg, channel *chan)
 
 //TODO: move this function to state?
 void
-send_paste(char *paste)
+send_paste(char *paste, channel *c)
 {
-	/* TODO: send the paste buffer, which is preformatted with \r\n, and then
-	 * split the messages and newline them into the buffer * */
-	UNUSED(paste);
+	/* Queue a confirmed paste of \r\n separated lines to a channel, split to
+	 * fit the server's LINELEN. Lines are sent paced, and echoed as they're
+	 * sent, see sendq_flush() */
+
+	char *line;
+	size_t len, room;
+
+	if (c->buffer_type != BUFFER_CHANNEL && c->buffer_type != BUFFER_PRIVATE) {
+		newline(c, 0, "-!!-", "Error: This is not a channel");
+		return;
+	}
+
+	if (c->parted) {
+		newline(c, 0, "-!!-", "Error: Parted from channel");
+		return;
+	}
+
+	if ((room = send_room(c->server, strlen(c->name), 0)) == 0) {
+		newline(c, 0, "-!!-", "Error: Message target is too long");
+		return;
+	}
+
+	while ((line = getarg(&paste, "\r\n"))) {
+		for (; *line; line += (*line == ' ')) {
+			len = split_text(line, strlen(line), room);
+			sendq_add(c, line, len);
+			line += len;
+		}
+	}
+
+	sendq_flush(c->server, time(NULL));
 }
 
 static int
@@ -333,18 +463,134 @@ send_ctcp(char *err, char *mesg, channel *c)
 	return sendf(err, c->server, "PRIVMSG %s :\x01""%s\x01", targ, mesg);
 }
 
+static int
+send_packed(char *err, server *s, const char *targets, const char *text, int action)
+{
+	/* Send a PRIVMSG to comma separated targets, packed into as few lines
+	 * as TARGMAX allows and split at words to fit LINELEN as it's relayed
+	 * with our prefix, :nick!user@host PRIVMSG <targets> :<text>
+	 *
+	 * More targets per line leave less room for text, so the number per
+	 * line is chosen for the fewest lines overall */
+
+	char *targs, *targ[MAX_INPUT / 2 + 1], buf[BUFFSIZE], group[BUFFSIZE];
+	const char *p, *end = text + strlen(text);
+	size_t i, j, k, n = 0, len, room, width, lines, chunks, best = 0, best_k = 0;
+	size_t targmax;
+
+	if (s == NULL)
+		fail("Error: Not connected to server");
+
+	if ((size_t)snprintf(buf, sizeof(buf), "%s", targets) >= sizeof(buf))
+		fail("Error: Message targets are too long");
+
+	for (targs = buf; n < sizeof(targ) / sizeof(targ[0]) && (targ[n] = getarg(&targs, ",")); n++)
+		;
+
+	if (n == 0)
+		fail("Error: Messages require a target");
+
+	targmax = ISUPPORT(s, targmax_privmsg, ISUPPORT(s, maxtargets, ISUPPORT_TARGMAX));
+
+	for (k = 1; k <= n && k <= targmax; k++) {
+
+		/* Widest line of targets grouped k at a time */
+		for (width = 0, i = 0; i < n; i += k) {
+
+			for (len = 0, j = i; j < i + k && j < n; j++)
+				len += strlen(targ[j]) + (j > i);
+
+			width = (len > width) ? len : width;
+		}
+
+		if ((room = send_room(s, width, action)) == 0)
+			continue;
+
+		chunks = 0;
+		p = text;
+
+		do {
+			p += split_text(p, end - p, room);
+			p += (*p == ' ');
+			chunks++;
+		} while (*p);
+
+		lines = ((n + k - 1) / k) * chunks;
+
+		if (best_k == 0 || lines < best) {
+			best = lines;
+			best_k = k;
+		}
+	}
+
+	if (best_k == 0)
+		fail("Error: Message targets are too long");
+
+	for (i = 0; i < n; i += best_k) {
+
+		for (len = 0, j = i; j < i + best_k && j < n; j++)
+			len += sprintf(group + len, "%s%s", (j > i ? "," : ""), targ[j]);
+
+		room = send_room(s, len, action);
+		p = text;
+
+		do {
+			len = split_text(p, end - p, room);
+
+			fail_if(sendf(err, s, "PRIVMSG %s :%s%.*s%s",
+				group, (action ? "\x01""ACTION " : ""), (int)len, p, (action ? "\x01" : "")));
+
+			p += len;
+			p += (*p == ' ');
+		} while (*p);
+	}
+
+	return 0;
+}
+
+static size_t
+send_room(server *s, size_t width, int action)
+{
+	/* Returns the bytes of text that fit a PRIVMSG to targets of a width as
+	 * it's relayed with our prefix, :nick!user@host PRIVMSG <targets> :<text>
+	 * or 0 if there's no room for a UTF-8 character */
+
+	size_t len, linelen;
+	user *u;
+
+	linelen = ISUPPORT(s, linelen, ISUPPORT_LINELEN);
+	linelen = (linelen < BUFFSIZE) ? linelen : BUFFSIZE;
+
+	/* Our user@host, at its longest while it isn't known, eg: ~user@host */
+	if ((u = user_get(s, s->nick)) && u->hostinfo)
+		len = strlen(u->hostinfo);
+	else
+		len = 1 + ISUPPORT(s, userlen, ISUPPORT_USERLEN) + 1 + ISUPPORT(s, hostlen, ISUPPORT_HOSTLEN);
+
+	len += strlen(":! PRIVMSG  :\r\n") + strlen(s->nick) + width + (action ? strlen("\x01""ACTION \x01") : 0);
+
+	return (len + 4 <= linelen) ? linelen - len : 0;
+}
+
 static int
 send_default(char *err, char *mesg, channel *c)
 {
 	/* All messages not beginning with '/'  */
 
+	/* In the channel directory, filter the channels listed */
+	if (c->buffer_type == BUFFER_LIST) {
+		directory_filter(c->directory, (strcmp(mesg, "*") ? mesg : ""));
+		draw(D_BUFFER);
+		return 0;
+	}
+
 	if (c->buffer_type == BUFFER_SERVER)
 		fail("Error: This is not a channel");
 
 	if (c->parted)
 		fail("Error: Parted from channel");
 
-	fail_if(sendf(err, c->server, "PRIVMSG %s :%s", c->name, mesg));
+	fail_if(send_packed(err, c->server, c->name, mesg, 0));
 
 	newline(c, LINE_CHAT, c->server->nick, mesg);
 
@@ -367,6 +613,24 @@ send_disconnect(char *err, char *mesg, channel *c)
 	return 0;
 }
 
+static int
+send_list(char *err, char *mesg, channel *c)
+{
+	/* /list [channels] [server] */
+
+	if (!c->server)
+		fail("Error: Not connected to server");
+
+	if (*mesg)
+		fail_if(sendf(err, c->server, "LIST %s", mesg));
+	else
+		fail_if(sendf(err, c->server, "LIST"));
+
+	channel_set_current(directory_open(c->server));
+
+	return 0;
+}
+
 static int
 send_me(char *err, char *mesg, channel *c)
 {
@@ -378,7 +642,7 @@ send_me(char *err, char *mesg, channel *c)
 	if (c->parted)
 		fail("Error: Parted from channel");
 
-	fail_if(sendf(err, c->server, "PRIVMSG %s :\x01""ACTION %s\x01", c->name, mesg));
+	fail_if(send_packed(err, c->server, c->name, mesg, 1));
 
 	newlinef(c, 0, "*", "%s %s", c->server->nick, mesg);
 
@@ -388,21 +652,21 @@ send_me(char *err, char *mesg, channel *c)
 static int
 send_ignore(char *err, char *mesg, channel *c)
 {
-	/* /ignore [nick] */
+	/* /ignore [nick | nick!user@host mask] */
 
-	char *nick;
+	char *mask;
 
 	if (!c->server)
 		fail("Error: Not connected to server");
 
-	if (!(nick = getarg(&mesg, " ")))
-		nicklist_print(c);
+	if (!(mask = getarg(&mesg, " ")))
+		ignore_print(c);
 
-	else if (!avl_add(&(c->server->ignore), nick, NULL))
-		failf("Error: Already ignoring '%s'", nick);
+	else if (!ignore_add(&(c->server->ignore), c->server->casemapping, mask))
+		failf("Error: Already ignoring '%s'", mask);
 
 	else
-		newlinef(c, 0, "--", "Ignoring '%s'", nick);
+		newlinef(c, 0, "--", "Ignoring '%s'", mask);
 
 	return 0;
 }
@@ -412,10 +676,18 @@ send_join(char *err, char *mesg, channel *c)
 {
 	/* /join [target[,targets]*] */
 
-	char *targ;
+	char *targ, *p;
+	size_t len;
+
+	if ((targ = getarg(&mesg, " "))) {
+
+		for (p = targ; c->server && c->server->isupport.channellen && *p; p += len + (p[len] == ',')) {
+			if ((len = strcspn(p, ",")) > c->server->isupport.channellen)
+				failf("Error: Channels are limited to %u characters", c->server->isupport.channellen);
+		}
 
-	if ((targ = getarg(&mesg, " ")))
 		return sendf(err, c->server, "JOIN %s", targ);
+	}
 
 	if (c->buffer_type == BUFFER_SERVER)
 		fail("Error: JOIN requires a target");
@@ -437,6 +709,37 @@ send_msg(char *err, char *mesg, channel *c)
 	return send_privmsg(err, mesg, c);
 }
 
+static int
+send_names(char *err, char *mesg, channel *c)
+{
+	/* /names [channel] */
+
+	char *targ;
+
+	/* The current channel's nicklist is printed without querying the server,
+	 * lazy nicklists once loaded */
+	if (!(targ = getarg(&mesg, " "))) {
+
+		if (c->buffer_type != BUFFER_CHANNEL)
+			fail("Error: /names <channel>");
+
+		if (!c->parted && !c->lazy) {
+			nicklist_print(c);
+			return 0;
+		}
+
+		if (!c->parted) {
+			nicklist_load(c);
+			c->load_print = 1;
+			return 0;
+		}
+
+		targ = c->name;
+	}
+
+	return sendf(err, c->server, "NAMES %s", targ);
+}
+
 static int
 send_nick(char *err, char *mesg, channel *c)
 {
@@ -444,8 +747,13 @@ send_nick(char *err, char *mesg, channel *c)
 
 	char *nick;
 
-	if ((nick = getarg(&mesg, " ")))
+	if ((nick = getarg(&mesg, " "))) {
+
+		if (c->server && c->server->isupport.nicklen && strlen(nick) > c->server->isupport.nicklen)
+			failf("Error: Nicks are limited to %u characters", c->server->isupport.nicklen);
+
 		return sendf(err, c->server, "NICK %s", nick);
+	}
 
 	if (!c->server)
 		fail("Error: Not connected to server");
@@ -455,6 +763,78 @@ send_nick(char *err, char *mesg, channel *c)
 	return 0;
 }
 
+static int
+send_nicklist(char *err, char *mesg, channel *c)
+{
+	/* /nicklist [auto | full | lazy] */
+
+	static const char *policies[] = {
+		[NICKLIST_AUTO] = "auto",
+		[NICKLIST_FULL] = "full",
+		[NICKLIST_LAZY] = "lazy",
+	};
+
+	char *arg;
+	nicklist_t policy;
+
+	if (c->buffer_type != BUFFER_CHANNEL)
+		fail("Error: /nicklist is only available in channels");
+
+	if (!(arg = getarg(&mesg, " "))) {
+		newlinef(c, 0, "--", "Nicklist policy: %s, %s with %d users",
+				policies[c->nicklist_policy], (c->lazy ? "lazy" : "full"), c->nick_count);
+		return 0;
+	}
+
+	for (policy = 0; policy < NICKLIST_T_SIZE; policy++) {
+		if (!irc_strcmp(CASEMAPPING_ASCII, arg, policies[policy]))
+			break;
+	}
+
+	if (policy == NICKLIST_T_SIZE)
+		fail("Error: /nicklist [auto | full | lazy]");
+
+	nicklist_set_policy(c, policy);
+	newlinef(c, 0, "--", "Nicklist policy set to %s", policies[policy]);
+
+	draw(D_STATUS);
+
+	return 0;
+}
+
+static int
+send_notify(char *err, char *mesg, channel *c)
+{
+	/* /notify [nick[,nick]* ...] */
+
+	char *nick;
+	unsigned int limit;
+
+	if (!c->server)
+		fail("Error: Not connected to server");
+
+	if (!(nick = getarg(&mesg, " ,"))) {
+		watch_print(c);
+		return 0;
+	}
+
+	limit = ISUPPORT(c->server, nicklen, NICKSIZE);
+
+	do {
+		if (strlen(nick) > limit)
+			newlinef(c, 0, "-!!-", "Error: Nicks are limited to %u characters", limit);
+
+		else if (!watch_add(c->server, nick))
+			newlinef(c, 0, "-!!-", "Error: Already watching '%s'", nick);
+
+		else
+			newlinef(c, 0, "--", "Watching '%s'", nick);
+
+	} while ((nick = getarg(&mesg, " ,")));
+
+	return 0;
+}
+
 static int
 send_part(char *err, char *mesg, channel *c)
 {
@@ -480,9 +860,9 @@ send_part(char *err, char *mesg, channel *c)
 static int
 send_privmsg(char *err, char *mesg, channel *c)
 {
-	/* /(priv | msg) <target> <message> */
+	/* /(priv | msg) <target[,targets]*> <message> */
 
-	char *targ;
+	char *targ, *t;
 	channel *cc;
 
 	if (!(targ = getarg(&mesg, " ")))
@@ -491,11 +871,13 @@ send_privmsg(char *err, char *mesg, channel *c)
 	if (*mesg == '\0')
 		fail("Error: Private messages was null");
 
-	fail_if(sendf(err, c->server, "PRIVMSG %s :%s", targ, mesg));
+	fail_if(send_packed(err, c->server, targ, mesg, 0));
 
 	/* FIXME: wait.... cc? does newline go to cc then not c? is this true elsewhere?*/
-	if ((cc = channel_get(targ, c->server)) == NULL)
-		cc = new_channel(targ, c->server, c, BUFFER_PRIVATE);
+	while ((t = getarg(&targ, ","))) {
+		if ((cc = channel_get(t, c->server)) == NULL)
+			cc = new_channel(t, c->server, c, BUFFER_PRIVATE);
+	}
 
 	newline(c, LINE_CHAT, c->server->nick, mesg);
 
@@ -514,6 +896,30 @@ send_raw(char *err, char *mesg, channel *c)
 	return 0;
 }
 
+static int
+send_sort(char *err, char *mesg, channel *c)
+{
+	/* /sort [users | name] */
+
+	char *order;
+	directory_sort_t sort;
+
+	if (c->buffer_type != BUFFER_LIST)
+		fail("Error: /sort is only available in the /list buffer");
+
+	if (!(order = getarg(&mesg, " ")) || !irc_strcmp(CASEMAPPING_ASCII, order, "users"))
+		sort = DIRECTORY_SORT_USERS;
+	else if (!irc_strcmp(CASEMAPPING_ASCII, order, "name"))
+		sort = DIRECTORY_SORT_NAME;
+	else
+		fail("Error: /sort [users | name]");
+
+	directory_sort(c->directory, sort);
+	draw(D_BUFFER);
+
+	return 0;
+}
+
 static int
 send_topic(char *err, char *mesg, channel *c)
 {
@@ -532,21 +938,47 @@ send_topic(char *err, char *mesg, channel *c)
 static int
 send_unignore(char *err, char *mesg, channel *c)
 {
-	/* /unignore [nick] */
+	/* /unignore [nick | nick!user@host mask] */
 
-	char *nick;
+	char *mask;
 
 	if (!c->server)
 		fail("Error: Not connected to server");
 
-	if (!(nick = getarg(&mesg, " ")))
-		nicklist_print(c);
+	if (!(mask = getarg(&mesg, " ")))
+		ignore_print(c);
 
-	else if (!avl_del(&(c->server->ignore), nick))
-		failf("Error: '%s' not on ignore list", nick);
+	else if (!ignore_del(&(c->server->ignore), c->server->casemapping, mask))
+		failf("Error: '%s' not on ignore list", mask);
 
 	else
-		newlinef(c, 0, "--", "No longer ignoring '%s'", nick);
+		newlinef(c, 0, "--", "No longer ignoring '%s'", mask);
+
+	return 0;
+}
+
+static int
+send_unnotify(char *err, char *mesg, channel *c)
+{
+	/* /unnotify [nick[,nick]* ...] */
+
+	char *nick;
+
+	if (!c->server)
+		fail("Error: Not connected to server");
+
+	if (!(nick = getarg(&mesg, " ,"))) {
+		watch_print(c);
+		return 0;
+	}
+
+	do {
+		if (!watch_del(c->server, nick))
+			newlinef(c, 0, "-!!-", "Error: '%s' not on watch list", nick);
+		else
+			newlinef(c, 0, "--", "No longer watching '%s'", nick);
+
+	} while ((nick = getarg(&mesg, " ,")));
 
 	return 0;
 }
@@ -591,6 +1023,46 @@ send_version(char *err, char *mesg, channel *c)
 		return sendf(err, c->server, "VERSION");
 }
 
+static int
+send_whois(char *err, char *mesg, channel *c)
+{
+	/* /whois <nick> [nick]
+	 *
+	 * Users sharing a channel are described from the user cache once their
+	 * WHO reply is received, otherwise the server is queried. A second
+	 * argument always queries the server, eg: /whois nick nick */
+
+	char chans[BUFFSIZE], *nick, *targ;
+	int len = 0;
+	membership *m;
+	user *u;
+
+	if (!(nick = getarg(&mesg, " ")))
+		fail("Error: /whois <nick>");
+
+	if ((targ = getarg(&mesg, " ")))
+		return sendf(err, c->server, "WHOIS %s %s", nick, targ);
+
+	if (!c->server || !(u = user_get(c->server, nick)) || !u->realname)
+		return sendf(err, c->server, "WHOIS %s", nick);
+
+	newlinef(c, 0, "--", "%s is %s (%s)", u->nick, (u->hostinfo ? u->hostinfo : "*@*"), u->realname);
+
+	if (u->account)
+		newlinef(c, 0, "--", "%s is logged in as %s", u->nick, u->account);
+
+	if (u->away)
+		newlinef(c, 0, "--", "%s is away", u->nick);
+
+	for (m = u->memberships; m && len < (int)sizeof(chans); m = m->next)
+		len += snprintf(chans + len, sizeof(chans) - len, " %s", m->channel->name);
+
+	if (len)
+		newlinef(c, 0, "--", "%s is on%s", u->nick, chans);
+
+	return 0;
+}
+
 /*
  * Message receiving handlers
  * */
@@ -601,13 +1073,18 @@ void
 recv_mesg(char *inp, int count, server *s)
 {
 	char *ptr = s->iptr;
-	char *max = s->input + BUFFSIZE;
+	char *max = s->input + sizeof(s->input) - 1;
 
 	char errbuff[MAX_ERROR];
+	char hostinfo[BUFFSIZE];
 
 	int err = 0;
 
 	parsed_mesg p;
+	user *u;
+
+	const char *tag;
+	unsigned int held;
 
 	while (count--) {
 		if (*inp == '\r') {
@@ -620,48 +1097,270 @@ recv_mesg(char *inp, int count, server *s)
 #endif
 			if (!(parse(&p, s->input)))
 				newline(s->channel, 0, "-!!-", "Failed to parse message");
-			else if (isdigit(*p.command))
-				err = recv_numeric(errbuff, &p, s);
-			else if (!strcmp(p.command, "PRIVMSG"))
-				err = recv_priv(errbuff, &p, s);
-			else if (!strcmp(p.command, "JOIN"))
-				err = recv_join(errbuff, &p, s);
-			else if (!strcmp(p.command, "PART"))
-				err = recv_part(errbuff, &p, s);
-			else if (!strcmp(p.command, "QUIT"))
-				err = recv_quit(errbuff, &p, s);
-			else if (!strcmp(p.command, "NOTICE"))
-				err = recv_notice(errbuff, &p, s);
-			else if (!strcmp(p.command, "NICK"))
-				err = recv_nick(errbuff, &p, s);
-			else if (!strcmp(p.command, "PING"))
-				err = recv_ping(errbuff, &p, s);
-			else if (!strcmp(p.command, "PONG"))
-				err = recv_pong(errbuff, &p, s);
-			else if (!strcmp(p.command, "KICK"))
-				err = recv_kick(errbuff, &p, s);
-			else if (!strcmp(p.command, "MODE"))
-				err = recv_mode(errbuff, &p, s);
-			else if (!strcmp(p.command, "ERROR"))
-				err = recv_error(errbuff, &p, s);
-			else if (!strcmp(p.command, "TOPIC"))
-				err = recv_topic(errbuff, &p, s);
+			else {
+				/* Known users' hostinfo is kept current from message prefixes,
+				 * and filled in from the user cache where a prefix omits it.
+				 * It's copied since handlers can free the user */
+				if (p.from && (u = user_seen(s, p.from, p.hostinfo)) && !p.hostinfo && u->hostinfo) {
+					snprintf(hostinfo, sizeof(hostinfo), "%s", u->hostinfo);
+					p.hostinfo = hostinfo;
+				}
+
+				/* IRCv3 server-time of the message, used for its lines */
+				if (!(tag = mesg_tag(&p, "time")) || !parse_time(tag, &(s->mesg_time)))
+					s->mesg_time = 0;
+
+				s->batch = (tag = mesg_tag(&p, "batch")) ? batch_get(s, tag) : NULL;
+
+				/* Lines of messages played back to a buffer already holding
+				 * them are dropped by msgid */
+				if ((s->mesg_id = mesg_tag(&p, "msgid")))
+					s->mesg_seq++;
+
+				/* Redraws for batched messages are held until the batch is closed */
+				held = draw;
+				draw = 0;
+
+				if (isdigit(*p.command))
+					err = recv_numeric(errbuff, &p, s);
+				else if (!strcmp(p.command, "PRIVMSG"))
+					err = recv_priv(errbuff, &p, s);
+				else if (!strcmp(p.command, "JOIN"))
+					err = recv_join(errbuff, &p, s);
+				else if (!strcmp(p.command, "PART"))
+					err = recv_part(errbuff, &p, s);
+				else if (!strcmp(p.command, "QUIT"))
+					err = recv_quit(errbuff, &p, s);
+				else if (!strcmp(p.command, "NOTICE"))
+					err = recv_notice(errbuff, &p, s);
+				else if (!strcmp(p.command, "NICK"))
+					err = recv_nick(errbuff, &p, s);
+				else if (!strcmp(p.command, "PING"))
+					err = recv_ping(errbuff, &p, s);
+				else if (!strcmp(p.command, "PONG"))
+					err = recv_pong(errbuff, &p, s);
+				else if (!strcmp(p.command, "KICK"))
+					err = recv_kick(errbuff, &p, s);
+				else if (!strcmp(p.command, "MODE"))
+					err = recv_mode(errbuff, &p, s);
+				else if (!strcmp(p.command, "ERROR"))
+					err = recv_error(errbuff, &p, s);
+				else if (!strcmp(p.command, "TOPIC"))
+					err = recv_topic(errbuff, &p, s);
+				else if (!strcmp(p.command, "AWAY"))
+					err = recv_away(errbuff, &p, s);
+				else if (!strcmp(p.command, "BATCH"))
+					err = recv_batch(errbuff, &p, s);
+				else if (!strcmp(p.command, "CAP"))
+					err = recv_cap(errbuff, &p, s);
+				else if (!strcmp(p.command, "TAGMSG"))
+					err = 0; /* Tags only, eg: typing notifications */
+				else
+					newlinef(s->channel, 0, "-!!-", "Message type '%s' unknown", p.command);
+
+				if (s->batch) {
+					s->batch_draw |= draw;
+					draw = held;
+				} else {
+					draw |= held;
+				}
+
+				s->batch = NULL;
+				s->mesg_id = NULL;
+				s->mesg_time = 0;
+			}
+
+			if (err)
+				newlinef(s->channel, 0, "-!!-", "%s", errbuff);
+
+			ptr = s->input;
+
+		/* Don't accept unprintable characters unless space or ctcp markup */
+		} else if (ptr < max && (isgraph(*inp) || *inp == ' ' || *inp == 0x01))
+			*ptr++ = *inp;
+
+		inp++;
+	}
+
+	s->iptr = ptr;
+}
+
+static int
+recv_away(char *err, parsed_mesg *p, server *s)
+{
+	/* :nick!user@hostname.domain AWAY [:message]
+	 *
+	 * Sent with away-notify when a user sharing a channel is marked away or back */
+
+	user *u;
+
+	if (!p->from)
+		fail("AWAY: sender's nick is null");
+
+	if ((u = user_get(s, p->from)))
+		u->away = (p->trailing && *p->trailing);
+
+	return 0;
+}
+
+static int
+recv_batch(char *err, parsed_mesg *p, server *s)
+{
+	/* BATCH +<reference> <type> [params]
+	 * BATCH -<reference> */
+
+	char *ref, *type;
+	channel *c;
+	struct batch *b;
+
+	if (!(ref = getarg(&p->params, " ")))
+		fail("BATCH: reference is null");
+
+	if (*ref == '+') {
+
+		if (!(type = getarg(&p->params, " ")))
+			fail("BATCH: type is null");
+
+		if (!batch_open(s, ref + 1, type, getarg(&p->params, " ")))
+			failf("BATCH: '%s' already open", ref + 1);
+
+		return 0;
+	}
+
+	if (*ref == '-') {
+
+		if (!(b = batch_get(s, ref + 1)))
+			failf("BATCH: '%s' not open", ref + 1);
+
+		/* BATCH +<reference> chathistory <target>, a reply to a CHATHISTORY request */
+		if (!strcmp(b->type, "chathistory") && (c = channel_get(b->target, s)) && c->history == REQUEST_SENT)
+			c->history = REQUEST_DONE;
+
+		batch_close(s, ref + 1);
+
+		return 0;
+	}
+
+	failf("BATCH: invalid reference '%s'", ref);
+}
+
+static int
+recv_cap(char *err, parsed_mesg *p, server *s)
+{
+	/* CAP <target> LS [*] :<capabilities>
+	 * CAP <target> ACK :<capabilities>
+	 * CAP <target> NAK :<capabilities>
+	 * CAP <target> NEW :<capabilities>
+	 * CAP <target> DEL :<capabilities>
+	 *
+	 * Capabilities offered by CAP LS are requested once all are listed, and
+	 * registration ends when the request is acknowledged or refused. With
+	 * CAP LS 302, capabilities can also be offered or withdrawn at any time
+	 * with CAP NEW and CAP DEL */
+
+	char *cmd, *cap, *caps;
+	int i;
+
+	if (!getarg(&p->params, " "))
+		fail("CAP: target is null");
+
+	if (!(cmd = getarg(&p->params, " ")))
+		fail("CAP: subcommand is null");
+
+	caps = p->trailing;
+
+	if (!strcmp(cmd, "LS") || !strcmp(cmd, "NEW")) {
+
+		while ((cap = getarg(&caps, " "))) {
+			if ((i = cap_get(cap)) >= 0 && !(s->caps & (1u << i)))
+				s->caps_ls |= (1u << i);
+		}
+
+		/* CAP LS * :<capabilities>, more lines to follow */
+		if (!strcmp(cmd, "LS") && (cap = getarg(&p->params, " ")) && !strcmp(cap, "*"))
+			return 0;
+
+		if (s->caps_ls)
+			return cap_req(err, s);
+
+		if (!strcmp(cmd, "LS") && s->registering) {
+			s->registering = 0;
+			return sendf(err, s, "CAP END");
+		}
+
+		return 0;
+	}
+
+	if (!strcmp(cmd, "ACK") || !strcmp(cmd, "DEL")) {
+
+		while ((cap = getarg(&caps, " "))) {
+
+			int set = (*cmd == 'A' && *cap != '-');
+
+			if (*cap == '-')
+				cap++;
+
+			if ((i = cap_get(cap)) < 0)
+				continue;
+
+			if (set)
+				s->caps |= (1u << i);
 			else
-				newlinef(s->channel, 0, "-!!-", "Message type '%s' unknown", p.command);
+				s->caps &= ~(1u << i);
+		}
+
+		if (!strcmp(cmd, "DEL"))
+			return 0;
+	}
+
+	else if (strcmp(cmd, "NAK"))
+		failf("CAP: unknown subcommand '%s'", cmd);
+
+	else if (p->trailing)
+		newlinef(s->channel, 0, "-!!-", "CAP: refused '%s'", p->trailing);
+
+	/* Registration is suspended until CAP END, later requests are from CAP NEW */
+	if (s->registering) {
+		s->registering = 0;
+		return sendf(err, s, "CAP END");
+	}
+
+	return 0;
+}
+
+static int
+cap_get(const char *str)
+{
+	/* Returns the cap_t of a capability, with CAP LS 302 values, eg: sasl=PLAIN,
+	 * or -1 if it isn't requested by rirc */
 
-			if (err)
-				newlinef(s->channel, 0, "-!!-", "%s", errbuff);
+	size_t len = strcspn(str, "=");
+	int i;
 
-			ptr = s->input;
+	for (i = 0; i < CAP_T_SIZE; i++) {
+		if (!strncmp(str, cap_names[i], len) && cap_names[i][len] == '\0')
+			return i;
+	}
 
-		/* Don't accept unprintable characters unless space or ctcp markup */
-		} else if (ptr < max && (isgraph(*inp) || *inp == ' ' || *inp == 0x01))
-			*ptr++ = *inp;
+	return -1;
+}
 
-		inp++;
+static int
+cap_req(char *err, server *s)
+{
+	/* Request the capabilities offered by CAP LS or CAP NEW */
+
+	char buf[BUFFSIZE];
+	int i, len = 0;
+
+	for (i = 0; i < CAP_T_SIZE; i++) {
+		if (s->caps_ls & (1u << i))
+			len += snprintf(buf + len, sizeof(buf) - len, "%s%s", (len ? " " : ""), cap_names[i]);
 	}
 
-	s->iptr = ptr;
+	s->caps_ls = 0;
+
+	return sendf(err, s, "CAP REQ :%s", buf);
 }
 
 static int
@@ -674,12 +1373,13 @@ recv_ctcp_req(char *err, parsed_mesg *p, server *s)
 	 * NOTICE <target> :0x01<reply>0x01 */
 
 	char *targ, *cmd, *mesg;
+	flood_t kind;
 
 	if (!p->from)
 		fail("CTCP: sender's nick is null");
 
 	/* CTCP request from ignored user, do nothing */
-	if (avl_get(ccur->server->ignore, p->from, strlen(p->from)))
+	if (ignore_match(&(s->ignore), s->casemapping, p->from, p->hostinfo))
 		return 0;
 
 	if (!(targ = getarg(&p->params, " ")))
@@ -692,6 +1392,15 @@ recv_ctcp_req(char *err, parsed_mesg *p, server *s)
 	if (!(cmd = getarg(&mesg, " ")))
 		fail("CTCP: command is null");
 
+	/* Floods are dropped before any reply is sent or buffer created */
+	if (strcmp(cmd, "ACTION"))
+		kind = FLOOD_CTCP;
+	else
+		kind = IS_ME(targ) ? FLOOD_PRIVATE : FLOOD_MESG;
+
+	if (check_flood(p, s, (IS_ME(targ) ? NULL : channel_get(targ, s)), kind))
+		return 0;
+
 	/* Handle the CTCP request if supported */
 
 	if (!strcmp(cmd, "ACTION")) {
@@ -711,6 +1420,9 @@ recv_ctcp_req(char *err, parsed_mesg *p, server *s)
 		} else if ((c = channel_get(targ, s)) == NULL)
 			failf("CTCP ACTION: channel '%s' not found", targ);
 
+		if (c->buffer_type == BUFFER_CHANNEL)
+			speaker_add(c, p->from);
+
 		newlinef(c, 0, "*", "%s %s", p->from, mesg);
 
 		return 0;
@@ -779,7 +1491,7 @@ recv_ctcp_req(char *err, parsed_mesg *p, server *s)
 }
 
 static int
-recv_ctcp_rpl(char *err, parsed_mesg *p)
+recv_ctcp_rpl(char *err, parsed_mesg *p, server *s)
 {
 	/* CTCP replies:
 	 * NOTICE <target> :0x01<command> <arguments>0x01 */
@@ -790,7 +1502,10 @@ recv_ctcp_rpl(char *err, parsed_mesg *p)
 		fail("CTCP: sender's nick is null");
 
 	/* CTCP reply from ignored user, do nothing */
-	if (avl_get(ccur->server->ignore, p->from, strlen(p->from)))
+	if (ignore_match(&(s->ignore), s->casemapping, p->from, p->hostinfo))
+		return 0;
+
+	if (check_flood(p, s, NULL, FLOOD_PRIVATE))
 		return 0;
 
 	if (!(mesg = getarg(&p->trailing, "\x01")))
@@ -817,6 +1532,91 @@ recv_error(char *err, parsed_mesg *p, server *s)
 	return 0;
 }
 
+static int
+recv_isupport(char *err, parsed_mesg *p, server *s)
+{
+	/* 005 1*13( ["-"]<parameter>[=<value>] ) :Are supported by this server
+	 *
+	 * Parse the server specific configuration used by rirc. A parameter
+	 * prefixed with '-' resets it to its default value */
+
+	char *param, *val;
+	int unset;
+
+	UNUSED(err);
+
+	while ((param = getarg(&p->params, " "))) {
+
+		if ((unset = (*param == '-')))
+			param++, val = NULL;
+		else if ((val = strchr(param, '=')))
+			*val++ = '\0';
+
+		if (!strcmp(param, "CASEMAPPING"))
+			server_set_casemapping(s, val ? casemapping_get(val) : CASEMAPPING_RFC1459);
+
+		else if (!strcmp(param, "CHANMODES") && !server_set_chanmodes(s, val))
+			newlinef(s->channel, 0, "-!!-", "RPL_ISUPPORT: invalid CHANMODES '%s'", val);
+
+		else if (!strcmp(param, "PREFIX") && !server_set_prefix(s, val))
+			newlinef(s->channel, 0, "-!!-", "RPL_ISUPPORT: invalid PREFIX '%s'", val);
+
+		else if (!strcmp(param, "WHOX"))
+			s->whox = !unset;
+
+		else if (!strcmp(param, "CHATHISTORY"))
+			s->history_max = (val ? strtoul(val, NULL, 10) : 0);
+
+		else if (!strcmp(param, "LINELEN"))
+			s->isupport.linelen = (val ? strtoul(val, NULL, 10) : 0);
+
+		else if (!strcmp(param, "NICKLEN"))
+			s->isupport.nicklen = (val ? strtoul(val, NULL, 10) : 0);
+
+		else if (!strcmp(param, "CHANNELLEN"))
+			s->isupport.channellen = (val ? strtoul(val, NULL, 10) : 0);
+
+		else if (!strcmp(param, "USERLEN"))
+			s->isupport.userlen = (val ? strtoul(val, NULL, 10) : 0);
+
+		else if (!strcmp(param, "HOSTLEN"))
+			s->isupport.hostlen = (val ? strtoul(val, NULL, 10) : 0);
+
+		else if (!strcmp(param, "MAXTARGETS"))
+			s->isupport.maxtargets = (val ? strtoul(val, NULL, 10) : 0);
+
+		else if (!strcmp(param, "TARGMAX"))
+			isupport_targmax(s, val);
+
+		else if (!strcmp(param, "MONITOR"))
+			s->isupport.monitor = unset ? 0 : (val && *val) ? strtoul(val, NULL, 10) : UINT_MAX;
+	}
+
+	return 0;
+}
+
+static void
+isupport_targmax(server *s, char *val)
+{
+	/* TARGMAX=<command>:[limit]{,<command>:[limit]}
+	 *
+	 * Commands without a limit take any number of targets, and commands
+	 * not listed only one */
+
+	char *cmd, *limit;
+
+	s->isupport.targmax_privmsg = (val ? 1 : 0);
+
+	while ((cmd = getarg(&val, ","))) {
+
+		if ((limit = strchr(cmd, ':')))
+			*limit++ = '\0';
+
+		if (!strcmp(cmd, "PRIVMSG"))
+			s->isupport.targmax_privmsg = (limit && *limit) ? strtoul(limit, NULL, 10) : UINT_MAX;
+	}
+}
+
 static int
 recv_join(char *err, parsed_mesg *p, server *s)
 {
@@ -833,24 +1633,31 @@ recv_join(char *err, parsed_mesg *p, server *s)
 
 	if (IS_ME(p->from)) {
 		if ((c = channel_get(chan, s)) == NULL)
-			channel_set_current(new_channel(chan, s, ccur, BUFFER_CHANNEL));
+			channel_set_current((c = new_channel(chan, s, ccur, BUFFER_CHANNEL)));
 		else {
 			c->parted = 0;
 			newlinef(c, 0, ">", "You have rejoined %s", chan);
+
+			/* Play back what was missed since the newest line with a server-time */
+			if ((s->caps & (1u << CAP_CHATHISTORY)) && c->server_time)
+				c->history = REQUEST_QUEUED;
 		}
+
+		/* Members' info is loaded in bulk, see requests_flush() */
+		c->who = REQUEST_QUEUED;
+
 		draw(D_FULL);
 	} else {
 
 		if ((c = channel_get(chan, s)) == NULL)
 			failf("JOIN: channel '%s' not found", chan);
 
-		if (!avl_add(&(c->nicklist), p->from, NULL))
+		if (!nicklist_add(c, p->from, p->hostinfo))
 			failf("JOIN: nick '%s' already in '%s'", p->from, chan);
 
-		c->nick_count++;
-
-		if (c->nick_count < config.join_part_quit_threshold)
-			newlinef(c, 0, ">", "%s!%s has joined %s", p->from, p->hostinfo, chan);
+		/* Users rejoining after a netsplit are counted, and printed once */
+		if (!netsplit_join(c, p->from) && show_member(c, p->from))
+			newevent(c, EVENT_JOIN, p->from, p->hostinfo, chan, NULL);
 
 		draw(D_STATUS);
 	}
@@ -896,11 +1703,9 @@ recv_kick(char *err, parsed_mesg *p, server *s)
 			newlinef(c, 0, "--", "You've been kicked by %s", p->from, user);
 	} else {
 
-		if (!avl_del(&c->nicklist, user))
+		if (!nicklist_del(c, user))
 			failf("KICK: nick '%s' not found in '%s'", user, chan);
 
-		c->nick_count--;
-
 		if (p->trailing)
 			newlinef(c, 0, "--", "%s has kicked %s (%s)", p->from, user, p->trailing);
 		else
@@ -919,15 +1724,16 @@ recv_mode(char *err, parsed_mesg *p, server *s)
 
 	channel *c;
 	char *targ;
+	membership *m;
+	user *u;
 
 	if (!(targ = getarg(&p->params, " ")))
 		fail("MODE: target is null");
 
-	/* If the target channel isn't found,  */
 	if (IS_ME(targ))
 		c = s->channel;
-	else
-		c = channel_get(targ, s);
+	else if ((c = channel_get(targ, s)))
+		return recv_mode_channel(err, p, s, c, targ);
 
 	char *modes, *modeparams, *modetmp = NULL;
 
@@ -949,12 +1755,9 @@ recv_mode(char *err, parsed_mesg *p, server *s)
 		else
 			modetmp = NULL;
 
-		/* Having c set means the target is the server modes or a specific channel's modes */
+		/* Having c set means the target is the server modes */
 		if (c) {
-			if (IS_ME(targ))
-				server_set_mode(s, modes);
-			else
-				channel_set_mode(c, modes);
+			server_set_mode(s, modes);
 
 			/* [<user> set ]<target> mode: [<mode>][ <modeparams>] */
 			newlinef(c, 0, "--", "%s%s%s mode: [%s%s%s]",
@@ -965,25 +1768,83 @@ recv_mode(char *err, parsed_mesg *p, server *s)
 				(modeparams ? " " : ""),
 				(modeparams ? modeparams : "")
 			);
-		} else {
+		} else if ((u = user_get(s, targ))) {
+
+			/* If the channel isn't found, the target is a user, print to all
+			 * channels the user is a member of */
+			for (m = u->memberships; m; m = m->next)
+				/* [<user> set ]<target> mode: [<mode>][ <modeparams>] */
+				newlinef(m->channel, 0, "--", "%s%s%s mode: [%s%s%s]",
+					(p->from ? p->from : ""),
+					(p->from ? " set " : ""),
+					targ,
+					modes,
+					(modeparams ? " " : ""),
+					(modeparams ? modeparams : "")
+				);
+		}
+	}
 
-			/* If the channel isn't found, search for the target as a user in all channels
-			 * and print where found */
-			c = s->channel;
+	return 0;
+}
 
-			do {
-				if (avl_get(c->nicklist, targ, strlen(targ)))
-					/* [<user> set ]<target> mode: [<mode>][ <modeparams>] */
-					newlinef(c, 0, "--", "%s%s%s mode: [%s%s%s]",
-						(p->from ? p->from : ""),
-						(p->from ? " set " : ""),
-						targ,
-						modes,
-						(modeparams ? " " : ""),
-						(modeparams ? modeparams : "")
-					);
-			} while ((c = c->next) != s->channel);
+static int
+recv_mode_channel(char *err, parsed_mesg *p, server *s, channel *c, char *targ)
+{
+	/* :nick!user@hostname.domain MODE <channel> ( "-" / "+" ) *<modes> *<modeparams>
+	 *
+	 * Prefix modes (eg: +o <nick>) update the membership of the user in the
+	 * channel, list modes (eg: +b <mask>) are only printed and all other modes
+	 * are set on the channel. Whether a mode takes a modeparam is given by
+	 * the server's CHANMODES */
+
+	char *modes, *param, pm = 0;
+	uint64_t bit;
+
+	if (!(modes = getarg(&p->params, " ")) && !(modes = getarg(&p->trailing, " ")))
+		fail("MODE: modes are null");
+
+	if (!(*modes == '+') && !(*modes == '-'))
+		fail("MODE: invalid mode format");
+
+	/* [<user> set ]<target> mode: [<mode>][ <modeparams>] */
+	newlinef(c, 0, "--", "%s%s%s mode: [%s%s%s%s%s]",
+		(p->from ? p->from : ""),
+		(p->from ? " set " : ""),
+		targ,
+		modes,
+		(p->params && *p->params ? " " : ""),
+		(p->params ? p->params : ""),
+		(p->trailing && *p->trailing ? " " : ""),
+		(p->trailing ? p->trailing : "")
+	);
+
+	for (; *modes; modes++) {
+
+		if (*modes == '+' || *modes == '-') {
+			pm = *modes;
+			continue;
+		}
+
+		bit = mode_bit(*modes);
+
+		/* The last modeparam is sent in the trailing by some servers */
+		if (strchr(s->prefix_modes, *modes)
+		 || (bit & (s->chanmodes.A | s->chanmodes.B))
+		 || ((bit & s->chanmodes.C) && pm == '+')) {
+			if (!(param = getarg(&p->params, " ")))
+				param = getarg(&p->trailing, " ");
+		} else {
+			param = NULL;
 		}
+
+		if (strchr(s->prefix_modes, *modes)) {
+			if (param)
+				nicklist_set_prefix(c, param, *modes, (pm == '+'));
+		}
+
+		else if (!(bit & s->chanmodes.A))
+			channel_set_mode(c, *modes, (pm == '+'), param);
 	}
 
 	return 0;
@@ -995,6 +1856,9 @@ recv_nick(char *err, parsed_mesg *p, server *s)
 	/* :nick!user@hostname.domain NICK [:]<new nick> */
 
 	char *nick;
+	channel *c;
+	membership *m;
+	user *u;
 
 	if (!p->from)
 		fail("NICK: old nick is null");
@@ -1008,14 +1872,24 @@ recv_nick(char *err, parsed_mesg *p, server *s)
 		newlinef(s->channel, 0, "--", "You are now known as %s", nick);
 	}
 
-	channel *c = s->channel;
+	u = user_set_nick(s, p->from, nick);
+
+	/* Lazy nicklists only know their recent speakers */
+	c = s->channel;
 	do {
-		if (avl_del(&c->nicklist, p->from)) {
-			avl_add(&c->nicklist, nick, NULL);
-			newlinef(c, 0, "--", "%s  >>  %s", p->from, nick);
-		}
+		if (c->lazy && speaker_recent(c, nick))
+			newevent(c, EVENT_NICK, p->from, NULL, NULL, nick);
 	} while ((c = c->next) != s->channel);
 
+	/* Only the channels the user is a member of are affected */
+	if (u == NULL)
+		return 0;
+
+	for (m = u->memberships; m; m = m->next) {
+		if (!m->channel->lazy && show_member(m->channel, nick))
+			newevent(m->channel, EVENT_NICK, p->from, NULL, NULL, nick);
+	}
+
 	return 0;
 }
 
@@ -1032,22 +1906,32 @@ recv_notice(char *err, parsed_mesg *p, server *s)
 
 	/* CTCP reply */
 	if (*p->trailing == 0x01)
-		return recv_ctcp_rpl(err, p);
+		return recv_ctcp_rpl(err, p, s);
 
 	if (!p->from)
 		fail("NOTICE: sender's nick is null");
 
 	/* Notice from ignored user, do nothing */
-	if (avl_get(ccur->server->ignore, p->from, strlen(p->from)))
+	if (ignore_match(&(s->ignore), s->casemapping, p->from, p->hostinfo))
 		return 0;
 
 	if (!(targ = getarg(&p->params, " ")))
 		fail("NOTICE: target is null");
 
-	if ((c = channel_get(targ, s)))
+	if ((c = channel_get(targ, s)) == NULL)
+		c = s->channel;
+
+	if (check_flood(p, s, c, (IS_ME(targ) ? FLOOD_PRIVATE : FLOOD_MESG)))
+		return 0;
+
+	if (check_pinged(s, p->trailing)) {
+
+		if (c != ccur)
+			c->active = ACTIVITY_PINGED;
+
+		newline(c, LINE_PINGED, p->from, p->trailing);
+	} else
 		newline(c, 0, p->from, p->trailing);
-	else
-		newline(s->channel, 0, p->from, p->trailing);
 
 	return 0;
 }
@@ -1059,7 +1943,8 @@ recv_numeric(char *err, parsed_mesg *p, server *s)
 
 	channel *c;
 	char *targ, *nick, *chan, *time, *type, *num;
-	int code;
+	char *token, *user, *host, *flags, *account, *realname;
+	int code, loading;
 
 	/* Extract numeric code */
 	for (code = 0; isdigit(*p->command); p->command++) {
@@ -1131,12 +2016,17 @@ recv_numeric(char *err, parsed_mesg *p, server *s)
 
 
 	case RPL_MYINFO:    /* 004 <params> :Are supported by this server */
-	case RPL_ISUPPORT:  /* 005 <params> :Are supported by this server */
 
 		newlinef(s->channel, 0, "--", "%s ~ supported by this server", p->params);
 		return 0;
 
 
+	case RPL_ISUPPORT:  /* 005 <params> :Are supported by this server */
+
+		newlinef(s->channel, 0, "--", "%s ~ supported by this server", p->params);
+		return recv_isupport(err, p, s);
+
+
 	default:
 
 		newlinef(s->channel, 0, "UNHANDLED", "%d %s :%s", code, p->params, p->trailing);
@@ -1161,6 +2051,107 @@ num_200:
 		return 0;
 
 
+	/* 315 <mask> :End of WHO list */
+	case RPL_ENDOFWHO:
+
+		if (!(chan = getarg(&p->params, " ")))
+			fail("RPL_ENDOFWHO: mask is null");
+
+		if ((c = channel_get(chan, s)) && c->who == REQUEST_SENT) {
+			c->who = REQUEST_DONE;
+			return 0;
+		}
+
+		newlinef(s->channel, 0, "--", "%s", (p->trailing ? p->trailing : "End of WHO list"));
+		return 0;
+
+
+	/* 352 <channel> <user> <host> <server> <nick> <flags> :<hopcount> <realname> */
+	case RPL_WHOREPLY:
+
+		if (!(chan = getarg(&p->params, " "))
+		 || !(user = getarg(&p->params, " "))
+		 || !(host = getarg(&p->params, " "))
+		 || !getarg(&p->params, " ")
+		 || !(nick = getarg(&p->params, " "))
+		 || !(flags = getarg(&p->params, " ")))
+			fail("RPL_WHOREPLY: invalid reply");
+
+		getarg(&p->trailing, " ");
+
+		realname = (p->trailing ? p->trailing : "");
+
+		return recv_who(s, chan, nick, user, host, flags, NULL, realname, 0);
+
+
+	/* 354 <token> <channel> <user> <host> <nick> <flags> <account> :<realname> */
+	case RPL_WHOSPCRPL:
+
+		if (!(token = getarg(&p->params, " ")))
+			fail("RPL_WHOSPCRPL: token is null");
+
+		/* Not a reply to a bulk WHO request */
+		if (strcmp(token, WHOX_TOKEN)) {
+			newlinef(s->channel, 0, "--", "%s %s", p->params, (p->trailing ? p->trailing : ""));
+			return 0;
+		}
+
+		if (!(chan = getarg(&p->params, " "))
+		 || !(user = getarg(&p->params, " "))
+		 || !(host = getarg(&p->params, " "))
+		 || !(nick = getarg(&p->params, " "))
+		 || !(flags = getarg(&p->params, " "))
+		 || !(account = getarg(&p->params, " ")))
+			fail("RPL_WHOSPCRPL: invalid reply");
+
+		realname = (p->trailing ? p->trailing : "");
+
+		/* An account of 0 isn't logged in */
+		if (!strcmp(account, "0"))
+			account = NULL;
+
+		return recv_who(s, chan, nick, user, host, flags, account, realname, 1);
+
+
+	/* 321 Channel :Users  Name */
+	case RPL_LISTSTART:
+
+		directory_open(s);
+		return 0;
+
+
+	/* 322 <channel> <users> :[topic] */
+	case RPL_LIST:
+
+		if (!(chan = getarg(&p->params, " ")))
+			fail("RPL_LIST: channel is null");
+
+		if (!(num = getarg(&p->params, " ")))
+			fail("RPL_LIST: user count is null");
+
+		c = directory_get(s);
+
+		directory_add(c->directory, chan, strtoul(num, NULL, 10), (p->trailing ? p->trailing : ""));
+
+		/* Only the rows in view are drawn, once per redraw */
+		if (c == ccur)
+			draw(D_BUFFER);
+
+		return 0;
+
+
+	/* 323 :End of LIST */
+	case RPL_LISTEND:
+
+		c = directory_get(s);
+		c->directory->complete = 1;
+
+		if (c == ccur)
+			draw(D_BUFFER);
+
+		return 0;
+
+
 	/* 332 <channel> :<topic> */
 	case RPL_TOPIC:
 
@@ -1211,14 +2202,48 @@ num_200:
 
 		c->type_flag = *type;
 
+		/* Nicks are staged and added to the nicklist in bulk at RPL_ENDOFNAMES.
+		 *
+		 * With multi-prefix, all of a user's prefixes precede the nick */
 		while ((nick = getarg(&p->trailing, " "))) {
-			if (*nick == '@' || *nick == '+')
-				nick++;
-			if (avl_add(&c->nicklist, nick, NULL))
-				c->nick_count++;
+
+			unsigned char prefix = 0;
+			const char *pc;
+
+			for (; *nick && (pc = strchr(s->prefix_chars, *nick)); nick++)
+				prefix |= (1 << (pc - s->prefix_chars));
+
+			nicklist_stage(c, nick, prefix);
 		}
 
-		draw(D_STATUS);
+		return 0;
+
+
+	case RPL_ENDOFNAMES:  /* 366 <chan> :<Message> */
+
+		if (!(chan = getarg(&p->params, " ")))
+			fail("RPL_ENDOFNAMES: channel is null");
+
+		if ((c = channel_get(chan, s)) == NULL)
+			failf("RPL_ENDOFNAMES: channel '%s' not found", chan);
+
+		/* Lazy nicklists loaded on demand or recounted aren't printed, unless
+		 * loaded for /names */
+		loading = (c->lazy && (c->load == REQUEST_SENT || c->count == REQUEST_SENT));
+
+		if (c->count == REQUEST_SENT)
+			c->count = REQUEST_DONE;
+
+		nicklist_commit(c);
+
+		if (c->load_print && !c->lazy) {
+			c->load_print = 0;
+			loading = 0;
+		}
+
+		if (!loading)
+			nicklist_print(c);
+
 		return 0;
 
 
@@ -1250,10 +2275,24 @@ num_200:
 		return 0;
 
 
+	/* 303 :<nick>{ <nick>} */
+	case RPL_ISON:
+
+		if (!watch_ison(s, (p->trailing ? p->trailing : "")))
+			newlinef(s->channel, 0, "--", "Online: %s", (p->trailing ? p->trailing : ""));
+
+		return 0;
+
+
+	case RPL_ENDOFMOTD:   /* 376 :End of MOTD command */
+
+		/* Registration is complete, watched nicks are sent */
+		s->watch.ready = 1;
+		return 0;
+
+
 	/* Not printing these */
 	case RPL_NOTOPIC:     /* 331 <chan> :<Message> */
-	case RPL_ENDOFNAMES:  /* 366 <chan> :<Message> */
-	case RPL_ENDOFMOTD:   /* 376 :End of MOTD command */
 		return 0;
 
 
@@ -1284,6 +2323,15 @@ num_400:
 		return 0;
 
 
+	case ERR_NOMOTD:  /* 422 :MOTD File is missing */
+
+		newline(s->channel, 0, "--", p->trailing);
+
+		/* Registration is complete, watched nicks are sent */
+		s->watch.ready = 1;
+		return 0;
+
+
 	case ERR_ERRONEUSNICKNAME:  /* 432 <nick> :<reason> */
 
 		if (!(nick = getarg(&p->params, " ")))
@@ -1309,6 +2357,52 @@ num_400:
 		return 0;
 
 
+	/* 730 :<target>[!<user>@<host>]{,<target>[!<user>@<host>]} */
+	case RPL_MONONLINE:
+
+		while ((nick = getarg(&p->trailing, ","))) {
+
+			if ((host = strchr(nick, '!')))
+				*host++ = 0;
+
+			watch_presence(s, nick, host, PRESENCE_ONLINE);
+		}
+		return 0;
+
+
+	/* 731 :<target>{,<target>} */
+	case RPL_MONOFFLINE:
+
+		while ((nick = getarg(&p->trailing, ",")))
+			watch_presence(s, nick, NULL, PRESENCE_OFFLINE);
+
+		return 0;
+
+
+	/* 732 :<target>{,<target>} */
+	case RPL_MONLIST:
+
+		newlinef(s->channel, 0, "--", "Monitoring: %s", (p->trailing ? p->trailing : ""));
+		return 0;
+
+
+	/* 733 :End of MONITOR list */
+	case RPL_ENDOFMONLIST:
+		return 0;
+
+
+	/* 734 <limit> <targets> :Monitor list is full */
+	case ERR_MONLISTFULL:
+
+		if (!(num = getarg(&p->params, " ")) || !(targ = getarg(&p->params, " ")))
+			fail("ERR_MONLISTFULL: invalid reply");
+
+		watch_unmonitor(s, targ);
+
+		newlinef(s->channel, 0, "--", "MONITOR list is full (%s), polling the rest of the watch list", num);
+		return 0;
+
+
 	default:
 
 		newlinef(s->channel, 0, "UNHANDLED", "%d %s :%s", code, p->params, p->trailing);
@@ -1325,6 +2419,7 @@ recv_part(char *err, parsed_mesg *p, server *s)
 
 	char *targ;
 	channel *c;
+	int show;
 
 	if (!p->from)
 		fail("PART: sender's nick is null");
@@ -1353,17 +2448,13 @@ recv_part(char *err, parsed_mesg *p, server *s)
 	if ((c = channel_get(targ, s)) == NULL)
 		failf("PART: channel '%s' not found", targ);
 
-	if (!avl_del(&c->nicklist, p->from))
-		failf("PART: nick '%s' not found in '%s'", p->from, targ);
+	show = show_member(c, p->from);
 
-	c->nick_count--;
+	if (!nicklist_del(c, p->from))
+		failf("PART: nick '%s' not found in '%s'", p->from, targ);
 
-	if (c->nick_count < config.join_part_quit_threshold) {
-		if (p->trailing)
-			newlinef(c, 0, "<", "%s!%s has left %s (%s)", p->from, p->hostinfo, targ, p->trailing);
-		else
-			newlinef(c, 0, "<", "%s!%s has left %s", p->from, p->hostinfo, targ);
-	}
+	if (show)
+		newevent(c, EVENT_PART, p->from, p->hostinfo, targ, p->trailing);
 
 	draw(D_STATUS);
 
@@ -1416,25 +2507,36 @@ recv_priv(char *err, parsed_mesg *p, server *s)
 		fail("PRIVMSG: sender's nick is null");
 
 	/* Privmesg from ignored user, do nothing */
-	if (avl_get(ccur->server->ignore, p->from, strlen(p->from)))
+	if (ignore_match(&(s->ignore), s->casemapping, p->from, p->hostinfo))
 		return 0;
 
 	if (!(targ = getarg(&p->params, " ")))
 		fail("PRIVMSG: target is null");
 
-	/* Find the target channel */
+	/* Find the target channel, private floods are dropped before opening a buffer */
 	if (IS_ME(targ)) {
 
-		if ((c = channel_get(p->from, s)) == NULL)
+		c = channel_get(p->from, s);
+
+		if (check_flood(p, s, c, FLOOD_PRIVATE))
+			return 0;
+
+		if (c == NULL)
 			c = new_channel(p->from, s, s->channel, BUFFER_PRIVATE);
 
 		if (c != ccur)
 			c->active = ACTIVITY_PINGED;
 
-	} else if ((c = channel_get(targ, s)) == NULL)
+	} else if ((c = channel_get(targ, s)) == NULL) {
 		failf("PRIVMSG: channel '%s' not found", targ);
+	} else if (check_flood(p, s, c, FLOOD_MESG)) {
+		return 0;
+	}
 
-	if (check_pinged(p->trailing, s->nick)) {
+	if (c->buffer_type == BUFFER_CHANNEL)
+		speaker_add(c, p->from);
+
+	if (check_pinged(s, p->trailing)) {
 
 		if (c != ccur)
 			c->active = ACTIVITY_PINGED;
@@ -1451,22 +2553,48 @@ recv_quit(char *err, parsed_mesg *p, server *s)
 {
 	/* :nick!user@hostname.domain QUIT [:message] */
 
+	channel *c;
+	membership *m, *next;
+	user *u;
+
 	if (!p->from)
 		fail("QUIT: sender's nick is null");
 
-	channel *c = s->channel;
+	/* Lazy nicklists only know their recent speakers */
+	c = s->channel;
 	do {
-		if (avl_del(&c->nicklist, p->from)) {
-			c->nick_count--;
-			if (c->nick_count < config.join_part_quit_threshold) {
-				if (p->trailing)
-					newlinef(c, 0, "<", "%s!%s has quit (%s)", p->from, p->hostinfo, p->trailing);
-				else
-					newlinef(c, 0, "<", "%s!%s has quit", p->from, p->hostinfo);
-			}
+		if (c->lazy && speaker_recent(c, p->from)) {
+
+			nicklist_del(c, p->from);
+
+			if (!netsplit_quit(c, p->from, p->trailing))
+				newevent(c, EVENT_QUIT, p->from, p->hostinfo, NULL, p->trailing);
 		}
-		c = c->next;
-	} while (c != s->channel);
+	} while ((c = c->next) != s->channel);
+
+	watch_presence(s, p->from, NULL, PRESENCE_OFFLINE);
+
+	/* Only the channels the user is a member of are affected */
+	if ((u = user_get(s, p->from)) == NULL) {
+		draw(D_STATUS);
+		return 0;
+	}
+
+	/* The user is freed along with its last membership, unless watched */
+	for (m = u->memberships; m; m = next) {
+
+		c = m->channel;
+		next = m->next;
+
+		nicklist_del(c, p->from);
+
+		/* Users quitting in a netsplit are counted, and printed once */
+		if (netsplit_quit(c, p->from, p->trailing))
+			continue;
+
+		if (show_member(c, p->from))
+			newevent(c, EVENT_QUIT, p->from, p->hostinfo, NULL, p->trailing);
+	}
 
 	draw(D_STATUS);
 
@@ -1502,3 +2630,25 @@ recv_topic(char *err, parsed_mesg *p, server *s)
 
 	return 0;
 }
+
+static int
+recv_who(server *s, char *chan, char *nick, char *user, char *host, char *flags, char *account, char *realname, int whox)
+{
+	/* Cache a user's info from a WHO reply, flagged G if away. Replies to
+	 * a channel's bulk WHO request aren't printed */
+
+	char hostinfo[BUFFSIZE];
+	channel *c;
+
+	snprintf(hostinfo, sizeof(hostinfo), "%s@%s", user, host);
+
+	user_set_info(s, nick, hostinfo, realname, account, (*flags == 'G'));
+
+	if (whox || ((c = channel_get(chan, s)) && c->who == REQUEST_SENT))
+		return 0;
+
+	newlinef(s->channel, 0, "--", "%s %s!%s (%s)%s",
+		chan, nick, hostinfo, realname, (*flags == 'G' ? " [away]" : ""));
+
+	return 0;
+}
@@ -83,6 +83,9 @@ new_server(char *host, char *port)
 
 	auto_nick(&(s->nptr), s->nick);
 
+	server_set_chanmodes(s, NULL);
+	server_set_prefix(s, NULL);
+
 	s->channel = new_channel(host, s, NULL, BUFFER_SERVER);
 
 	DLL_ADD(server_head, s);
@@ -101,6 +104,16 @@ free_server(server *s)
 		free_channel(t);
 	} while (c != s->channel);
 
+	free_netsplits(s);
+	free_floods(s);
+	sendq_cancel(s, NULL);
+	free_batches(s);
+	free_ignore(&(s->ignore));
+	free_watch(s);
+	free_highlight(&(s->highlight));
+	free_hash(&(s->chan_table));
+	free_hash(&(s->user_table));
+	free_intern_pool(&(s->intern_pool));
 	free(s->host);
 	free(s->port);
 	free(s);
@@ -117,6 +130,7 @@ sendf(char *err, server *s, const char *fmt, ...)
 
 	char sendbuff[BUFFSIZE];
 	int soc, len;
+	time_t t;
 	va_list ap;
 
 	if (s == NULL || (soc = s->soc) < 0) {
@@ -150,6 +164,10 @@ sendf(char *err, server *s, const char *fmt, ...)
 		return 1;
 	}
 
+	/* Every message advances the server's message timer, see sendq_flush() */
+	t = time(NULL);
+	s->sendq.time = ((s->sendq.time > t) ? s->sendq.time : t) + SENDQ_PENALTY;
+
 	return 0;
 }
 
@@ -222,6 +240,10 @@ connected(server *s)
 	s->latency_time = time(NULL);
 	s->latency_delta = 0;
 
+	/* Registration is suspended until CAP END, see recv_cap() */
+	s->registering = 1;
+
+	sendf(NULL, s, "CAP LS 302");
 	sendf(NULL, s, "NICK %s", s->nick);
 	sendf(NULL, s, "USER %s 8 * :%s", config.username, config.realname);
 
@@ -349,7 +371,7 @@ server_disconnect(server *s, int err, int kill, char *mesg)
 		close(s->soc);
 
 		/* Set all server attributes back to default */
-		memset(s->usermodes, 0, MODE_SIZE);
+		mode_reset(&(s->usermodes));
 		s->soc = -1;
 		s->iptr = s->input;
 		s->nptr = config.nicks;
@@ -358,6 +380,33 @@ server_disconnect(server *s, int err, int kill, char *mesg)
 		/* Reset the nick that reconnects will attempt to register with */
 		auto_nick(&(s->nptr), s->nick);
 
+		/* Casemapping, channel modes, prefixes and WHOX are re-advertised on registration */
+		server_set_casemapping(s, CASEMAPPING_RFC1459);
+		server_set_chanmodes(s, NULL);
+		server_set_prefix(s, NULL);
+		s->whox = 0;
+		s->who_time = 0;
+		s->history_time = 0;
+		s->history_max = 0;
+		memset(&(s->isupport), 0, sizeof(s->isupport));
+
+		/* Capabilities are renegotiated, open batches are never closed */
+		s->caps = 0;
+		s->caps_ls = 0;
+		s->registering = 0;
+		free_batches(s);
+
+		/* Users lost in netsplits are forgotten along with the nicklists */
+		free_netsplits(s);
+
+		/* Watched nicks are sent again once registered */
+		watch_reset(s);
+
+		/* Queued pastes aren't resent on reconnect */
+		unsigned int n;
+		if ((n = sendq_cancel(s, NULL)))
+			newlinef(s->channel, 0, "--", "Paste cancelled, %u line%s not sent", n, (n == 1 ? "" : "s"));
+
 		/* Print message to all open channels and reset their attributes */
 		channel *c = s->channel;
 		do {
@@ -418,6 +467,16 @@ check_servers(void)
 
 		check_socket(s, t);
 
+		netsplit_flush(s, t);
+
+		flood_flush(s, t);
+
+		sendq_flush(s, t);
+
+		requests_flush(s, t);
+
+		watch_flush(s, t);
+
 	} while ((s = s->next) != server_head);
 }
 
@@ -33,6 +33,8 @@ static struct
 	char *port;
 	char *join;
 	char *nicks;
+	char *highlights;
+	int flood_ignore;
 } opts;
 
 static struct termios oterm, nterm;
@@ -66,11 +68,16 @@ usage(void)
 	"  -p, --port=PORT        Connect using PORT\n"
 	"  -j, --join=CHANNELS    Comma separated list of channels to join\n"
 	"  -n, --nicks=NICKS      Comma and/or space separated list of nicks to use\n"
+	"  -l, --highlight=WORDS  Comma and/or space separated list of words to highlight,\n"
+	"                         a leading or trailing '*' also matches within words\n"
+	"  -f, --flood-ignore=SECONDS\n"
+	"                         Ignore users flooding messages for SECONDS\n"
 	"  -v, --version          Print rirc version and exit\n"
 	"\n"
 	"Examples:\n"
 	"  rirc -c server.tld -j '#chan'\n"
 	"  rirc -c server.tld -p 1234 -j '#chan1,#chan2' -n 'nick, nick_, nick__'\n"
+	"  rirc -c server.tld -l 'rirc, *bot*'\n"
 	);
 }
 
@@ -81,7 +88,10 @@ getopts(int argc, char **argv)
 	opts.port    = NULL;
 	opts.join    = NULL;
 	opts.nicks   = NULL;
+	opts.highlights = NULL;
+	opts.flood_ignore = 0;
 
+	char *end;
 	int c, opt_i = 0;
 
 	static struct option long_opts[] =
@@ -90,12 +100,14 @@ getopts(int argc, char **argv)
 		{"port",    required_argument, 0, 'p'},
 		{"join",    required_argument, 0, 'j'},
 		{"nick",    required_argument, 0, 'n'},
+		{"highlight", required_argument, 0, 'l'},
+		{"flood-ignore", required_argument, 0, 'f'},
 		{"version", no_argument,       0, 'v'},
 		{"help",    no_argument,       0, 'h'},
 		{0, 0, 0, 0}
 	};
 
-	while ((c = getopt_long(argc, argv, "c:p:n:j:vh", long_opts, &opt_i))) {
+	while ((c = getopt_long(argc, argv, "c:p:n:l:f:j:vh", long_opts, &opt_i))) {
 
 		if (c == -1)
 			break;
@@ -129,6 +141,24 @@ getopts(int argc, char **argv)
 				opts.nicks = optarg;
 				break;
 
+			/* Comma and/or space separated list of words to highlight */
+			case 'l':
+				if (*optarg == '-') {
+					puts("-l/--highlight requires an argument");
+					exit(EXIT_FAILURE);
+				}
+				opts.highlights = optarg;
+				break;
+
+			/* Seconds to ignore flooding users */
+			case 'f':
+				opts.flood_ignore = strtol(optarg, &end, 10);
+				if (*optarg == '-' || *end || opts.flood_ignore <= 0) {
+					puts("-f/--flood-ignore requires a number of seconds");
+					exit(EXIT_FAILURE);
+				}
+				break;
+
 			/* Comma separated list of channels to join */
 			case 'j':
 				if (*optarg == '-') {
@@ -177,12 +207,16 @@ configure(void)
 		config.nicks = getenv("USER");
 	}
 
+	config.highlights = opts.highlights;
+
 	//FIXME: these would become global_config as oppose to each s.config
 	//options in this struct can be /set, or :set
 
 	config.username = "rirc_v" VERSION;
 	config.realname = "rirc v" VERSION;
 	config.join_part_quit_threshold = 100;
+	config.lazy_nicklist_threshold = 5000;
+	config.flood_ignore = opts.flood_ignore;
 }
 
 static void
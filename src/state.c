@@ -8,7 +8,6 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
 #include <stdarg.h>
 #include <stdio.h>
 
@@ -17,10 +16,100 @@
 
 static int action_close_server(char);
 
+static user* new_user(server*, const char*);
+static void free_user(server*, user*);
+static void user_merge(server*, user*, user*);
+static membership* membership_get(channel*, const char*);
+static membership* new_membership(channel*, const char*, const char*);
+static void free_membership(void*);
+static void free_names(channel*);
+static void names_del(channel*, membership*);
+static void names_push(channel*, membership*);
+static void nicklist_drop(channel*);
+static int nicklist_lazy_want(channel*, size_t);
+static void user_set_str(char**, const char*);
+
+static struct netsplit_channel* netsplit_channel(struct netsplit*, channel*);
+static void free_netsplit(struct netsplit*);
+static void netsplit_forget(channel*);
+static void netsplit_release(void*);
+
+/* Sender counted by a server's flood limits */
+struct flood_sender
+{
+	const char *nick;
+	char *ignore;          /* Mask ignored until ignore_time, or NULL */
+	channel *channel;      /* Buffer of the last message dropped, or NULL */
+	time_t mesg;           /* Token buckets, see struct flood */
+	time_t ctcp;
+	time_t first;          /* First and last message dropped */
+	time_t last;
+	time_t ignore_time;
+	unsigned int dropped;
+	int counted;           /* Counted in the server's senders */
+	struct flood_sender *next;
+};
+
+static void flood_forget(channel*);
+static void flood_ignore(server*, struct flood_sender*, const char*, time_t);
+
+/* Message text queued to send to a channel */
+struct sendq_line
+{
+	channel *channel;
+	struct sendq_line *next;
+	char text[];
+};
+
+/* Nick on a server's watch list */
+struct watch_nick
+{
+	const char *nick;
+	int monitored;         /* On the server's MONITOR list */
+	int pending;           /* Not yet sent, see watch_flush() */
+};
+
+/* Nicks of an ISON poll awaiting its reply */
+struct watch_ison
+{
+	struct watch_ison *next;
+	char nicks[];
+};
+
+static size_t watch_pack(char*, size_t, const char**, size_t, char);
+static void free_watch_ison(server*);
+static void watch_release(void*);
+
+static void free_speakers(channel*);
+static void speaker_del(channel*, struct speaker*);
+static void speaker_link(struct speakers*, struct speaker*);
+static void speaker_rename(channel*, const char*, const char*);
+static void speaker_unlink(struct speakers*, struct speaker*);
+
+/* Item of a table printed by print_columns() */
+struct column
+{
+	const char *text;
+	size_t len;
+	char prefix;
+};
+
+static int column_cmp(const void*, const void*);
+static void print_columns(channel*, struct column*, size_t);
+
 static void _newline(channel*, line_t, const char*, const char*, size_t);
+static buffer_line* buffer_line_next(channel*, line_t, const char*);
+static buffer_line* buffer_line_order(channel*, buffer_line*);
+static void free_buffer_line(channel*, buffer_line*);
+static channel* request_next(server*, size_t, time_t, time_t);
+static void directory_scroll(struct directory*, int);
+static const char* intern_opt(hash_table*, const char*);
 
 static struct state state;
 
+/* Interned strings of buffers not associated with a server */
+static hash_table intern_pool;
+
 struct state const* get_state(void) { return &state; }
 
 void
@@ -49,6 +138,7 @@ void
 free_state(void)
 {
 	free_channel(state.default_channel);
+	free_intern_pool(&intern_pool);
 }
 
 void
@@ -75,6 +165,32 @@ newlinef(channel *c, line_t type, const char *from, const char *fmt, ...)
 	_newline(c, type, from, buff, len);
 }
 
+void
+newevent(channel *c, event_t kind, const char *nick, const char *host, const char *chan, const char *arg)
+{
+	/* Insert an event line, formatted only if it's ever drawn. Its strings are
+	 * interned, so an event shown in many buffers shares a single copy */
+
+	static const char *from[EVENT_T_SIZE] = {
+		[EVENT_JOIN] = ">",
+		[EVENT_PART] = "<",
+		[EVENT_QUIT] = "<",
+		[EVENT_NICK] = "--",
+	};
+
+	buffer_line *l = buffer_line_next(c, 0, from[kind]);
+	hash_table *pool = (c->server) ? &(c->server->intern_pool) : &intern_pool;
+
+	if (l == NULL)
+		return;
+
+	l->event.kind = kind;
+	l->event.nick = intern(pool, nick);
+	l->event.host = intern_opt(pool, host);
+	l->event.chan = intern_opt(pool, chan);
+	l->event.arg  = intern_opt(pool, arg);
+}
+
 static void
 _newline(channel *c, line_t type, const char *from, const char *mesg, size_t len)
 {
@@ -82,6 +198,36 @@ _newline(channel *c, line_t type, const char *from, const char *mesg, size_t len
 
 	buffer_line *new_line;
 
+	if (mesg == NULL)
+		fatal("mesg is null");
+
+	if ((new_line = buffer_line_next(c, type, from)) == NULL)
+		return;
+
+	new_line->len = len;
+
+	if ((new_line->text = malloc(new_line->len + 1)) == NULL)
+		fatal("newline");
+
+	strcpy(new_line->text, mesg);
+}
+
+static buffer_line*
+buffer_line_next(channel *c, line_t type, const char *from)
+{
+	/* Recycle the oldest line of a buffer as its newest
+	 *
+	 * Returns NULL if the line is played back by CHATHISTORY and an earlier
+	 * message with its msgid is already in the buffer. Lines of live messages
+	 * are never dropped, nor the lines after the first of a message */
+
+	buffer_line *new_line;
+	server *s = c->server;
+	int playback = (s && s->batch && !strcmp(s->batch->type, "chathistory"));
+
+	if (playback && s->mesg_id && c->msgid_seq != s->mesg_seq && hash_get_exact(&(c->msgids), s->mesg_id))
+		return NULL;
+
 	/* c->buffer_head points to the first printable line, so get the next line in the
 	 * circular buffer */
 	if ((new_line = c->buffer_head + 1) == &c->buffer[SCROLLBACK_BUFFER])
@@ -97,41 +243,110 @@ _newline(channel *c, line_t type, const char *from, const char *mesg, size_t len
 
 	c->buffer_head = new_line;
 
-	/* new_channel() memsets c->buffer to 0, so this will either free(NULL) or an old line */
-	free(new_line->text);
-
 	if (c == NULL)
 		fatal("channel is null");
 
+	/* new_channel() memsets c->buffer to 0, so this is either unused or an old line */
+	free_buffer_line(c, new_line);
+
 	/* Set the line meta data */
-	new_line->len = len;
 	new_line->type = type;
-	new_line->time = time(NULL);
+	new_line->time = (s && s->mesg_time) ? s->mesg_time : time(NULL);
+
+	/* The first line of a message holds its msgid */
+	if (s && s->mesg_id && !hash_get_exact(&(c->msgids), s->mesg_id)) {
+		new_line->msgid = strdup(s->mesg_id);
+		hash_add_exact(&(c->msgids), new_line->msgid, new_line->msgid);
+		c->msgid_seq = s->mesg_seq;
+	}
 
 	/* Rows are recalculated by the draw routine when == 0 */
 	new_line->rows = 0;
 
 	/* If from is NULL, assume server message */
-	strncpy(new_line->from, (from) ? from : c->name, NICKSIZE);
+	new_line->from = intern(
+		(c->server) ? &(c->server->intern_pool) : &intern_pool,
+		(from) ? from : c->name);
 
 	size_t len_from;
 	if ((len_from = strlen(new_line->from)) > c->draw.nick_pad)
 		c->draw.nick_pad = len_from;
 
-	if (mesg == NULL)
-		fatal("mesg is null");
-
-	if ((new_line->text = malloc(new_line->len + 1)) == NULL)
-		fatal("newline");
-
-	strcpy(new_line->text, mesg);
-
 	if (c == ccur)
 		draw(D_BUFFER);
 	else if (!type && c->active < ACTIVITY_ACTIVE) {
 		c->active = ACTIVITY_ACTIVE;
 		draw(D_CHANS);
 	}
+
+	if (s && s->mesg_time > c->server_time)
+		c->server_time = s->mesg_time;
+
+	/* Live lines stay in the order received, despite any clock skew */
+	if (playback && s->mesg_time)
+		return buffer_line_order(c, new_line);
+
+	return new_line;
+}
+
+static buffer_line*
+buffer_line_order(channel *c, buffer_line *l)
+{
+	/* Move a buffer's newest line back past newer lines, so a batch of lines
+	 * played back by CHATHISTORY is inserted in timestamp order
+	 *
+	 * Returns the line's new position */
+
+	buffer_line *prev, tmp;
+	int i;
+
+	for (i = 1; i < SCROLLBACK_BUFFER; i++) {
+
+		prev = (l == c->buffer) ? &c->buffer[SCROLLBACK_BUFFER - 1] : l - 1;
+
+		if (prev->from == NULL || prev->time <= l->time)
+			break;
+
+		tmp = *prev;
+		*prev = *l;
+		*l = tmp;
+
+		l = prev;
+	}
+
+	return l;
+}
+
+static void
+free_buffer_line(channel *c, buffer_line *l)
+{
+	const char *strs[] = { l->from, l->event.nick, l->event.host, l->event.chan, l->event.arg };
+	size_t i;
+
+	for (i = 0; i < sizeof(strs) / sizeof(strs[0]); i++) {
+		if (strs[i])
+			intern_release(strs[i]);
+	}
+
+	if (l->msgid) {
+		hash_del_exact(&(c->msgids), l->msgid);
+		free(l->msgid);
+	}
+
+	free(l->text);
+
+	l->text = NULL;
+	l->msgid = NULL;
+	l->from = NULL;
+	l->len = 0;
+
+	memset(&(l->event), 0, sizeof(l->event));
+}
+
+static const char*
+intern_opt(hash_table *pool, const char *str)
+{
+	return (str) ? intern(pool, str) : NULL;
 }
 
 channel*
@@ -159,6 +374,10 @@ new_channel(char *name, server *server, channel *chanlist, buffer_t type)
 	/* Append the new channel to the list */
 	DLL_ADD(chanlist, c);
 
+	/* Index the channel by name for lookup on inbound messages */
+	if (server)
+		hash_add(&(server->chan_table), server->casemapping, c->name, c);
+
 	draw(D_FULL);
 
 	return c;
@@ -169,9 +388,22 @@ free_channel(channel *c)
 {
 	buffer_line *l;
 	for (l = c->buffer; l < c->buffer + SCROLLBACK_BUFFER; l++)
-		free(l->text);
+		free_buffer_line(c, l);
+
+	free_hash(&(c->msgids));
 
-	free_avl(c->nicklist);
+	if (c->directory) {
+		free_directory(c->directory);
+		free(c->directory);
+	}
+
+	netsplit_forget(c);
+	flood_forget(c);
+	sendq_cancel(c->server, c);
+	free_speakers(c);
+	free_names(c);
+	free_avl(&(c->nicklist), free_membership);
+	mode_reset(&(c->chanmodes));
 	free_input(c->input);
 	free(c);
 }
@@ -179,26 +411,18 @@ free_channel(channel *c)
 channel*
 channel_get(char *chan, server *s)
 {
+	/* Find a server's channel or private buffer by name */
+
 	if (!s)
 		return NULL;
 
-	channel *c = s->channel;
-
-	do {
-		if (!strcasecmp(c->name, chan))
-			return c;
-
-	} while ((c = c->next) != s->channel);
-
-	return NULL;
+	return hash_get(&(s->chan_table), s->casemapping, chan);
 }
 
 void
 channel_clear(channel *c)
 {
-	free(c->buffer_head->text);
-
-	c->buffer_head->text = NULL;
+	free_buffer_line(c, c->buffer_head);
 
 	c->draw.nick_pad = 0;
 
@@ -234,18 +458,191 @@ action_close_server(char c)
 void
 nicklist_print(channel *c)
 {
-	newline(c, 0, "TODO", "Print ignore list to channel");
+	/* Print a channel's nicklist as a table, its users collected in one
+	 * in-order pass over the tree, with counts by highest prefix mode */
+
+	const avl_node **nodes;
+	const membership *m;
+	struct column *items;
+	char counts[BUFFSIZE] = "";
+	size_t class, i, len = 0, n = avl_size(&(c->nicklist), -1);
+
+	if (c->server == NULL || c->buffer_type != BUFFER_CHANNEL)
+		return;
+
+	if (c->lazy) {
+		newlinef(c, 0, "--", "%s: ~%d users, nicklist not loaded", c->name, c->nick_count);
+		return;
+	}
+
+	for (class = 1; class <= strlen(c->server->prefix_chars); class++) {
+
+		if ((i = avl_size(&(c->nicklist), class)) == 0)
+			continue;
+
+		len += snprintf(counts + len, sizeof(counts) - len, "%s%zu %c",
+				(len ? ", " : " ("), i, c->server->prefix_chars[class - 1]);
+	}
+
+	newlinef(c, 0, "--", "%s: %zu users%s%s", c->name, n, counts, (len ? ")" : ""));
+
+	if (n == 0)
+		return;
+
+	if ((nodes = malloc(sizeof(*nodes) * n)) == NULL)
+		fatal("malloc");
+
+	if ((items = malloc(sizeof(*items) * n)) == NULL)
+		fatal("malloc");
+
+	n = avl_range(&(c->nicklist), 0, -1, nodes, n);
+
+	for (i = 0; i < n; i++) {
+
+		m = nodes[i]->val;
+
+		class = nicklist_class(m->prefix);
+
+		items[i].text = m->user->nick;
+		items[i].prefix = (class) ? c->server->prefix_chars[class - 1] : 0;
+	}
+
+	print_columns(c, items, n);
+
+	free(nodes);
+	free(items);
+}
+
+void
+ignore_print(channel *c)
+{
+	/* Print a server's ignore list as a table, sorted by mask */
+
+	const char **masks;
+	struct column *items;
+	size_t i, n;
+
+	if (c->server == NULL)
+		return;
+
+	if ((n = ignore_list(&(c->server->ignore), NULL)) == 0) {
+		newline(c, 0, "--", "Ignore list is empty");
+		return;
+	}
+
+	if ((masks = malloc(sizeof(*masks) * n)) == NULL)
+		fatal("malloc");
+
+	if ((items = malloc(sizeof(*items) * n)) == NULL)
+		fatal("malloc");
+
+	ignore_list(&(c->server->ignore), masks);
+
+	for (i = 0; i < n; i++) {
+		items[i].text = masks[i];
+		items[i].prefix = 0;
+	}
+
+	qsort(items, n, sizeof(*items), column_cmp);
+
+	newlinef(c, 0, "--", "Ignoring %zu mask%s:", n, (n == 1 ? "" : "s"));
+
+	print_columns(c, items, n);
+
+	free(masks);
+	free(items);
+}
+
+static int
+column_cmp(const void *c1, const void *c2)
+{
+	return strcmp(((const struct column *)c1)->text, ((const struct column *)c2)->text);
+}
+
+static void
+print_columns(channel *c, struct column *items, size_t n)
+{
+	/* Print items as a table sorted across its rows, every column as wide as
+	 * the widest item, a line per row. Rows are laid out for the buffer's text
+	 * width when printed, and wrap like any other line if it narrows. At most
+	 * TABLE_ROWS rows are printed, the remaining items are counted */
+
+	char *p, *text;
+	int text_cols;
+	size_t col, cols, i, rows, width, max_len = 0;
+
+	if (n == 0)
+		return;
+
+	/* (#terminal columns) - (nick sidebar) - strlen((widest nick in c)) - strlen(" HH:MM   ~ ") */
+	text_cols = term_cols - nicklist_cols(c) - (int)(c->draw.nick_pad > 2 ? c->draw.nick_pad : 2) - 11;
+
+	width = (text_cols > 1) ? (size_t)text_cols : 80;
+
+	/* Items wider than a row are truncated */
+	for (i = 0; i < n; i++) {
+
+		items[i].len = strlen(items[i].text) + (items[i].prefix != 0);
+
+		if (items[i].len > width)
+			items[i].len = width;
+
+		if (items[i].len > max_len)
+			max_len = items[i].len;
+	}
+
+	/* The most columns that fit, separated by two spaces */
+	cols = (width + 2) / (max_len + 2);
+
+	if ((rows = (n + cols - 1) / cols) > TABLE_ROWS)
+		rows = TABLE_ROWS;
+
+	if ((text = malloc(width + 1)) == NULL)
+		fatal("malloc");
+
+	for (i = 0; i < n && i < rows * cols;) {
+
+		for (p = text, col = 0; col < cols && i < n; col++, i++) {
+
+			while (p < text + col * (max_len + 2))
+				*p++ = ' ';
+
+			if (items[i].prefix)
+				*p++ = items[i].prefix;
+
+			memcpy(p, items[i].text, items[i].len - (items[i].prefix != 0));
+
+			p += items[i].len - (items[i].prefix != 0);
+		}
+
+		*p = '\0';
+
+		newline(c, 0, "--", text);
+	}
+
+	if (i < n)
+		newlinef(c, 0, "--", "... and %zu more", n - i);
+
+	free(text);
 }
 
 void
 reset_channel(channel *c)
 {
-	memset(c->chanmodes, 0, MODE_SIZE);
+	mode_reset(&(c->chanmodes));
 
-	free_avl(c->nicklist);
+	free_names(c);
+	free_avl(&(c->nicklist), free_membership);
 
+	c->lazy = (c->nicklist_policy == NICKLIST_LAZY);
 	c->nick_count = 0;
-	c->nicklist = NULL;
+	c->names.counted = 0;
+	c->who = REQUEST_NONE;
+	c->history = REQUEST_NONE;
+	c->load = REQUEST_NONE;
+	c->load_print = 0;
+	c->count = REQUEST_NONE;
+	c->count_time = 0;
 }
 
 void
@@ -295,6 +692,8 @@ channel_close(channel *c)
 			draw(D_CHANS);
 		}
 
+		hash_del(&(c->server->chan_table), c->server->casemapping, c->name);
+
 		DLL_DEL(c->server->channel, c);
 		free_channel(c);
 	}
@@ -326,6 +725,54 @@ channel_switch(channel *c, int next)
 	return ret;
 }
 
+channel*
+directory_get(server *s)
+{
+	/* Return a server's channel directory buffer, creating it if needed */
+
+	channel *c;
+
+	if ((c = channel_get("/list", s)) == NULL) {
+
+		c = new_channel("/list", s, s->channel, BUFFER_LIST);
+
+		if ((c->directory = calloc(1, sizeof(*c->directory))) == NULL)
+			fatal("calloc");
+	}
+
+	return c;
+}
+
+channel*
+directory_open(server *s)
+{
+	/* Return a server's channel directory buffer, emptied for a new /list */
+
+	channel *c = directory_get(s);
+
+	directory_reset(c->directory);
+
+	if (c == ccur)
+		draw(D_BUFFER);
+
+	return c;
+}
+
+static void
+directory_scroll(struct directory *d, int rows)
+{
+	/* Scroll a directory by a page of rows, less its header row */
+
+	size_t page = (rows < -2 || rows > 2) ? (size_t)abs(rows) - 1 : 1;
+
+	if (rows < 0)
+		d->scroll -= (d->scroll > page) ? page : d->scroll;
+	else if (d->scroll + page < d->view_count)
+		d->scroll += page;
+
+	draw(D_BUFFER);
+}
+
 void
 buffer_scrollback_back(channel *c)
 {
@@ -336,12 +783,17 @@ buffer_scrollback_back(channel *c)
 	/* Terminal rows - nav - separator*2 - input */
 	int rows = term_rows - 4;
 
+	if (c->directory) {
+		directory_scroll(c->directory, -rows);
+		return;
+	}
+
 	do {
 		/* Circular buffer prev */
 		l = (l == c->buffer) ? &c->buffer[SCROLLBACK_BUFFER - 1] : l - 1;
 
 		/* If last scrollback line is found before a full page is counted, do nothing */
-		if (l->text == NULL || l == c->buffer_head)
+		if (l->from == NULL || l == c->buffer_head)
 			return;
 
 		rows -= l->rows;
@@ -363,9 +815,14 @@ buffer_scrollback_forw(channel *c)
 	/* Terminal rows - nav - separator*2 - input */
 	int rows = term_rows - 4;
 
+	if (c->directory) {
+		directory_scroll(c->directory, rows);
+		return;
+	}
+
 	/* Unfortunately Scrolling forward might encountej
 	 * lines that haven't been drawn since resizing */
-	int text_cols = term_cols - c->draw.nick_pad - 11;
+	int text_cols = term_cols - nicklist_cols(c) - c->draw.nick_pad - 11;
 
 	do {
 		if (l == c->buffer_head)
@@ -415,68 +872,2113 @@ auto_nick(char **autonick, char *nick)
 	*nick = '\0';
 }
 
-static void
-set_mode_str(char mode_str[MODE_SIZE], const char *modes)
+void
+server_set_casemapping(server *s, casemapping_t cm)
 {
-	/* Given a string of modes, eg: +abc, add or remove flags
-	 * from the mode_str set, maintaining alphabetic order */
+	/* Set a server's casemapping, rebuilding any trees keyed under the previous one.
+	 * Users whose nicks collide under the new casemapping are merged */
 
-	char *ptr, pm = 0;
+	hash_table users = s->user_table;
+	size_t i;
+	user *u;
 
-	while (*modes) {
+	if (s->casemapping == cm)
+		return;
 
-		if (*modes == '-' || *modes == '+')
-			pm = *modes;
+	s->user_table.count = 0;
+	s->user_table.size = 0;
+	s->user_table.entries = NULL;
 
-		/* Silently skip invalid flags */
-		else if (!isalpha(*modes) || !pm)
-			;
+	for (i = 0; i < users.size; i++) {
 
-		/* Add flags */
-		else if (pm == '+' && !strchr(mode_str, *modes)) {
+		if (users.entries[i].key == NULL)
+			continue;
 
-			char *tmp;
+		u = users.entries[i].val;
 
-			/* Find location to insert, alphabetically */
-			for (ptr = mode_str; *ptr && *ptr < *modes; ptr++)
-				;
+		if (!hash_add(&(s->user_table), cm, u->nick, u))
+			user_merge(s, hash_get(&(s->user_table), cm, u->nick), u);
+	}
 
-			/* Shift flags */
-			for (tmp = strchr(mode_str, '\0') + 1; tmp > ptr; tmp--)
-				*tmp = *(tmp - 1);
+	free(users.entries);
 
-			*ptr = *modes;
-		}
+	s->casemapping = cm;
+
+	ignore_remap(&(s->ignore), cm);
+	hash_remap(&(s->chan_table), cm, NULL);
+	hash_remap(&(s->watch.nicks), cm, watch_release);
+
+	struct netsplit *n;
+	for (n = s->netsplits; n; n = n->next)
+		hash_remap(&(n->nicks), cm, netsplit_release);
+
+	/* Flood senders colliding under the new casemapping are left unindexed
+	 * until they're forgotten */
+	struct flood_sender *p;
+	free_hash(&(s->flood.table));
+	for (p = s->flood.head; p; p = p->next)
+		hash_add(&(s->flood.table), cm, p->nick, p);
+
+	/* Recent speakers are few and short lived, they're discarded */
+	channel *c = s->channel;
+	do {
+		avl_remap(&(c->nicklist), cm, free_membership);
+		free_speakers(c);
+	} while ((c = c->next) != s->channel);
+}
+
+int
+server_set_prefix(server *s, const char *prefix)
+{
+	/* Set a server's channel membership prefixes from the ISUPPORT PREFIX
+	 * value, eg: (ov)@+, or the default if prefix is NULL
+	 *
+	 * Modes are listed in order of rank, highest first. Returns 0 if the
+	 * value is invalid, leaving the prefixes unchanged */
+
+	const char *chars;
+	size_t len;
+
+	if (prefix == NULL)
+		prefix = "(ov)@+";
+
+	/* An empty value indicates no prefixes are supported */
+	if (*prefix == '\0') {
+		*s->prefix_chars = '\0';
+		*s->prefix_modes = '\0';
+		return 1;
+	}
+
+	if (*prefix++ != '(' || (chars = strchr(prefix, ')')) == NULL)
+		return 0;
+
+	if ((len = chars++ - prefix) > PREFIX_MAX || strlen(chars) != len)
+		return 0;
+
+	memcpy(s->prefix_modes, prefix, len);
+	memcpy(s->prefix_chars, chars, len);
+
+	s->prefix_modes[len] = '\0';
+	s->prefix_chars[len] = '\0';
+
+	return 1;
+}
+
+int
+server_set_chanmodes(server *s, const char *chanmodes)
+{
+	/* Set a server's channel mode types from the ISUPPORT CHANMODES value,
+	 * eg: beI,k,l,imnpst, or the RFC2811 defaults if chanmodes is NULL
+	 *
+	 * Returns 0 if the value is invalid, leaving the types unchanged */
+
+	struct chanmodes cm = {0};
+	uint64_t *type = &cm.A, bit;
 
-		/* Remove flags, if found */
-		else if (pm == '-' && (ptr = strchr(mode_str, *modes))) {
-			do {
-				*ptr = *(ptr + 1);
-			} while (*ptr++);
+	if (chanmodes == NULL)
+		chanmodes = "beI,k,l,imnpst";
+
+	for (; *chanmodes; chanmodes++) {
+
+		/* Types beyond D may be added in the future and are ignored */
+		if (*chanmodes == ',') {
+			if (type++ == &cm.D)
+				break;
 		}
 
-		modes++;
+		else if ((bit = mode_bit(*chanmodes)))
+			*type |= bit;
+
+		else
+			return 0;
 	}
+
+	s->chanmodes = cm;
+
+	return 1;
 }
 
 void
 server_set_mode(server *s, const char *modes)
 {
-	set_mode_str(s->usermodes, modes);
+	/* Set or unset user modes from a mode string, eg: +iw-x */
+
+	int set = 0;
+
+	for (; *modes; modes++) {
+		if (*modes == '+' || *modes == '-')
+			set = (*modes == '+');
+		else
+			mode_set(&(s->usermodes), *modes, set, NULL);
+	}
 
 	if (ccur->server == s)
 		draw(D_STATUS);
 }
 
 void
-channel_set_mode(channel *c, const char *modes)
+channel_set_mode(channel *c, char flag, int set, const char *arg)
 {
-	set_mode_str(c->chanmodes, modes);
+	mode_set(&(c->chanmodes), flag, set, arg);
 
 	if (ccur == c)
 		draw(D_STATUS);
 }
 
+/* Server user table and channel nicklists
+ *
+ * Each user is stored once per server, and each of the channel nicklists it
+ * appears in holds a membership linking the user and the channel. Handlers
+ * affecting a user on all channels (QUIT, NICK) need only visit the user's
+ * memberships rather than every channel's nicklist */
+
+user*
+user_get(server *s, const char *nick)
+{
+	return hash_get(&(s->user_table), s->casemapping, nick);
+}
+
+static user*
+new_user(server *s, const char *nick)
+{
+	user *u;
+
+	if ((u = calloc(1, sizeof(*u))) == NULL)
+		fatal("calloc");
+
+	u->nick = intern(&(s->intern_pool), nick);
+
+	hash_add(&(s->user_table), s->casemapping, u->nick, u);
+
+	return u;
+}
+
+static void
+free_user(server *s, user *u)
+{
+	hash_del(&(s->user_table), s->casemapping, u->nick);
+	intern_release(u->nick);
+	free(u->hostinfo);
+	free(u->realname);
+	free(u->account);
+	free(u);
+}
+
+static void
+user_merge(server *s, user *into, user *u)
+{
+	/* Merge a user into the user its nick collides with under a server's new
+	 * casemapping, before it's set. The user's memberships are moved, or
+	 * dropped from channels the other user is already in */
+
+	membership *m, *n;
+	channel *c;
+	void *val;
+	int staged;
+
+	while ((m = u->memberships)) {
+
+		u->memberships = m->next;
+		c = m->channel;
+
+		for (n = into->memberships; n && n->channel != c; n = n->next)
+			;
+
+		/* Nicklist nodes borrow their user's nick, memberships not in the
+		 * nicklist are staged */
+		staged = !avl_del(&(c->nicklist), s->casemapping, u->nick, &val);
+
+		if (n) {
+
+			if (staged)
+				names_del(c, m);
+			else
+				c->nick_count--;
+
+			free(m);
+			continue;
+		}
+
+		m->user = into;
+		m->next = into->memberships;
+		into->memberships = m;
+
+		if (!staged) {
+			avl_add(&(c->nicklist), s->casemapping, into->nick, m);
+			avl_set_class(&(c->nicklist), s->casemapping, into->nick, nicklist_class(m->prefix));
+		}
+	}
+
+	intern_release(u->nick);
+	free(u->hostinfo);
+	free(u->realname);
+	free(u->account);
+	free(u);
+}
+
+static void
+user_set_str(char **p, const char *str)
+{
+	/* Set one of a user's strings, NULL to unset */
+
+	if (*p && str && !strcmp(*p, str))
+		return;
+
+	free(*p);
+	*p = (str ? strdup(str) : NULL);
+}
+
+user*
+user_seen(server *s, const char *nick, const char *hostinfo)
+{
+	/* Update a known user's hostinfo from a message prefix
+	 *
+	 * Returns NULL if the user isn't known */
+
+	user *u;
+
+	if ((u = user_get(s, nick)) && hostinfo)
+		user_set_str(&(u->hostinfo), hostinfo);
+
+	return u;
+}
+
+user*
+user_set_info(server *s, const char *nick, const char *hostinfo, const char *realname, const char *account, int away)
+{
+	/* Cache a known user's info from a WHO reply, account is NULL if the
+	 * user isn't logged in
+	 *
+	 * Returns NULL if the user isn't known */
+
+	user *u;
+
+	if ((u = user_get(s, nick)) == NULL)
+		return NULL;
+
+	user_set_str(&(u->hostinfo), hostinfo);
+	user_set_str(&(u->realname), realname);
+	user_set_str(&(u->account), account);
+
+	u->away = away;
+
+	return u;
+}
+
+static channel*
+request_next(server *s, size_t field, time_t sent, time_t t)
+{
+	/* Returns the first of a server's channels with a queued request, or NULL
+	 * if none is queued or a sent request is awaiting its reply. Requests
+	 * without a reply after REQUEST_TIMEOUT seconds are abandoned, and their
+	 * partial replies kept */
+
+	channel *c = s->channel, *next = NULL;
+	request_t *r;
+
+	if (t - sent < REQUEST_DELAY)
+		return NULL;
+
+	do {
+		r = (request_t *)((char *)c + field);
+
+		if (*r == REQUEST_SENT) {
+
+			if (t - sent < REQUEST_TIMEOUT)
+				return NULL;
+
+			*r = REQUEST_DONE;
+		}
+
+		if (*r == REQUEST_QUEUED && next == NULL)
+			next = c;
+
+	} while ((c = c->next) != s->channel);
+
+	return next;
+}
+
+void
+requests_flush(server *s, time_t t)
+{
+	/* Send the first queued bulk WHO, NAMES and CHATHISTORY requests of a
+	 * server's joined channels, and drop unused lazy nicklists.
+	 *
+	 * Requests are coalesced to one per channel, and only one of each is sent
+	 * at a time, at most every REQUEST_DELAY seconds */
+
+	channel *c;
+	char err[MAX_ERROR], since[sizeof("YYYY-MM-DDThh:mm:ss.sssZ")];
+	unsigned int limit;
+
+	if (s->soc < 0)
+		return;
+
+	/* Lazy nicklists are loaded while shown in the nick sidebar */
+	if (state.nicklist_shown && ccur->server == s)
+		nicklist_load(ccur);
+
+	c = s->channel;
+	do {
+		/* Lazy nicklists loaded on demand are dropped again once unused */
+		if (!c->lazy && c->load == REQUEST_DONE && t - c->load_time >= NICKLIST_IDLE
+		 && nicklist_lazy_want(c, c->nick_count))
+			nicklist_drop(c);
+
+		/* Members of lazy nicklists aren't cached */
+		if (c->lazy && c->who == REQUEST_QUEUED)
+			c->who = REQUEST_NONE;
+
+		/* Lazy nicklists are recounted, unless being loaded */
+		if (c->lazy && !c->parted && c->count_time && t - c->count_time >= NICKLIST_RECOUNT
+		 && c->count != REQUEST_QUEUED && c->count != REQUEST_SENT
+		 && c->load != REQUEST_QUEUED && c->load != REQUEST_SENT)
+			c->count = REQUEST_QUEUED;
+
+	} while ((c = c->next) != s->channel);
+
+	if ((c = request_next(s, offsetof(channel, who), s->who_time, t))) {
+
+		/* WHOX fields: token, channel, user, host, nick, flags, account, realname */
+		if (s->whox ? sendf(err, s, "WHO %s %%tcuhnfar,"WHOX_TOKEN, c->name)
+		            : sendf(err, s, "WHO %s", c->name))
+			newlinef(c, 0, "-!!-", "%s", err);
+
+		c->who = REQUEST_SENT;
+		s->who_time = t;
+	}
+
+	if ((c = request_next(s, offsetof(channel, history), s->history_time, t))) {
+
+		/* The newest messages after the newest line already in the buffer, no
+		 * more than fit in it */
+		strftime(since, sizeof(since), "%Y-%m-%dT%H:%M:%S.000Z", gmtime(&(c->server_time)));
+
+		limit = (s->history_max && s->history_max < SCROLLBACK_BUFFER) ? s->history_max : SCROLLBACK_BUFFER;
+
+		if (sendf(err, s, "CHATHISTORY LATEST %s timestamp=%s %u", c->name, since, limit))
+			newlinef(c, 0, "-!!-", "%s", err);
+
+		c->history = REQUEST_SENT;
+		s->history_time = t;
+	}
+
+	if ((c = request_next(s, offsetof(channel, load), s->load_time, t))) {
+
+		if (sendf(err, s, "NAMES %s", c->name))
+			newlinef(c, 0, "-!!-", "%s", err);
+
+		c->load = REQUEST_SENT;
+		s->load_time = t;
+	}
+
+	if ((c = request_next(s, offsetof(channel, count), s->count_time, t))) {
+
+		if (sendf(err, s, "NAMES %s", c->name))
+			newlinef(c, 0, "-!!-", "%s", err);
+
+		c->count = REQUEST_SENT;
+		s->count_time = t;
+	}
+}
+
+static void
+free_membership(void *arg)
+{
+	/* Unlink a membership from its user, freeing the user when it
+	 * no longer shares any channels, unless its nick is watched */
+
+	membership **mp, *m = arg;
+	user *u = m->user;
+	server *s = m->channel->server;
+
+	for (mp = &(u->memberships); *mp != m; mp = &((*mp)->next))
+		;
+
+	*mp = m->next;
+
+	if (u->memberships == NULL && !hash_get(&(s->watch.nicks), s->casemapping, u->nick))
+		free_user(s, u);
+
+	free(m);
+}
+
+static membership*
+membership_get(channel *c, const char *nick)
+{
+	/* Returns a user's membership in a channel, including staged memberships,
+	 * or NULL if the user isn't in the channel */
+
+	membership *m;
+	user *u;
+
+	if ((u = user_get(c->server, nick)) == NULL)
+		return NULL;
+
+	for (m = u->memberships; m && m->channel != c; m = m->next)
+		;
+
+	return m;
+}
+
+static membership*
+new_membership(channel *c, const char *nick, const char *hostinfo)
+{
+	/* Returns NULL if the user is already a member of the channel */
+
+	membership *m;
+	server *s = c->server;
+	user *u;
+
+	if ((u = user_get(s, nick)) == NULL)
+		u = new_user(s, nick);
+
+	if (hostinfo)
+		user_set_str(&(u->hostinfo), hostinfo);
+
+	for (m = u->memberships; m; m = m->next) {
+		if (m->channel == c)
+			return NULL;
+	}
+
+	if ((m = calloc(1, sizeof(*m))) == NULL)
+		fatal("calloc");
+
+	m->channel = c;
+	m->user = u;
+	m->next = u->memberships;
+	u->memberships = m;
+
+	return m;
+}
+
+int
+nicklist_add(channel *c, const char *nick, const char *hostinfo)
+{
+	/* Add a user to a channel's nicklist
+	 *
+	 * Returns 0 if the user is already in the nicklist */
+
+	membership *m;
+
+	/* Lazy nicklists only count users, unless being loaded */
+	if (c->lazy && c->load != REQUEST_SENT) {
+		c->nick_count++;
+		return 1;
+	}
+
+	if ((m = new_membership(c, nick, hostinfo)) == NULL)
+		return 0;
+
+	/* Users joining in a batch or while a lazy nicklist is loaded are staged,
+	 * and added in bulk when it's closed or loaded */
+	if (c->server->batch || c->lazy) {
+		names_push(c, m);
+		return 1;
+	}
+
+	if (!avl_add(&(c->nicklist), c->server->casemapping, m->user->nick, m)) {
+		free_membership(m);
+		return 0;
+	}
+
+	c->nick_count++;
+
+	return 1;
+}
+
+int
+nicklist_del(channel *c, const char *nick)
+{
+	/* Remove a user from a channel's nicklist
+	 *
+	 * Returns 0 if the user isn't in the nicklist */
+
+	struct speaker *p;
+	size_t i;
+	void *m;
+
+	if (avl_del(&(c->nicklist), c->server->casemapping, nick, &m)) {
+		free_membership(m);
+		c->nick_count--;
+		return 1;
+	}
+
+	/* Users leaving before the end of a NAMES reply are unstaged */
+	for (i = 0; i < c->names.count; i++) {
+
+		m = c->names.memberships[i];
+
+		if (!irc_strcmp(c->server->casemapping, nick, ((membership *)m)->user->nick)) {
+			c->names.memberships[i] = c->names.memberships[--c->names.count];
+			free_membership(m);
+			return 1;
+		}
+	}
+
+	/* Lazy nicklists only count users, and forget departed speakers */
+	if (c->lazy) {
+
+		if ((p = hash_get(&(c->speakers.table), c->server->casemapping, nick)))
+			speaker_del(c, p);
+
+		if (c->nick_count)
+			c->nick_count--;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+nicklist_set_prefix(channel *c, const char *nick, char mode, int set)
+{
+	/* Set or unset a prefix mode of a user's membership in a channel
+	 *
+	 * Returns 0 if mode isn't a prefix mode or the user isn't in the channel */
+
+	const char *p;
+	membership *m;
+
+	if (mode == '\0' || (p = strchr(c->server->prefix_modes, mode)) == NULL)
+		return 0;
+
+	if ((m = membership_get(c, nick)) == NULL)
+		return 0;
+
+	if (set)
+		m->prefix |= (1 << (p - c->server->prefix_modes));
+	else
+		m->prefix &= ~(1 << (p - c->server->prefix_modes));
+
+	/* Staged memberships are classed once committed */
+	avl_set_class(&(c->nicklist), c->server->casemapping, m->user->nick, nicklist_class(m->prefix));
+
+	if (c == ccur)
+		draw(D_STATUS);
+
+	return 1;
+}
+
+int
+nicklist_stage(channel *c, const char *nick, unsigned char prefix)
+{
+	/* Stage a user from a NAMES reply, to be added to the channel's nicklist
+	 * in bulk by nicklist_commit
+	 *
+	 * Returns 0 if the user is already in the nicklist or staged, in which
+	 * case only the user's prefix modes are updated */
+
+	membership *m;
+
+	/* Lazy nicklists only count users, unless being loaded */
+	if (c->lazy && c->load != REQUEST_SENT) {
+		c->names.counted++;
+		return 1;
+	}
+
+	if ((m = membership_get(c, nick))) {
+		m->prefix = prefix;
+		return 0;
+	}
+
+	m = new_membership(c, nick, NULL);
+	m->prefix = prefix;
+
+	names_push(c, m);
+
+	/* Large channels listed on joining are only counted from the threshold */
+	if (!c->lazy && c->nick_count == 0 && nicklist_lazy_want(c, c->names.count)) {
+		c->names.counted = c->names.count;
+		nicklist_drop(c);
+	}
+
+	return 1;
+}
+
+static void
+names_del(channel *c, membership *m)
+{
+	/* Unstage a membership, the order of a NAMES reply isn't kept */
+
+	size_t i;
+
+	for (i = 0; i < c->names.count; i++) {
+		if (c->names.memberships[i] == m) {
+			c->names.memberships[i] = c->names.memberships[--c->names.count];
+			return;
+		}
+	}
+}
+
+static void
+names_push(channel *c, membership *m)
+{
+	if (c->names.count == c->names.size) {
+
+		c->names.size = (c->names.size) ? c->names.size * 2 : 64;
+
+		c->names.memberships = realloc(c->names.memberships,
+			sizeof(*c->names.memberships) * c->names.size);
+
+		if (c->names.memberships == NULL)
+			fatal("realloc");
+	}
+
+	c->names.memberships[c->names.count++] = m;
+}
+
+void
+nicklist_commit(channel *c)
+{
+	/* Add the users staged from a NAMES reply or batch to a channel's nicklist.
+	 * Lazy nicklists are only recounted, unless being loaded */
+
+	struct avl_entry *e;
+	size_t i, n = c->names.count;
+
+	if (c->lazy && c->load != REQUEST_SENT) {
+
+		/* Partial replies to abandoned loads are discarded */
+		free_names(c);
+
+		if (c->names.counted)
+			c->nick_count = c->names.counted;
+
+		c->names.counted = 0;
+		c->count_time = time(NULL);
+
+	} else {
+
+		if (c->lazy) {
+			c->lazy = 0;
+			c->load = REQUEST_DONE;
+			c->load_time = time(NULL);
+			c->nick_count = 0;
+		}
+
+		if (n == 0)
+			return;
+
+		if ((e = malloc(sizeof(*e) * n)) == NULL)
+			fatal("malloc");
+
+		for (i = 0; i < n; i++) {
+			e[i].key = c->names.memberships[i]->user->nick;
+			e[i].val = c->names.memberships[i];
+			e[i].class = nicklist_class(c->names.memberships[i]->prefix);
+		}
+
+		c->names.count = 0;
+
+		c->nick_count += avl_build(&(c->nicklist), c->server->casemapping, e, n, free_membership);
+
+		free(e);
+
+		/* Loaded lazy nicklists are kept until unused, see requests_flush() */
+		if (c->load != REQUEST_DONE && nicklist_lazy_want(c, c->nick_count))
+			nicklist_drop(c);
+	}
+
+	if (c == ccur)
+		draw(D_STATUS);
+}
+
+void
+nicklist_load(channel *c)
+{
+	/* Queue loading a lazy nicklist in full, or keep a loaded one from being
+	 * dropped */
+
+	if (c->buffer_type != BUFFER_CHANNEL || c->parted)
+		return;
+
+	c->load_time = time(NULL);
+
+	if (c->lazy && (c->load == REQUEST_NONE || c->load == REQUEST_DONE))
+		c->load = REQUEST_QUEUED;
+}
+
+void
+nicklist_set_policy(channel *c, nicklist_t policy)
+{
+	/* Set a channel's nicklist policy, dropping or loading its nicklist */
+
+	c->nicklist_policy = policy;
+
+	/* Parted channels apply the policy once rejoined */
+	if (c->parted)
+		c->lazy = (policy == NICKLIST_LAZY);
+	else if (!c->lazy && nicklist_lazy_want(c, c->nick_count))
+		nicklist_drop(c);
+	else if (c->lazy && !nicklist_lazy_want(c, c->nick_count))
+		nicklist_load(c);
+}
+
+unsigned char
+nicklist_class(unsigned char prefix)
+{
+	/* Nicklist nodes are classed by the membership's highest prefix mode,
+	 * 1 for the server's highest, or 0 without a prefix */
+
+	unsigned char class;
+
+	if (prefix == 0)
+		return 0;
+
+	for (class = 1; !(prefix & 1); prefix >>= 1)
+		class++;
+
+	return class;
+}
+
+int
+nicklist_cols(channel *c)
+{
+	/* Returns the columns of a channel taken by the nick sidebar */
+
+	if (!state.nicklist_shown || c->buffer_type != BUFFER_CHANNEL || term_cols < NICKLIST_COLS * 3)
+		return 0;
+
+	return NICKLIST_COLS;
+}
+
+void
+nicklist_toggle(void)
+{
+	/* Show or hide the nick sidebar, lazy nicklists are loaded while shown */
+
+	channel *c = ccur;
+
+	state.nicklist_shown = !state.nicklist_shown;
+
+	/* Lines wrap to the width left of the sidebar */
+	do {
+		c->resized = 1;
+	} while ((c = channel_get_next(c)) != ccur);
+
+	if (state.nicklist_shown)
+		nicklist_load(ccur);
+
+	draw(D_BUFFER);
+}
+
+void
+nicklist_scroll(channel *c, int rows)
+{
+	/* Scroll the nick sidebar by a page of rows, less its header row */
+
+	size_t page = (rows < -2 || rows > 2) ? (size_t)abs(rows) - 1 : 1;
+	size_t *scroll = &(c->draw.nicklist_scroll);
+
+	if (!nicklist_cols(c))
+		return;
+
+	if (rows < 0)
+		*scroll -= (*scroll > page) ? page : *scroll;
+	else if (*scroll + page < (size_t)c->nick_count)
+		*scroll += page;
+
+	draw(D_BUFFER);
+}
+
+static int
+nicklist_lazy_want(channel *c, size_t n)
+{
+	return (c->nicklist_policy == NICKLIST_LAZY
+	    || (c->nicklist_policy == NICKLIST_AUTO && n > (size_t)config.lazy_nicklist_threshold));
+}
+
+static void
+nicklist_drop(channel *c)
+{
+	/* Keep only a channel's count of users and recent speakers */
+
+	free_names(c);
+	free_avl(&(c->nicklist), free_membership);
+
+	c->lazy = 1;
+	c->load = REQUEST_NONE;
+	c->count_time = time(NULL);
+}
+
+static void
+free_names(channel *c)
+{
+	/* Free a channel's staged NAMES reply */
+
+	while (c->names.count)
+		free_membership(c->names.memberships[--c->names.count]);
+
+	free(c->names.memberships);
+
+	c->names.memberships = NULL;
+	c->names.size = 0;
+}
+
+user*
+user_set_nick(server *s, const char *from, const char *nick)
+{
+	/* Change a user's nick in the server's user table, in the nicklist of
+	 * each channel the user is a member of, and in the recent speakers of
+	 * lazy nicklists
+	 *
+	 * Returns the user, or NULL if the user shares no channels */
+
+	const char *from_nick;
+	channel *c = s->channel;
+	membership *m;
+	presence_t presence = PRESENCE_UNKNOWN;
+	user *t, *u;
+	void *val;
+
+	do {
+		if (c->lazy)
+			speaker_rename(c, from, nick);
+	} while ((c = c->next) != s->channel);
+
+	if ((u = hash_del(&(s->user_table), s->casemapping, from)) == NULL)
+		return NULL;
+
+	/* Watched nicks are cached while sharing no channels, the user replaces
+	 * the cached user of its new nick */
+	if ((t = user_get(s, nick)) && t->memberships == NULL) {
+		presence = t->presence;
+		free_user(s, t);
+	}
+
+	from_nick = u->nick;
+	u->nick = intern(&(s->intern_pool), nick);
+
+	hash_add(&(s->user_table), s->casemapping, u->nick, u);
+
+	/* Nicklist nodes borrow the user's nick, release it only once re-keyed */
+	for (m = u->memberships; m; m = m->next) {
+		/* Staged memberships are keyed only once committed */
+		if (avl_del(&(m->channel->nicklist), s->casemapping, from_nick, &val)) {
+			avl_add(&(m->channel->nicklist), s->casemapping, u->nick, m);
+			avl_set_class(&(m->channel->nicklist), s->casemapping, u->nick, nicklist_class(m->prefix));
+		}
+
+		speaker_rename(m->channel, from_nick, u->nick);
+	}
+
+	intern_release(from_nick);
+
+	/* Presence is of the nick rather than the user, unless only its case
+	 * changed */
+	if (irc_strcmp(s->casemapping, from, nick)) {
+
+		t = (hash_get(&(s->watch.nicks), s->casemapping, from) ? new_user(s, from) : NULL);
+
+		if (t)
+			t->presence = u->presence;
+
+		u->presence = presence;
+
+		if (hash_get(&(s->watch.nicks), s->casemapping, nick))
+			watch_presence(s, nick, NULL, PRESENCE_ONLINE);
+
+		if (t)
+			watch_presence(s, from, NULL, PRESENCE_OFFLINE);
+	}
+
+	return u;
+}
+
+struct speaker
+{
+	const char *nick;
+	time_t time;
+	struct speaker *prev;
+	struct speaker *next;
+};
+
+void
+speaker_add(channel *c, const char *nick)
+{
+	/* Move a user to the front of a channel's recent speakers, evicting the
+	 * least recent beyond SPEAKERS_MAX or older than SPEAKERS_WINDOW */
+
+	struct speakers *sp = &(c->speakers);
+	struct speaker *p;
+	time_t t = time(NULL);
+
+	if (c->server == NULL)
+		return;
+
+	if ((p = hash_get(&(sp->table), c->server->casemapping, nick))) {
+		speaker_unlink(sp, p);
+	} else {
+
+		if ((p = malloc(sizeof(*p))) == NULL)
+			fatal("malloc");
+
+		p->nick = intern(&(c->server->intern_pool), nick);
+
+		hash_add(&(sp->table), c->server->casemapping, p->nick, p);
+		sp->count++;
+	}
+
+	p->time = t;
+
+	speaker_link(sp, p);
+
+	while (sp->count > SPEAKERS_MAX || t - sp->tail->time >= SPEAKERS_WINDOW)
+		speaker_del(c, sp->tail);
+}
+
+int
+speaker_recent(channel *c, const char *nick)
+{
+	/* Returns 1 if a user spoke in a channel within SPEAKERS_WINDOW seconds */
+
+	struct speaker *p;
+
+	if (c->server == NULL || (p = hash_get(&(c->speakers.table), c->server->casemapping, nick)) == NULL)
+		return 0;
+
+	return (time(NULL) - p->time < SPEAKERS_WINDOW);
+}
+
+const char*
+nick_complete(channel *c, const char *str, size_t len, size_t n)
+{
+	/* Returns the nth nick in a channel beginning with str, or NULL once
+	 * there are no more. Recent speakers come first, most recent first,
+	 * followed by the rest of the nicklist in order
+	 *
+	 * The speakers are bounded by SPEAKERS_MAX and the nicklist's matches
+	 * are found by rank, so a 20k user channel costs the same as a small
+	 * one: O(SPEAKERS_MAX log N) */
+
+	casemapping_t cm;
+	size_t first, count, k, t, skip[SPEAKERS_MAX], nskip = 0, i, j;
+	struct speaker *p;
+	const char *match = NULL;
+
+	if (c->server == NULL)
+		return NULL;
+
+	cm = c->server->casemapping;
+
+	for (p = c->speakers.head; p; p = p->next) {
+
+		if (irc_strncmp(cm, p->nick, str, len))
+			continue;
+
+		/* Speakers who have since left a loaded nicklist aren't offered */
+		if (!c->lazy) {
+
+			if (avl_get(&(c->nicklist), cm, p->nick, strlen(p->nick) + 1) == NULL)
+				continue;
+
+			skip[nskip++] = avl_rank(&(c->nicklist), cm, p->nick, -1);
+		}
+
+		if (match == NULL && n-- == 0)
+			match = p->nick;
+	}
+
+	if (match || c->lazy)
+		return match;
+
+	/* Skip over the speakers already offered, in order of rank */
+	for (i = 1; i < nskip; i++) {
+		for (t = skip[i], j = i; j > 0 && skip[j - 1] > t; j--)
+			skip[j] = skip[j - 1];
+		skip[j] = t;
+	}
+
+	count = avl_prefix(&(c->nicklist), cm, str, len, &first);
+
+	for (k = first + n, i = 0; i < nskip && skip[i] <= k; i++)
+		k++;
+
+	if (k >= first + count)
+		return NULL;
+
+	return avl_select(&(c->nicklist), k, -1)->key;
+}
+
+static void
+speaker_rename(channel *c, const char *from, const char *nick)
+{
+	/* Re-key a recent speaker after a nick change */
+
+	struct speakers *sp = &(c->speakers);
+	struct speaker *p, *q;
+
+	if ((p = hash_del(&(sp->table), c->server->casemapping, from)) == NULL)
+		return;
+
+	/* A previous user of the nick is no longer the same speaker */
+	if ((q = hash_get(&(sp->table), c->server->casemapping, nick)))
+		speaker_del(c, q);
+
+	intern_release(p->nick);
+	p->nick = intern(&(c->server->intern_pool), nick);
+
+	hash_add(&(sp->table), c->server->casemapping, p->nick, p);
+}
+
+static void
+speaker_del(channel *c, struct speaker *p)
+{
+	struct speakers *sp = &(c->speakers);
+
+	hash_del(&(sp->table), c->server->casemapping, p->nick);
+	speaker_unlink(sp, p);
+	intern_release(p->nick);
+	free(p);
+
+	sp->count--;
+}
+
+static void
+speaker_link(struct speakers *sp, struct speaker *p)
+{
+	p->prev = NULL;
+	p->next = sp->head;
+
+	if (sp->head)
+		sp->head->prev = p;
+	else
+		sp->tail = p;
+
+	sp->head = p;
+}
+
+static void
+speaker_unlink(struct speakers *sp, struct speaker *p)
+{
+	if (p->prev)
+		p->prev->next = p->next;
+	else
+		sp->head = p->next;
+
+	if (p->next)
+		p->next->prev = p->prev;
+	else
+		sp->tail = p->prev;
+}
+
+static void
+free_speakers(channel *c)
+{
+	struct speakers *sp = &(c->speakers);
+	struct speaker *p;
+
+	while ((p = sp->head)) {
+		sp->head = p->next;
+		intern_release(p->nick);
+		free(p);
+	}
+
+	free_hash(&(sp->table));
+
+	sp->tail = NULL;
+	sp->count = 0;
+}
+
+int
+netsplit_quit(channel *c, const char *nick, const char *mesg)
+{
+	/* Count a user quitting a channel in a netsplit, rather than printing it
+	 *
+	 * Returns 0 if the QUIT message isn't a netsplit's */
+
+	const char *key;
+	server *s = c->server;
+	struct netsplit *n;
+
+	if (mesg == NULL || !check_netsplit(mesg))
+		return 0;
+
+	for (n = s->netsplits; n && strcmp(n->servers, mesg); n = n->next)
+		;
+
+	if (n == NULL) {
+
+		if ((n = calloc(1, sizeof(*n))) == NULL)
+			fatal("calloc");
+
+		n->servers = strdup(mesg);
+		n->next = s->netsplits;
+		s->netsplits = n;
+	}
+
+	key = intern(&(s->intern_pool), nick);
+
+	if (!hash_add(&(n->nicks), s->casemapping, key, (void *)key))
+		intern_release(key);
+
+	netsplit_channel(n, c)->quits++;
+	n->quit_time = time(NULL);
+
+	return 1;
+}
+
+int
+netsplit_join(channel *c, const char *nick)
+{
+	/* Count a user rejoining a channel after a netsplit, rather than printing it
+	 *
+	 * Returns 0 if the user wasn't lost in a netsplit */
+
+	server *s = c->server;
+	struct netsplit *n;
+
+	for (n = s->netsplits; n && !hash_get(&(n->nicks), s->casemapping, nick); n = n->next)
+		;
+
+	if (n == NULL)
+		return 0;
+
+	netsplit_channel(n, c)->joins++;
+	n->join_time = time(NULL);
+
+	return 1;
+}
+
+void
+netsplit_flush(server *s, time_t t)
+{
+	/* Print the counts of netsplits and netjoins with no QUIT or JOIN in the
+	 * last NETSPLIT_WINDOW seconds, and forget netsplits that have timed out */
+
+	const char *server2;
+	int len;
+	struct netsplit *n, **np;
+	struct netsplit_channel *nc, **ncp;
+
+	for (np = &(s->netsplits); (n = *np); ) {
+
+		server2 = strchr(n->servers, ' ') + 1;
+		len = server2 - n->servers - 1;
+
+		for (ncp = &(n->channels); (nc = *ncp); ) {
+
+			if (nc->quits && t - n->quit_time >= NETSPLIT_WINDOW) {
+				newlinef(nc->channel, 0, "<", "Netsplit %.*s <-> %s: %u user%s",
+					len, n->servers, server2, nc->quits, (nc->quits == 1 ? "" : "s"));
+				nc->quits = 0;
+			}
+
+			if (nc->joins && t - n->join_time >= NETSPLIT_WINDOW) {
+				newlinef(nc->channel, 0, ">", "Netjoin %.*s <-> %s: %u user%s",
+					len, n->servers, server2, nc->joins, (nc->joins == 1 ? "" : "s"));
+				nc->joins = 0;
+			}
+
+			if (nc->quits == 0 && nc->joins == 0) {
+				*ncp = nc->next;
+				free(nc);
+			} else {
+				ncp = &(nc->next);
+			}
+		}
+
+		if (n->channels == NULL
+		 && t - n->quit_time >= NETSPLIT_TIMEOUT
+		 && t - n->join_time >= NETSPLIT_TIMEOUT) {
+			*np = n->next;
+			free_netsplit(n);
+		} else {
+			np = &(n->next);
+		}
+	}
+}
+
+void
+free_netsplits(server *s)
+{
+	struct netsplit *n;
+
+	while ((n = s->netsplits)) {
+		s->netsplits = n->next;
+		free_netsplit(n);
+	}
+}
+
+int
+flood_check(server *s, const char *nick, const char *hostinfo, channel *c, flood_t kind)
+{
+	/* Take a message's tokens from the sender's and server's buckets, and
+	 * count it if it's dropped. Dropped messages are printed in c, or the
+	 * server buffer if NULL
+	 *
+	 * Returns 1 if the message is over a limit and should be dropped */
+
+	struct flood *f = &(s->flood);
+	struct flood_bucket b[2];
+	struct flood_sender *p;
+	time_t t = time(NULL);
+	size_t i, n = 0;
+
+	if ((p = hash_get(&(f->table), s->casemapping, nick)) == NULL) {
+
+		if ((p = calloc(1, sizeof(*p))) == NULL)
+			fatal("calloc");
+
+		p->nick = intern(&(s->intern_pool), nick);
+		p->next = f->head;
+		f->head = p;
+
+		hash_add(&(f->table), s->casemapping, p->nick, p);
+	}
+
+	/* The sender's bucket, then the server's */
+	if (kind == FLOOD_CTCP) {
+		b[n].time = &(p->ctcp);
+		b[n].burst = FLOOD_CTCP_BURST;
+		b[n++].refill = FLOOD_CTCP_REFILL;
+		b[n].time = &(f->reply);
+		b[n].burst = FLOOD_REPLY_BURST;
+		b[n++].refill = FLOOD_REPLY_REFILL;
+	} else {
+		b[n].time = &(p->mesg);
+		b[n].burst = FLOOD_MESG_BURST;
+		b[n++].refill = FLOOD_MESG_REFILL;
+	}
+
+	if (kind == FLOOD_PRIVATE) {
+		b[n].time = &(f->private);
+		b[n].burst = FLOOD_PRIVATE_BURST;
+		b[n++].refill = FLOOD_PRIVATE_REFILL;
+	}
+
+	if ((i = flood_take(b, n, t)) == n)
+		return 0;
+
+	/* Messages dropped over only the server's limits, from many senders at
+	 * once, are counted together */
+	if (i > 0) {
+
+		if (f->dropped++ == 0)
+			f->first = t;
+
+		if (!p->counted) {
+			p->counted = 1;
+			f->senders++;
+		}
+
+		f->last = t;
+
+		return 1;
+	}
+
+	if (p->dropped++ == 0)
+		p->first = t;
+
+	p->last = t;
+	p->channel = c;
+
+	if (p->dropped >= FLOOD_IGNORE && p->ignore == NULL && config.flood_ignore > 0)
+		flood_ignore(s, p, hostinfo, t);
+
+	return 1;
+}
+
+void
+flood_flush(server *s, time_t t)
+{
+	/* Print the counts of messages dropped with none dropped in the last
+	 * FLOOD_WINDOW seconds, or for the last FLOOD_REPORT seconds. Lift
+	 * expired ignores and forget senders with full buckets */
+
+	struct flood *f = &(s->flood);
+	struct flood_sender *p, **pp;
+	int report;
+
+	report = (f->dropped && (t - f->last >= FLOOD_WINDOW || t - f->first >= FLOOD_REPORT));
+
+	if (report) {
+		newlinef(s->channel, 0, "--", "%u message%s suppressed from %u user%s",
+			f->dropped, (f->dropped == 1 ? "" : "s"), f->senders, (f->senders == 1 ? "" : "s"));
+		f->dropped = 0;
+		f->senders = 0;
+	}
+
+	for (pp = &(f->head); (p = *pp); ) {
+
+		if (report)
+			p->counted = 0;
+
+		if (p->dropped && (t - p->last >= FLOOD_WINDOW || t - p->first >= FLOOD_REPORT)) {
+			newlinef((p->channel ? p->channel : s->channel), 0, "--", "%u message%s suppressed from %s",
+				p->dropped, (p->dropped == 1 ? "" : "s"), p->nick);
+			p->dropped = 0;
+		}
+
+		if (p->ignore && t >= p->ignore_time) {
+
+			if (ignore_del(&(s->ignore), s->casemapping, p->ignore))
+				newlinef(s->channel, 0, "--", "No longer ignoring '%s'", p->ignore);
+
+			free(p->ignore);
+			p->ignore = NULL;
+		}
+
+		if (p->dropped == 0 && p->ignore == NULL && !p->counted && p->mesg <= t && p->ctcp <= t) {
+			*pp = p->next;
+			if (hash_get(&(f->table), s->casemapping, p->nick) == p)
+				hash_del(&(f->table), s->casemapping, p->nick);
+			intern_release(p->nick);
+			free(p);
+		} else {
+			pp = &(p->next);
+		}
+	}
+}
+
+void
+free_floods(server *s)
+{
+	struct flood *f = &(s->flood);
+	struct flood_sender *p;
+
+	while ((p = f->head)) {
+		f->head = p->next;
+		intern_release(p->nick);
+		free(p->ignore);
+		free(p);
+	}
+
+	free_hash(&(f->table));
+}
+
+void
+sendq_add(channel *c, const char *text, size_t len)
+{
+	/* Queue a message's text to send to a channel, see sendq_flush() */
+
+	struct sendq *q = &(c->server->sendq);
+	struct sendq_line *l;
+
+	if ((l = malloc(sizeof(*l) + len + 1)) == NULL)
+		fatal("malloc");
+
+	memcpy(l->text, text, len);
+	l->text[len] = 0;
+	l->channel = c;
+	l->next = NULL;
+
+	if (q->tail)
+		q->tail->next = l;
+	else
+		q->head = l;
+
+	q->tail = l;
+	q->count++;
+}
+
+unsigned int
+sendq_cancel(server *s, channel *c)
+{
+	/* Discard the lines queued to a channel, or to every channel of a server
+	 * if c is NULL
+	 *
+	 * Returns the number of lines discarded */
+
+	struct sendq *q;
+	struct sendq_line *l, **lp;
+	unsigned int n = 0;
+
+	if (s == NULL)
+		return 0;
+
+	q = &(s->sendq);
+	q->tail = NULL;
+
+	for (lp = &(q->head); (l = *lp); ) {
+		if (c == NULL || l->channel == c) {
+			*lp = l->next;
+			free(l);
+			n++;
+		} else {
+			q->tail = l;
+			lp = &(l->next);
+		}
+	}
+
+	q->count -= n;
+
+	return n;
+}
+
+void
+sendq_flush(server *s, time_t t)
+{
+	/* Send queued lines while the server's message timer allows, echoing
+	 * each to its channel as it's sent. Sending fewer than SENDQ_BURST
+	 * seconds of messages ahead keeps clear of the server's flood limits */
+
+	char err[MAX_ERROR];
+	channel *c;
+	struct sendq *q = &(s->sendq);
+	struct sendq_line *l;
+	unsigned int n;
+
+	while ((l = q->head) && q->time - t < SENDQ_BURST) {
+
+		if (l->channel->parted) {
+			c = l->channel;
+			n = sendq_cancel(s, c);
+			newlinef(c, 0, "--", "Paste cancelled, %u line%s not sent", n, (n == 1 ? "" : "s"));
+			continue;
+		}
+
+		if (sendf(err, s, "PRIVMSG %s :%s", l->channel->name, l->text)) {
+			c = l->channel;
+			n = sendq_cancel(s, c);
+			newline(c, 0, "-!!-", err);
+			newlinef(c, 0, "--", "Paste cancelled, %u line%s not sent", n, (n == 1 ? "" : "s"));
+			continue;
+		}
+
+		newline(l->channel, LINE_CHAT, s->nick, l->text);
+
+		if ((q->head = l->next) == NULL)
+			q->tail = NULL;
+
+		q->count--;
+		free(l);
+	}
+}
+
+int
+watch_add(server *s, const char *nick)
+{
+	/* Add a nick to a server's watch list, sent by the next watch_flush()
+	 *
+	 * Returns 0 if the nick is already watched */
+
+	struct watch_nick *w;
+
+	if (hash_get(&(s->watch.nicks), s->casemapping, nick))
+		return 0;
+
+	if ((w = calloc(1, sizeof(*w))) == NULL)
+		fatal("calloc");
+
+	w->nick = intern(&(s->intern_pool), nick);
+	w->pending = 1;
+
+	hash_add(&(s->watch.nicks), s->casemapping, w->nick, w);
+
+	s->watch.pending++;
+
+	return 1;
+}
+
+int
+watch_del(server *s, const char *nick)
+{
+	/* Remove a nick from a server's watch list, along with its user if it
+	 * shares no channels
+	 *
+	 * Returns 0 if the nick isn't watched */
+
+	char err[MAX_ERROR];
+	struct watch_nick *w;
+	user *u;
+
+	if ((w = hash_del(&(s->watch.nicks), s->casemapping, nick)) == NULL)
+		return 0;
+
+	if (w->pending)
+		s->watch.pending--;
+
+	if (w->monitored) {
+		s->watch.monitored--;
+
+		if (sendf(err, s, "MONITOR - %s", w->nick))
+			newline(s->channel, 0, "-!!-", err);
+	}
+
+	if ((u = user_get(s, nick)) && u->memberships == NULL)
+		free_user(s, u);
+	else if (u)
+		u->presence = PRESENCE_UNKNOWN;
+
+	intern_release(w->nick);
+	free(w);
+
+	return 1;
+}
+
+void
+watch_flush(server *s, time_t t)
+{
+	/* Send the nicks added to a server's watch list, and poll those not on
+	 * its MONITOR list every WATCH_ISON_INTERVAL seconds
+	 *
+	 * Added nicks go on the MONITOR list while it's under the server's limit.
+	 * ISON replies are matched to polls in order, a poll still without a
+	 * reply by the next is abandoned */
+
+	char err[MAX_ERROR], buf[BUFFSIZE];
+	const char **monitor, **ison;
+	size_t i, k, len, linelen, room, m = 0, n = 0;
+	struct watch *w = &(s->watch);
+	struct watch_ison *p, **pp;
+	struct watch_nick *e;
+	int poll;
+
+	if (s->soc < 0 || !w->ready)
+		return;
+
+	poll = (t - w->ison_time >= WATCH_ISON_INTERVAL && w->monitored < w->nicks.count);
+
+	if (w->pending == 0 && !poll)
+		return;
+
+	if ((monitor = malloc(sizeof(*monitor) * w->nicks.count * 2)) == NULL)
+		fatal("malloc");
+
+	ison = monitor + w->nicks.count;
+
+	for (i = 0; i < w->nicks.size; i++) {
+
+		if (w->nicks.entries[i].key == NULL)
+			continue;
+
+		e = w->nicks.entries[i].val;
+
+		if (e->pending && w->monitored < s->isupport.monitor) {
+			e->monitored = 1;
+			w->monitored++;
+			monitor[m++] = e->nick;
+		} else if (!e->monitored && (e->pending || poll)) {
+			ison[n++] = e->nick;
+		}
+
+		e->pending = 0;
+	}
+
+	w->pending = 0;
+
+	if (poll) {
+		free_watch_ison(s);
+		w->ison_time = t;
+	}
+
+	linelen = ISUPPORT(s, linelen, ISUPPORT_LINELEN);
+	linelen = (linelen < BUFFSIZE) ? linelen : BUFFSIZE - 1;
+
+	/* MONITOR + <target>{,<target>} */
+	len = strlen("MONITOR + \r\n");
+	room = (len < linelen) ? linelen - len : 0;
+
+	for (i = 0; i < m; i += k) {
+
+		k = watch_pack(buf, room, monitor + i, m - i, ',');
+
+		if (sendf(err, s, "MONITOR + %s", buf)) {
+			newline(s->channel, 0, "-!!-", err);
+			goto free;
+		}
+	}
+
+	/* ISON <nick>{ <nick>}, sized for the reply :<server> 303 <nick> :<nicks> */
+	len = strlen(": 303  :\r\n") + ISUPPORT(s, hostlen, ISUPPORT_HOSTLEN) + strlen(s->nick);
+	room = (len < linelen) ? linelen - len : 0;
+
+	for (pp = &(w->ison); *pp; pp = &((*pp)->next))
+		;
+
+	for (i = 0; i < n; i += k) {
+
+		k = watch_pack(buf, room, ison + i, n - i, ' ');
+
+		if (sendf(err, s, "ISON %s", buf)) {
+			newline(s->channel, 0, "-!!-", err);
+			goto free;
+		}
+
+		if ((p = malloc(sizeof(*p) + strlen(buf) + 1)) == NULL)
+			fatal("malloc");
+
+		strcpy(p->nicks, buf);
+		p->next = NULL;
+
+		*pp = p;
+		pp = &(p->next);
+	}
+
+free:
+
+	free(monitor);
+}
+
+static size_t
+watch_pack(char *buf, size_t room, const char **nicks, size_t n, char sep)
+{
+	/* Write as many nicks as fit in room bytes to buf, separated by sep, and
+	 * at least one. Returns the number of nicks written */
+
+	size_t i, len = 0, nick_len;
+
+	for (i = 0; i < n; i++) {
+
+		nick_len = strlen(nicks[i]);
+
+		if (i && len + 1 + nick_len > room)
+			break;
+
+		if (i)
+			buf[len++] = sep;
+
+		memcpy(buf + len, nicks[i], nick_len);
+		len += nick_len;
+	}
+
+	buf[len] = 0;
+
+	return i;
+}
+
+int
+watch_ison(server *s, const char *online)
+{
+	/* Set the presence of the nicks of a server's oldest ISON poll from its
+	 * reply, nicks not listed are offline
+	 *
+	 * Returns 0 if no poll is awaiting a reply */
+
+	struct watch_ison *p;
+	const char *q;
+	char *nick, *nicks;
+	size_t len, n;
+
+	if ((p = s->watch.ison) == NULL)
+		return 0;
+
+	s->watch.ison = p->next;
+
+	for (nicks = p->nicks; (nick = getarg(&nicks, " ")); ) {
+
+		len = strlen(nick);
+
+		for (q = online; *(q += strspn(q, " ")); q += n) {
+			if ((n = strcspn(q, " ")) == len && !irc_strncmp(s->casemapping, q, nick, n))
+				break;
+		}
+
+		watch_presence(s, nick, NULL, (*q ? PRESENCE_ONLINE : PRESENCE_OFFLINE));
+	}
+
+	free(p);
+
+	return 1;
+}
+
+void
+watch_presence(server *s, const char *nick, const char *hostinfo, presence_t presence)
+{
+	/* Set a watched nick's presence in its cached user, printing changes to
+	 * the nick's private buffer, or else the server buffer. Nicks first
+	 * found offline aren't printed */
+
+	channel *c;
+	presence_t prev;
+	user *u;
+
+	if (!hash_get(&(s->watch.nicks), s->casemapping, nick))
+		return;
+
+	if ((u = user_get(s, nick)) == NULL)
+		u = new_user(s, nick);
+
+	if (hostinfo)
+		user_set_str(&(u->hostinfo), hostinfo);
+
+	if ((prev = u->presence) == presence)
+		return;
+
+	u->presence = presence;
+
+	if ((c = hash_get(&(s->chan_table), s->casemapping, nick)) && c->buffer_type == BUFFER_PRIVATE) {
+		if (c == ccur)
+			draw(D_STATUS);
+	} else {
+		c = s->channel;
+	}
+
+	if (presence == PRESENCE_OFFLINE && prev == PRESENCE_UNKNOWN)
+		return;
+
+	if (presence == PRESENCE_OFFLINE)
+		newlinef(c, 0, "--", "%s is offline", u->nick);
+	else if (u->hostinfo)
+		newlinef(c, 0, "--", "%s is online (%s)", u->nick, u->hostinfo);
+	else
+		newlinef(c, 0, "--", "%s is online", u->nick);
+}
+
+void
+watch_print(channel *c)
+{
+	/* Print a server's watch list as a table, sorted by nick, online nicks
+	 * prefixed with '*' */
+
+	struct column *items;
+	struct watch_nick *w;
+	size_t i, n = 0, online = 0;
+	user *u;
+
+	if (c->server == NULL)
+		return;
+
+	if (c->server->watch.nicks.count == 0) {
+		newline(c, 0, "--", "Watch list is empty");
+		return;
+	}
+
+	if ((items = malloc(sizeof(*items) * c->server->watch.nicks.count)) == NULL)
+		fatal("malloc");
+
+	for (i = 0; i < c->server->watch.nicks.size; i++) {
+
+		if (c->server->watch.nicks.entries[i].key == NULL)
+			continue;
+
+		w = c->server->watch.nicks.entries[i].val;
+
+		u = user_get(c->server, w->nick);
+
+		items[n].text = w->nick;
+		items[n].prefix = (u && u->presence == PRESENCE_ONLINE) ? '*' : 0;
+
+		online += (items[n++].prefix != 0);
+	}
+
+	qsort(items, n, sizeof(*items), column_cmp);
+
+	newlinef(c, 0, "--", "Watching %zu nick%s, %zu online:", n, (n == 1 ? "" : "s"), online);
+
+	print_columns(c, items, n);
+
+	free(items);
+}
+
+void
+watch_reset(server *s)
+{
+	/* Forget the presence of a server's watched nicks on disconnect, they're
+	 * sent again once registered */
+
+	struct watch *w = &(s->watch);
+	struct watch_nick *e;
+	size_t i;
+	user *u;
+
+	free_watch_ison(s);
+
+	for (i = 0; i < w->nicks.size; i++) {
+
+		if (w->nicks.entries[i].key == NULL)
+			continue;
+
+		e = w->nicks.entries[i].val;
+
+		if ((u = user_get(s, e->nick)))
+			u->presence = PRESENCE_UNKNOWN;
+
+		e->monitored = 0;
+		e->pending = 1;
+	}
+
+	w->pending = w->nicks.count;
+	w->monitored = 0;
+	w->ison_time = 0;
+	w->ready = 0;
+}
+
+void
+watch_unmonitor(server *s, char *targets)
+{
+	/* Poll the watched nicks a server refused to MONITOR, its list being full,
+	 * and stop adding to the list */
+
+	struct watch_nick *w;
+	char *nick;
+
+	while ((nick = getarg(&targets, ","))) {
+		if ((w = hash_get(&(s->watch.nicks), s->casemapping, nick)) && w->monitored) {
+			w->monitored = 0;
+			s->watch.monitored--;
+		}
+	}
+
+	s->isupport.monitor = s->watch.monitored;
+	s->watch.ison_time = 0;
+}
+
+void
+free_watch(server *s)
+{
+	/* Free a server's watch list, and the users cached for it */
+
+	struct watch_nick *w;
+	size_t i;
+	user *u;
+
+	free_watch_ison(s);
+
+	for (i = 0; i < s->watch.nicks.size; i++) {
+
+		if (s->watch.nicks.entries[i].key == NULL)
+			continue;
+
+		w = s->watch.nicks.entries[i].val;
+
+		if ((u = user_get(s, w->nick)) && u->memberships == NULL)
+			free_user(s, u);
+
+		intern_release(w->nick);
+		free(w);
+	}
+
+	free_hash(&(s->watch.nicks));
+}
+
+static void
+free_watch_ison(server *s)
+{
+	struct watch_ison *p;
+
+	while ((p = s->watch.ison)) {
+		s->watch.ison = p->next;
+		free(p);
+	}
+}
+
+static void
+watch_release(void *arg)
+{
+	/* Free a watched nick colliding under a new casemapping */
+
+	struct watch_nick *w = arg;
+
+	intern_release(w->nick);
+	free(w);
+}
+
+struct batch*
+batch_get(server *s, const char *ref)
+{
+	struct batch *b;
+
+	for (b = s->batches; b && strcmp(b->ref, ref); b = b->next)
+		;
+
+	return b;
+}
+
+int
+batch_open(server *s, const char *ref, const char *type, const char *target)
+{
+	/* Open a batch of messages tagged with its reference
+	 *
+	 * Returns 0 if the reference is already open */
+
+	struct batch *b;
+	size_t ref_len = strlen(ref) + 1, type_len = strlen(type) + 1;
+
+	if (batch_get(s, ref))
+		return 0;
+
+	if (target == NULL)
+		target = "";
+
+	if ((b = malloc(sizeof(*b) + ref_len + type_len + strlen(target) + 1)) == NULL)
+		fatal("malloc");
+
+	b->type = b->ref + ref_len;
+	b->target = b->type + type_len;
+
+	strcpy(b->ref, ref);
+	strcpy(b->type, type);
+	strcpy(b->target, target);
+
+	b->next = s->batches;
+	s->batches = b;
+
+	return 1;
+}
+
+int
+batch_close(server *s, const char *ref)
+{
+	/* Close a batch. When the server's last open batch is closed, the users
+	 * staged in its channels' nicklists are added and held redraws applied
+	 *
+	 * Returns 0 if the reference isn't open */
+
+	channel *c;
+	struct batch *b, **bp;
+
+	for (bp = &(s->batches); (b = *bp) && strcmp(b->ref, ref); bp = &(b->next))
+		;
+
+	if (b == NULL)
+		return 0;
+
+	*bp = b->next;
+
+	if (s->batch == b)
+		s->batch = NULL;
+
+	free(b);
+
+	if (s->batches == NULL) {
+
+		/* Lazy nicklists are committed at the end of their NAMES reply */
+		c = s->channel;
+		do {
+			if (!c->lazy)
+				nicklist_commit(c);
+		} while ((c = c->next) != s->channel);
+
+		draw(s->batch_draw);
+		s->batch_draw = 0;
+	}
+
+	return 1;
+}
+
+void
+free_batches(server *s)
+{
+	struct batch *b;
+
+	while ((b = s->batches)) {
+		s->batches = b->next;
+		free(b);
+	}
+
+	s->batch = NULL;
+	s->batch_draw = 0;
+}
+
+static struct netsplit_channel*
+netsplit_channel(struct netsplit *n, channel *c)
+{
+	/* Return the counts of a netsplit for a channel, creating them if needed */
+
+	struct netsplit_channel *nc;
+
+	for (nc = n->channels; nc && nc->channel != c; nc = nc->next)
+		;
+
+	if (nc == NULL) {
+
+		if ((nc = calloc(1, sizeof(*nc))) == NULL)
+			fatal("calloc");
+
+		nc->channel = c;
+		nc->next = n->channels;
+		n->channels = nc;
+	}
+
+	return nc;
+}
+
+static void
+netsplit_forget(channel *c)
+{
+	/* Discard the uncounted netsplits and netjoins of a channel being freed */
+
+	struct netsplit *n;
+	struct netsplit_channel *nc, **ncp;
+
+	if (c->server == NULL)
+		return;
+
+	for (n = c->server->netsplits; n; n = n->next) {
+		for (ncp = &(n->channels); (nc = *ncp); ) {
+			if (nc->channel == c) {
+				*ncp = nc->next;
+				free(nc);
+			} else {
+				ncp = &(nc->next);
+			}
+		}
+	}
+}
+
+static void
+flood_forget(channel *c)
+{
+	/* Print the messages dropped from a channel being freed in the server buffer */
+
+	struct flood_sender *p;
+
+	if (c->server == NULL)
+		return;
+
+	for (p = c->server->flood.head; p; p = p->next) {
+		if (p->channel == c)
+			p->channel = NULL;
+	}
+}
+
+static void
+flood_ignore(server *s, struct flood_sender *p, const char *hostinfo, time_t t)
+{
+	/* Ignore a flooding sender's host for config.flood_ignore seconds, or
+	 * their nick if the host isn't known. Masks already ignored are left
+	 * as they are */
+
+	const char *host;
+	char mask[BUFFSIZE];
+
+	if (hostinfo && (host = strchr(hostinfo, '@')))
+		snprintf(mask, sizeof(mask), "*!*%s", host);
+	else
+		snprintf(mask, sizeof(mask), "%s", p->nick);
+
+	if (!ignore_add(&(s->ignore), s->casemapping, mask))
+		return;
+
+	if ((p->ignore = strdup(mask)) == NULL)
+		fatal("strdup");
+
+	p->ignore_time = t + config.flood_ignore;
+
+	newlinef(s->channel, 0, "--", "Ignoring '%s' for %d seconds, flooding", mask, config.flood_ignore);
+}
+
+static void
+free_netsplit(struct netsplit *n)
+{
+	struct netsplit_channel *nc;
+	size_t i;
+
+	for (i = 0; i < n->nicks.size; i++) {
+		if (n->nicks.entries[i].key)
+			intern_release(n->nicks.entries[i].key);
+	}
+
+	while ((nc = n->channels)) {
+		n->channels = nc->next;
+		free(nc);
+	}
+
+	free_hash(&(n->nicks));
+	free(n->servers);
+	free(n);
+}
+
+static void
+netsplit_release(void *nick)
+{
+	intern_release(nick);
+}
+
 /* Usefull server/channel structure abstractions for drawing */
 
 channel*
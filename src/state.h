@@ -12,6 +12,8 @@ struct state
 	channel *default_channel; /* the default rirc channel at startup */
 
 	server *server_list;
+
+	int nicklist_shown; /* Nick sidebar toggled on */
 };
 
 void init_state(void);
@@ -27,6 +29,14 @@ channel* channel_get_last(void);
 channel* channel_get_next(channel*);
 channel* channel_get_prev(channel*);
 
+/* A server's channel directory buffer, created if needed */
+channel* directory_get(server*);
+channel* directory_open(server*);
+
+/* Users are shared between the nicklists of a server's channels, and cache
+ * what's known of them from message prefixes and WHO replies */
+user* user_get(server*, const char*);
+
 /* State altering interface */
 channel* new_channel(char*, server*, channel*, buffer_t);
 void auto_nick(char**, char*);
@@ -37,13 +47,59 @@ void channel_close(channel*);
 void channel_move_prev(void);
 void channel_move_next(void);
 void channel_set_current(channel*);
-void channel_set_mode(channel*, const char*);
+void channel_set_mode(channel*, char, int, const char*);
 void free_channel(channel*);
+void free_netsplits(server*);
+void free_floods(server*);
+void free_batches(server*);
 void newline(channel*, line_t, const char*, const char*);
 void newlinef(channel*, line_t, const char*, const char*, ...);
+void newevent(channel*, event_t, const char*, const char*, const char*, const char*);
+int nicklist_add(channel*, const char*, const char*);
+int nicklist_del(channel*, const char*);
+int nicklist_set_prefix(channel*, const char*, char, int);
+int nicklist_stage(channel*, const char*, unsigned char);
+void nicklist_commit(channel*);
+void nicklist_load(channel*);
+void nicklist_set_policy(channel*, nicklist_t);
+void nicklist_scroll(channel*, int);
+void nicklist_toggle(void);
+int nicklist_cols(channel*);
+unsigned char nicklist_class(unsigned char);
 void nicklist_print(channel*);
+void ignore_print(channel*);
+int batch_open(server*, const char*, const char*, const char*);
+int batch_close(server*, const char*);
+struct batch* batch_get(server*, const char*);
+int netsplit_join(channel*, const char*);
+int netsplit_quit(channel*, const char*, const char*);
+void netsplit_flush(server*, time_t);
+int flood_check(server*, const char*, const char*, channel*, flood_t);
+void flood_flush(server*, time_t);
 void part_channel(channel*);
 void reset_channel(channel*);
+void server_set_casemapping(server*, casemapping_t);
+void speaker_add(channel*, const char*);
+int speaker_recent(channel*, const char*);
+const char* nick_complete(channel*, const char*, size_t, size_t);
 void server_set_mode(server*, const char*);
+int server_set_chanmodes(server*, const char*);
+int server_set_prefix(server*, const char*);
+user* user_set_nick(server*, const char*, const char*);
+user* user_seen(server*, const char*, const char*);
+user* user_set_info(server*, const char*, const char*, const char*, const char*, int);
+void requests_flush(server*, time_t);
+void sendq_add(channel*, const char*, size_t);
+unsigned int sendq_cancel(server*, channel*);
+void sendq_flush(server*, time_t);
+int watch_add(server*, const char*);
+int watch_del(server*, const char*);
+int watch_ison(server*, const char*);
+void watch_flush(server*, time_t);
+void watch_presence(server*, const char*, const char*, presence_t);
+void watch_print(channel*);
+void watch_reset(server*);
+void watch_unmonitor(server*, char*);
+void free_watch(server*);
 
 #endif
@@ -1,28 +1,127 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
-#include <setjmp.h>
 #include <stdarg.h>
 #include <string.h>
-#include <strings.h>
 
 #include "common.h"
 
 #define H(N) (N == NULL ? 0 : N->height)
 #define MAX(A, B) (A > B ? A : B)
+#define MIN(A, B) (A < B ? A : B)
+
+
+/* AVL trees never exceed 1.44 * log2(n + 2) in height, so fixed size
+ * stacks suffice for iterative traversal of any tree that fits in memory */
+#define AVL_MAX_HEIGHT 64
+#define AVL_STACK_SIZE (AVL_MAX_HEIGHT * 2)
+
+/* Node pool slab sizes, in bytes */
+#define AVL_SLAB_MIN 512
+#define AVL_SLAB_MAX 16384
+
+#define AVL_SLAB_HDR \
+	((sizeof(struct avl_slab) + AVL_POOL_ALIGN - 1) / AVL_POOL_ALIGN * AVL_POOL_ALIGN)
+
+/* Size of a node with an inline key of len bytes, rounded up to the pool alignment */
+#define AVL_NODE_SIZE(len) \
+	((offsetof(avl_node, fkey) + (len) + AVL_POOL_ALIGN - 1) / AVL_POOL_ALIGN * AVL_POOL_ALIGN)
+
+/* Maximum number of glob tokens matched bit-parallel, longer globs are
+ * matched by backtracking */
+#define GLOB_BITS 63
+
+/* Bit of a character in a 64 bit character set signature */
+#define SIG(C) ((uint64_t)1 << ((unsigned char)(C) & 63))
+
+/* Highlight word boundaries, words prefixed or suffixed with '*' may match
+ * within a larger word */
+#define HIGHLIGHT_L (1 << 0)
+#define HIGHLIGHT_R (1 << 1)
+
+/* Initial number of hash table buckets, must be a power of 2 */
+#define HASH_SIZE_MIN 16
+
+/* Identity mapped ranges of casemapping tables */
+#define CM_I4(N)  (N), (N) + 1, (N) + 2, (N) + 3
+#define CM_I16(N) CM_I4(N), CM_I4((N) + 4), CM_I4((N) + 8), CM_I4((N) + 12)
+#define CM_I64(N) CM_I16(N), CM_I16((N) + 16), CM_I16((N) + 32), CM_I16((N) + 48)
+
+/* 0x41 - 0x5A, A-Z folded to a-z */
+#define CM_UPPER CM_I16('a'), CM_I4('q'), CM_I4('u'), 'y', 'z'
+
+/* 0x61 - 0x7F */
+#define CM_LOWER CM_I16(0x61), CM_I4(0x71), CM_I4(0x75), CM_I4(0x79), 0x7D, 0x7E, 0x7F
+
+/* Casemapping tables, indexed by casemapping_t
+ *
+ * Each maps a character to its lowercase equivalent such that two
+ * strings are equal under a casemapping iff their folded forms are equal */
+static const unsigned char casemap[CASEMAPPING_T_SIZE][256] = {
+	[CASEMAPPING_RFC1459] = {
+		CM_I64(0x00), '@', CM_UPPER, '{', '|', '}', '~', '_', '`', CM_LOWER,
+		CM_I64(0x80), CM_I64(0xC0)
+	},
+	[CASEMAPPING_STRICT_RFC1459] = {
+		CM_I64(0x00), '@', CM_UPPER, '{', '|', '}', '^', '_', '`', CM_LOWER,
+		CM_I64(0x80), CM_I64(0xC0)
+	},
+	[CASEMAPPING_ASCII] = {
+		CM_I64(0x00), '@', CM_UPPER, '[', '\\', ']', '^', '_', '`', CM_LOWER,
+		CM_I64(0x80), CM_I64(0xC0)
+	}
+};
+
+/* Mode flags in order of their bits */
+static const char mode_flags[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+/* Identity mapping, for case sensitive hashing, eg: of interned strings */
+static const unsigned char casemap_exact[256] = {
+	CM_I64(0x00), CM_I64(0x40), CM_I64(0x80), CM_I64(0xC0)
+};
 
 static int irc_isnickchar(const char);
 
-/* AVL tree function */
-static avl_node* _avl_add(avl_node*, const char*, void*);
-static avl_node* _avl_del(avl_node*, const char*);
-static avl_node* _avl_get(avl_node*, const char*, size_t);
-static avl_node* avl_new_node(const char*, void*);
-static void avl_free_node(avl_node*);
+/* AVL tree functions */
+static avl_node* avl_link(avl_node**, size_t);
+static avl_node** avl_flatten(avl_node*, avl_node**);
+static size_t avl_weight(const avl_node*, int);
+static void avl_update(avl_node*);
+static avl_node* avl_new_node(struct avl_pool*, const unsigned char*, const char*, void*);
+static int avl_node_cmp(const void*, const void*);
+static avl_node* avl_pool_get(struct avl_pool*, size_t);
+static int avl_cmp(const unsigned char*, const char*, const char*);
+static int avl_ncmp(const unsigned char*, const char*, const char*, size_t);
+static void avl_pool_free(struct avl_pool*);
+static void avl_pool_put(struct avl_pool*, avl_node*);
+static void avl_rebalance(avl_node***, size_t);
 static avl_node* avl_rotate_L(avl_node*);
 static avl_node* avl_rotate_R(avl_node*);
 
-static jmp_buf jmpbuf;
+/* Ignore list functions */
+static char* ignore_mask(const char*);
+static struct hash_table* ignore_table(struct ignore*, const char*, const char**);
+static struct glob* glob_compile(const unsigned char*, char*);
+static int glob_match(const struct glob*, const char*);
+static int glob_match_slow(const char*, const char*);
+static void free_glob(struct glob*);
+
+/* Channel directory functions */
+static int directory_cmp(const struct directory*, size_t, size_t);
+static int directory_match(const struct directory*, size_t);
+static void directory_merge(const struct directory*, const size_t*, size_t, size_t, size_t, size_t*);
+static void directory_msort(const struct directory*, size_t*, size_t*, size_t);
+static size_t directory_text(struct directory*, const char*);
+
+/* Highlight functions */
+static const char* highlight_token(const char**, size_t*, int*);
+
+/* Hash table functions */
+static int hash_insert(hash_table*, const unsigned char*, unsigned int, const char*, void*);
+static size_t hash_find(hash_table*, const unsigned char*, unsigned int, const char*);
+static unsigned int hash_key(const unsigned char*, const char*);
+static void* hash_remove(hash_table*, const unsigned char*, unsigned int, const char*);
+static void hash_resize(hash_table*, size_t);
 
 void
 error(int errnum, const char *fmt, ...)
@@ -98,6 +197,55 @@ strdup(const char *str)
 	return ret;
 }
 
+casemapping_t
+casemapping_get(const char *str)
+{
+	/* Return the casemapping named by an RPL_ISUPPORT CASEMAPPING value.
+	 *
+	 * Unknown casemappings default to rfc1459 */
+
+	if (!strcmp(str, "ascii"))
+		return CASEMAPPING_ASCII;
+
+	if (!strcmp(str, "strict-rfc1459"))
+		return CASEMAPPING_STRICT_RFC1459;
+
+	return CASEMAPPING_RFC1459;
+}
+
+int
+irc_strcmp(casemapping_t cm, const char *s1, const char *s2)
+{
+	/* Compare two strings, case insensitive under casemapping cm */
+
+	const unsigned char *map = casemap[cm];
+	const unsigned char *p1 = (const unsigned char *)s1;
+	const unsigned char *p2 = (const unsigned char *)s2;
+
+	while (*p1 && map[*p1] == map[*p2])
+		p1++, p2++;
+
+	return map[*p1] - map[*p2];
+}
+
+int
+irc_strncmp(casemapping_t cm, const char *s1, const char *s2, size_t n)
+{
+	/* Compare at most n characters of two strings, case insensitive under casemapping cm */
+
+	const unsigned char *map = casemap[cm];
+	const unsigned char *p1 = (const unsigned char *)s1;
+	const unsigned char *p2 = (const unsigned char *)s2;
+
+	if (n == 0)
+		return 0;
+
+	while (--n && *p1 && map[*p1] == map[*p2])
+		p1++, p2++;
+
+	return map[*p1] - map[*p2];
+}
+
 static int
 irc_isnickchar(const char c)
 {
@@ -112,12 +260,116 @@ irc_isnickchar(const char c)
 	return (c == '-' || (c >= 0x30 && c <= 0x39) || (c >= 0x41 && c <= 0x7D));
 }
 
+static char*
+parse_tags(parsed_mesg *p, char *mesg)
+{
+	/* IRCv3 message tags, returns the end of the tags
+	 *
+	 * tags       =   "@" tag *( ";" tag ) SPACE
+	 * tag        =   key [ "=" escaped_value ]
+	 *
+	 * Values are unescaped in place, tags beyond TAGS_MAX are ignored */
+
+	char *key, *val, *r, *w, end;
+
+	do {
+		key = mesg;
+		val = NULL;
+
+		while (*mesg && *mesg != ' ' && *mesg != ';') {
+			if (*mesg == '=' && !val) {
+				*mesg++ = '\0';
+				val = mesg;
+			} else {
+				mesg++;
+			}
+		}
+
+		if ((end = *mesg))
+			*mesg++ = '\0';
+
+		/* \: -> ;  \s -> SPACE  \\ -> \  \r -> CR  \n -> LF, other escapes drop the \ */
+		if (val) {
+			for (r = w = val; *r; r++) {
+
+				if (*r != '\\') {
+					*w++ = *r;
+					continue;
+				}
+
+				switch (*++r) {
+					case ':':  *w++ = ';';  break;
+					case 's':  *w++ = ' ';  break;
+					case 'r':  *w++ = '\r'; break;
+					case 'n':  *w++ = '\n'; break;
+					case '\0': r--;         break;
+					default:   *w++ = *r;
+				}
+			}
+			*w = '\0';
+		}
+
+		if (*key && p->tag_count < TAGS_MAX) {
+			p->tags[p->tag_count].key = key;
+			p->tags[p->tag_count].val = (val ? val : "");
+			p->tag_count++;
+		}
+
+	} while (end == ';');
+
+	return mesg;
+}
+
+const char*
+mesg_tag(const parsed_mesg *p, const char *key)
+{
+	/* Returns a message tag's value, or NULL if the message isn't tagged with key */
+
+	unsigned int i;
+
+	for (i = 0; i < p->tag_count; i++) {
+		if (!strcmp(p->tags[i].key, key))
+			return p->tags[i].val;
+	}
+
+	return NULL;
+}
+
+int
+parse_time(const char *str, time_t *t)
+{
+	/* Parse an IRCv3 server-time timestamp, UTC with millisecond
+	 * precision, eg: 2011-10-19T16:40:51.620Z
+	 *
+	 * Returns 0 if the timestamp is invalid */
+
+	int y, m, d, hh, mm, ss, n = 0;
+	long days;
+
+	if (sscanf(str, "%4d-%2d-%2dT%2d:%2d:%2d%n", &y, &m, &d, &hh, &mm, &ss, &n) != 6 || n == 0)
+		return 0;
+
+	if (m < 1 || m > 12 || d < 1 || d > 31 || hh > 23 || mm > 59 || ss > 60 || y < 1970)
+		return 0;
+
+	/* Days since the epoch of the proleptic Gregorian date, with the year
+	 * starting in March so the leap day is last */
+	y -= (m <= 2);
+	m += (m <= 2) ? 9 : -3;
+
+	days = 365L * y + y / 4 - y / 100 + y / 400 + (153 * m + 2) / 5 + d - 1 - 719468;
+
+	*t = (time_t)days * 86400 + hh * 3600 + mm * 60 + ss;
+
+	return 1;
+}
+
 parsed_mesg*
 parse(parsed_mesg *p, char *mesg)
 {
-	/* RFC 2812, section 2.3.1
+	/* RFC 2812, section 2.3.1, with IRCv3 message tags
 	 *
-	 * message    =   [ ":" prefix SPACE ] command [ params ] crlf
+	 * message    =   [ "@" tags SPACE ] [ ":" prefix SPACE ] command [ params ] crlf
 	 * prefix     =   servername / ( nickname [ [ "!" user ] "@" host ] )
 	 * command    =   1*letter / 3digit
 	 * params     =   *14( SPACE middle ) [ SPACE ":" trailing ]
@@ -138,6 +390,14 @@ parse(parsed_mesg *p, char *mesg)
 	while (*mesg && *mesg == ' ')
 		mesg++;
 
+	if (*mesg == '@') {
+
+		mesg = parse_tags(p, mesg + 1);
+
+		while (*mesg && *mesg == ' ')
+			mesg++;
+	}
+
 	/* Check for prefix and parse if detected */
 	if (*mesg == ':') {
 
@@ -203,30 +463,83 @@ parse(parsed_mesg *p, char *mesg)
 	return p;
 }
 
+size_t
+split_text(const char *text, size_t len, size_t max)
+{
+	/* Returns the length of the first part of a text to send in a message
+	 * of at most max bytes. Text is split at the last space that fits,
+	 * otherwise between UTF-8 characters, the remainder beginning with the
+	 * space or character split at */
+
+	size_t n;
+
+	if (len <= max)
+		return len;
+
+	for (n = max; n > 0 && text[n] != ' '; n--)
+		;
+
+	if (n > 0)
+		return n;
+
+	/* Continuation bytes are 10xxxxxx */
+	for (n = max; n > 0 && (text[n] & 0xC0) == 0x80; n--)
+		;
+
+	return (n > 0) ? n : max;
+}
+
 int
-check_pinged(const char *mesg, const char *nick)
+check_netsplit(const char *mesg)
 {
+	/* A netsplit's QUIT message is the names of the two servers split, eg:
+	 * "irc.a.net irc.b.net". Servers prefix users' own quit messages, so
+	 * they can't take this form
+	 *
+	 * Returns 0 if the message isn't a netsplit's */
 
-	int len = strlen(nick);
+	const char *p, *start;
+	int i, dot;
 
-	while (*mesg) {
+	for (p = mesg, i = 0; i < 2; i++) {
 
-		/* skip any prefixing characters that wouldn't match a valid nick */
-		while (!(*mesg >= 0x41 && *mesg <= 0x7D))
-			mesg++;
+		for (start = p, dot = 0; isalnum((unsigned char)*p) || *p == '-' || *p == '.'; p++)
+			dot |= (*p == '.');
 
-		/* nick prefixes the word, following character is space or symbol */
-		if (!strncasecmp(mesg, nick, len) && !irc_isnickchar(*(mesg + len))) {
-			putchar('\a');
-			return 1;
-		}
+		if (!dot || *start == '.' || *(p - 1) == '.')
+			return 0;
 
-		/* skip to end of word */
-		while (*mesg && *mesg != ' ')
-			mesg++;
+		if (*p++ != (i ? '\0' : ' '))
+			return 0;
 	}
 
-	return 0;
+	return 1;
+}
+
+size_t
+flood_take(struct flood_bucket *b, size_t n, time_t t)
+{
+	/* Take a token from each of n token buckets, only once every bucket has
+	 * one. Taking a token advances the time a bucket is next full by one
+	 * refill, and it's empty while that's more than a burst ahead of t
+	 *
+	 * Returns n if the tokens were taken, otherwise the first empty bucket */
+
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+
+		if (*b[i].time < t)
+			*b[i].time = t;
+
+		if (*b[i].time - t > (time_t)(b[i].burst - 1) * b[i].refill)
+			return i;
+	}
+
+	for (i = 0; i < n; i++)
+		*b[i].time += b[i].refill;
+
+	return n;
 }
 
 char*
@@ -285,6 +598,61 @@ word_wrap(int text_cols, char **ptr1, char *ptr2)
 	return ret;
 }
 
+char*
+buffer_line_text(buffer_line *l)
+{
+	/* Return a line's text, formatting it from the line's event on first use */
+
+	char buff[BUFFSIZE];
+	const char *bang = (l->event.host) ? "!" : "";
+	const char *host = (l->event.host) ? l->event.host : "";
+	int len = 0;
+
+	if (l->text)
+		return l->text;
+
+	switch (l->event.kind) {
+		case EVENT_JOIN:
+			len = snprintf(buff, sizeof(buff), "%s%s%s has joined %s",
+				l->event.nick, bang, host, l->event.chan);
+			break;
+
+		case EVENT_PART:
+			len = snprintf(buff, sizeof(buff), "%s%s%s has left %s%s%s%s",
+				l->event.nick, bang, host, l->event.chan,
+				(l->event.arg ? " (" : ""), (l->event.arg ? l->event.arg : ""), (l->event.arg ? ")" : ""));
+			break;
+
+		case EVENT_QUIT:
+			len = snprintf(buff, sizeof(buff), "%s%s%s has quit%s%s%s",
+				l->event.nick, bang, host,
+				(l->event.arg ? " (" : ""), (l->event.arg ? l->event.arg : ""), (l->event.arg ? ")" : ""));
+			break;
+
+		case EVENT_NICK:
+			len = snprintf(buff, sizeof(buff), "%s  >>  %s", l->event.nick, l->event.arg);
+			break;
+
+		default:
+			buff[0] = 0;
+	}
+
+	if (len < 0)
+		len = 0;
+
+	if ((size_t)len >= sizeof(buff))
+		len = sizeof(buff) - 1;
+
+	if ((l->text = malloc(len + 1)) == NULL)
+		fatal("malloc");
+
+	memcpy(l->text, buff, len);
+	l->text[len] = 0;
+	l->len = len;
+
+	return l->text;
+}
+
 int
 count_line_rows(int text_cols, buffer_line *l)
 {
@@ -292,8 +660,8 @@ count_line_rows(int text_cols, buffer_line *l)
 
 	int count = 0;
 
-	char *ptr1 = l->text;
-	char *ptr2 = l->text + l->len;
+	char *ptr1 = buffer_line_text(l);
+	char *ptr2 = ptr1 + l->len;
 
 	do {
 		word_wrap(text_cols, &ptr1, ptr2);
@@ -303,280 +671,1940 @@ count_line_rows(int text_cols, buffer_line *l)
 	return count;
 }
 
-/* AVL tree functions */
+/* Channel directory functions */
 
 void
-free_avl(avl_node *n)
+directory_add(struct directory *d, const char *name, unsigned int users, const char *topic)
 {
-	/* Recusrively free an AVL tree */
+	/* Append an entry, and add it to the unsorted tail of the view if it
+	 * matches the filter */
 
-	if (n == NULL)
-		return;
+	size_t len;
 
-	free_avl(n->l);
-	free_avl(n->r);
-	avl_free_node(n);
-}
+	if (d->count == d->size) {
 
-int
-avl_add(avl_node **n, const char *key, void *val)
-{
-	/* Entry point for adding a node to an AVL tree */
+		d->size = d->size ? d->size * 2 : 1024;
 
-	if (setjmp(jmpbuf))
-		return 0;
+		if ((d->names = realloc(d->names, d->size * sizeof(*d->names))) == NULL)
+			fatal("realloc");
 
-	*n = _avl_add(*n, key, val);
+		if ((d->topics = realloc(d->topics, d->size * sizeof(*d->topics))) == NULL)
+			fatal("realloc");
 
-	return 1;
+		if ((d->users = realloc(d->users, d->size * sizeof(*d->users))) == NULL)
+			fatal("realloc");
+
+		if ((d->view = realloc(d->view, d->size * sizeof(*d->view))) == NULL)
+			fatal("realloc");
+
+		if ((d->scratch = realloc(d->scratch, d->size * sizeof(*d->scratch))) == NULL)
+			fatal("realloc");
+	}
+
+	d->names[d->count] = directory_text(d, name);
+	d->topics[d->count] = directory_text(d, topic);
+	d->users[d->count] = users;
+
+	if ((len = strlen(name)) > d->name_width)
+		d->name_width = len;
+
+	if (directory_match(d, d->count))
+		d->view[d->view_count++] = d->count;
+
+	d->count++;
 }
 
-int
-avl_del(avl_node **n, const char *key)
+void
+directory_filter(struct directory *d, const char *filter)
 {
-	/* Entry point for removing a node from an AVL tree */
+	/* Rebuild the view from the entries containing filter in their name or
+	 * topic, ignoring case. An empty filter matches all entries */
 
-	if (setjmp(jmpbuf))
-		return 0;
+	size_t i;
 
-	*n = _avl_del(*n, key);
+	for (i = 0; filter[i] && i < sizeof(d->filter) - 1; i++)
+		d->filter[i] = tolower((unsigned char)filter[i]);
 
-	return 1;
+	d->filter[i] = 0;
+
+	d->scroll = 0;
+	d->view_count = 0;
+	d->view_sorted = 0;
+
+	for (i = 0; i < d->count; i++) {
+		if (directory_match(d, i))
+			d->view[d->view_count++] = i;
+	}
 }
 
-const avl_node*
-avl_get(avl_node *n, const char *key, size_t len)
+void
+directory_reset(struct directory *d)
 {
-	/* Entry point for fetching an avl node with prefix key */
+	/* Discard all entries, keeping the filter and sort order */
+
+	d->text_len = 0;
+	d->count = 0;
+	d->view_count = 0;
+	d->view_sorted = 0;
+	d->scroll = 0;
+	d->name_width = 0;
+	d->complete = 0;
+}
 
-	if (setjmp(jmpbuf))
-		return NULL;
+void
+directory_sort(struct directory *d, directory_sort_t sort)
+{
+	if (d->sort == sort)
+		return;
 
-	return _avl_get(n, key, len);
+	d->sort = sort;
+	d->scroll = 0;
+	d->view_sorted = 0;
 }
 
-static avl_node*
-avl_new_node(const char *key, void *val)
+void
+directory_update(struct directory *d)
 {
-	avl_node *n;
+	/* Sort the view's unsorted tail, and merge it with the sorted prefix, so
+	 * entries streaming in cost O(n) per update rather than a full sort */
 
-	if ((n = calloc(1, sizeof(*n))) == NULL)
-		fatal("calloc");
+	size_t sorted = d->view_sorted, n = d->view_count;
 
-	n->height = 1;
-	n->key = strdup(key);
-	n->val = val;
+	if (sorted == n)
+		return;
 
-	return n;
+	directory_msort(d, d->view + sorted, d->scratch, n - sorted);
+
+	if (sorted) {
+		directory_merge(d, d->view, 0, sorted, n, d->scratch);
+		memcpy(d->view, d->scratch, n * sizeof(*d->view));
+	}
+
+	d->view_sorted = n;
 }
 
-static void
-avl_free_node(avl_node *n)
+void
+free_directory(struct directory *d)
 {
-	free(n->key);
-	free(n->val);
-	free(n);
+	free(d->text);
+	free(d->fold);
+	free(d->names);
+	free(d->topics);
+	free(d->users);
+	free(d->view);
+	free(d->scratch);
 }
 
-static avl_node*
-avl_rotate_R(avl_node *r)
+static int
+directory_cmp(const struct directory *d, size_t a, size_t b)
 {
-	/* Rotate right for root r and pivot p
-	 *
-	 *     r          p
-	 *    / \   ->   / \
-	 *   p   c      a   r
-	 *  / \            / \
-	 * a   b          b   c
-	 *
-	 */
+	int ret;
 
-	avl_node *p = r->l;
-	avl_node *b = p->r;
+	if (d->sort == DIRECTORY_SORT_USERS && d->users[a] != d->users[b])
+		return (d->users[a] < d->users[b]) ? 1 : -1;
 
-	p->r = r;
-	r->l = b;
+	if ((ret = strcmp(d->fold + d->names[a], d->fold + d->names[b])))
+		return ret;
 
-	r->height = MAX(H(r->l), H(r->r)) + 1;
-	p->height = MAX(H(p->l), H(p->r)) + 1;
+	if (d->users[a] != d->users[b])
+		return (d->users[a] < d->users[b]) ? 1 : -1;
 
-	return p;
+	return (a > b) - (a < b);
 }
 
-static avl_node*
-avl_rotate_L(avl_node *r)
+static int
+directory_match(const struct directory *d, size_t i)
 {
-	/* Rotate left for root r and pivot p
-	 *
-	 *   r            p
-	 *  / \    ->    / \
-	 * a   p        r   c
-	 *    / \      / \
-	 *   b   c    a   b
-	 *
-	 */
+	return (!*d->filter
+		|| strstr(d->fold + d->names[i], d->filter)
+		|| strstr(d->fold + d->topics[i], d->filter));
+}
 
-	avl_node *p = r->r;
-	avl_node *b = p->l;
+static void
+directory_merge(const struct directory *d, const size_t *src, size_t lo, size_t mid, size_t hi, size_t *dst)
+{
+	/* Merge the sorted runs src[lo, mid) and src[mid, hi) into dst[lo, hi) */
 
-	p->l = r;
-	r->r = b;
+	size_t i = lo, j = mid, k = lo;
 
-	r->height = MAX(H(r->l), H(r->r)) + 1;
-	p->height = MAX(H(p->l), H(p->r)) + 1;
+	while (i < mid && j < hi)
+		dst[k++] = (directory_cmp(d, src[j], src[i]) < 0) ? src[j++] : src[i++];
 
-	return p;
+	while (i < mid)
+		dst[k++] = src[i++];
+
+	while (j < hi)
+		dst[k++] = src[j++];
 }
 
-static avl_node*
-_avl_add(avl_node *n, const char *key, void *val)
+static void
+directory_msort(const struct directory *d, size_t *v, size_t *tmp, size_t n)
 {
-	/* Recursively add key to an AVL tree.
-	 *
-	 * If a duplicate is found (case insensitive) longjmp is called to indicate failure */
+	/* Bottom up merge sort of n view entries, using tmp of at least n entries */
 
-	if (n == NULL)
-		return avl_new_node(key, val);
+	size_t *src = v, *dst = tmp, *swap, lo, width;
 
-	int ret = strcasecmp(key, n->key);
+	for (width = 1; width < n; width *= 2) {
 
-	if (ret == 0)
-		/* Duplicate found */
-		longjmp(jmpbuf, 1);
+		for (lo = 0; lo < n; lo += 2 * width) {
 
-	else if (ret > 0)
-		n->r = _avl_add(n->r, key, val);
+			size_t mid = (lo + width < n) ? lo + width : n;
+			size_t hi = (lo + 2 * width < n) ? lo + 2 * width : n;
 
-	else if (ret < 0)
-		n->l = _avl_add(n->l, key, val);
+			directory_merge(d, src, lo, mid, hi, dst);
+		}
 
-	/* Node was successfully added, recaculate height and rebalance */
+		swap = src, src = dst, dst = swap;
+	}
 
-	n->height = MAX(H(n->l), H(n->r)) + 1;
+	if (src != v)
+		memcpy(v, src, n * sizeof(*v));
+}
 
-	int balance = H(n->l) - H(n->r);
+static size_t
+directory_text(struct directory *d, const char *str)
+{
+	/* Append a string and its lowercase copy, returning their offset */
 
-	/* right rotation */
-	if (balance > 1) {
+	size_t i, len = strlen(str) + 1, offset = d->text_len;
 
-		/* left-right rotation */
-		if (strcasecmp(key, n->l->key) > 0)
-			n->l = avl_rotate_L(n->l);
+	if (d->text_len + len > d->text_size) {
 
-		return avl_rotate_R(n);
-	}
+		while (d->text_len + len > d->text_size)
+			d->text_size = d->text_size ? d->text_size * 2 : 65536;
 
-	/* left rotation */
-	if (balance < -1) {
+		if ((d->text = realloc(d->text, d->text_size)) == NULL)
+			fatal("realloc");
 
-		/* right-left rotation */
-		if (strcasecmp(n->r->key, key) > 0)
-			n->r = avl_rotate_R(n->r);
+		if ((d->fold = realloc(d->fold, d->text_size)) == NULL)
+			fatal("realloc");
+	}
 
-		return avl_rotate_L(n);
+	for (i = 0; i < len; i++) {
+		d->text[offset + i] = str[i];
+		d->fold[offset + i] = tolower((unsigned char)str[i]);
 	}
 
-	return n;
+	d->text_len += len;
+
+	return offset;
 }
 
-static avl_node*
-_avl_del(avl_node *n, const char *key)
+/* Mode functions */
+
+uint64_t
+mode_bit(char flag)
 {
-	/* Recursive function for deleting nodes from an AVL tree
+	/* Return the bit of a mode flag, or 0 if the flag isn't [A-Za-z]
 	 *
-	 * If the node isn't found (case insensitive) longjmp is called to indicate failure */
-
-	if (n == NULL)
-		/* Node not found */
-		longjmp(jmpbuf, 1);
+	 * Bits are assigned in ASCII order, A-Z followed by a-z */
 
-	int ret = strcasecmp(key, n->key);
+	if (flag >= 'A' && flag <= 'Z')
+		return (uint64_t)1 << (flag - 'A');
 
-	if (ret == 0) {
-		/* Node found */
+	if (flag >= 'a' && flag <= 'z')
+		return (uint64_t)1 << (flag - 'a' + 26);
 
-		if (n->l && n->r) {
-			/* Recursively delete nodes with both children to ensure balance */
+	return 0;
+}
 
-			/* Find the next largest value in the tree (the leftmost node in the right subtree) */
-			avl_node *next = n->r;
+int
+mode_set(struct mode *m, char flag, int set, const char *arg)
+{
+	/* Set or unset a mode flag, storing its parameter if set with one
+	 *
+	 * Returns 0 if the flag is invalid */
 
-			while (next->l)
-				next = next->l;
+	struct mode_param *p, *slot = NULL;
+	uint64_t bit;
 
-			/* Swap it's value with the node being deleted */
-			avl_node t = *n;
+	if ((bit = mode_bit(flag)) == 0)
+		return 0;
 
-			n->key = next->key;
-			n->val = next->val;
-			next->key = t.key;
-			next->val = t.val;
+	for (p = m->params; p < m->params + MODE_PARAMS_MAX; p++) {
 
-			/* Recusively delete in the right subtree */
-			n->r = _avl_del(n->r, t.key);
+		if (p->flag == flag) {
+			free(p->arg);
+			p->arg = NULL;
+			p->flag = 0;
+		}
 
-		} else {
-			/* If n has a child, return it */
-			avl_node *tmp = (n->l) ? n->l : n->r;
+		if (p->flag == 0 && slot == NULL)
+			slot = p;
+	}
 
-			avl_free_node(n);
+	if (set) {
+		m->flags |= bit;
 
-			return tmp;
+		/* Parameters beyond MODE_PARAMS_MAX aren't stored */
+		if (arg && slot) {
+			slot->flag = flag;
+			slot->arg = strdup(arg);
 		}
+	} else {
+		m->flags &= ~bit;
 	}
 
-	else if (ret > 0)
-		n->r = _avl_del(n->r, key);
+	return 1;
+}
+
+void
+mode_reset(struct mode *m)
+{
+	/* Unset all flags and free their parameters */
 
-	else if (ret < 0)
-		n->l = _avl_del(n->l, key);
+	struct mode_param *p;
 
-	/* Node was successfully deleted, recalculate height and rebalance */
+	for (p = m->params; p < m->params + MODE_PARAMS_MAX; p++)
+		free(p->arg);
 
-	n->height = MAX(H(n->l), H(n->r)) + 1;
+	memset(m, 0, sizeof(*m));
+}
 
-	int balance = H(n->l) - H(n->r);
+void
+mode_str(const struct mode *m, char *buf, size_t len)
+{
+	/* Print the set flags of a mode followed by their parameters, eg: "klnt key 10"
+	 *
+	 * buf is always null terminated, output exceeding len is truncated */
 
-	/* right rotation */
-	if (balance > 1) {
+	const struct mode_param *p;
+	const char *f;
+	size_t n = 0;
+	int ret;
 
-		/* left-right rotation */
-		if (H(n->l->l) - H(n->l->r) < 0)
-			n->l =  avl_rotate_L(n->l);
+	if (len == 0)
+		return;
 
-		return avl_rotate_R(n);
+	for (f = mode_flags; *f && n + 1 < len; f++) {
+		if (m->flags & mode_bit(*f))
+			buf[n++] = *f;
 	}
 
-	/* left rotation */
-	if (balance < -1) {
+	buf[n] = '\0';
+
+	for (f = mode_flags; *f; f++) {
+
+		if (!(m->flags & mode_bit(*f)))
+			continue;
+
+		for (p = m->params; p < m->params + MODE_PARAMS_MAX; p++) {
 
-		/* right-left rotation */
-		if (H(n->r->l) - H(n->r->r) > 0)
-			n->r = avl_rotate_R(n->r);
+			if (p->flag != *f || p->arg == NULL)
+				continue;
 
-		return avl_rotate_L(n);
+			if ((ret = snprintf(buf + n, len - n, " %s", p->arg)) < 0 || (n += ret) >= len)
+				return;
+		}
 	}
+}
 
-	return n;
+/* AVL tree functions */
+
+void
+free_avl(avl_tree *t, void (*val_free)(void*))
+{
+	/* Free an AVL tree, passing each node's value to val_free
+	 *
+	 * Nodes are released in bulk with the tree's node pool */
+
+	avl_node *n, *stack[AVL_STACK_SIZE];
+	size_t depth = 0;
+
+	if (t->root)
+		stack[depth++] = t->root;
+
+	while (depth) {
+		n = stack[--depth];
+
+		if (n->l) stack[depth++] = n->l;
+		if (n->r) stack[depth++] = n->r;
+
+		val_free(n->val);
+	}
+
+	avl_pool_free(&(t->pool));
+
+	t->root = NULL;
 }
 
-static avl_node*
-_avl_get(avl_node *n, const char *key, size_t len)
+int
+avl_add(avl_tree *t, casemapping_t cm, const char *key, void *val)
 {
-	/* Case insensitive search for a node whose value is prefixed by key */
+	/* Add a node to an AVL tree
+	 *
+	 * Returns 0 if the key is a duplicate under the casemapping */
 
-	/* Failed to find node */
-	if (n == NULL)
-		longjmp(jmpbuf, 1);
+	const unsigned char *map = casemap[cm];
 
-	int ret = strncasecmp(key, n->key, len);
+	avl_node *n, **link, **path[AVL_MAX_HEIGHT];
+	size_t depth = 0;
+	int ret;
 
-	if (ret > 0)
-		return _avl_get(n->r, key, len);
+	for (link = &(t->root); (n = *link); link = (ret < 0) ? &(n->l) : &(n->r)) {
 
-	if (ret < 0)
-		return _avl_get(n->l, key, len);
+		if ((ret = avl_cmp(map, key, n->fkey)) == 0)
+			return 0;
+
+		path[depth++] = link;
+	}
+
+	*link = avl_new_node(&(t->pool), map, key, val);
+
+	avl_rebalance(path, depth);
+
+	return 1;
+}
+
+int
+avl_del(avl_tree *t, casemapping_t cm, const char *key, void **val)
+{
+	/* Remove a node from an AVL tree
+	 *
+	 * If val is non-NULL the node's value is returned through it,
+	 * otherwise the value is freed with the node
+	 *
+	 * Returns 0 if the key isn't found */
+
+	const unsigned char *map = casemap[cm];
+
+	avl_node *n, *s, **link, **slink, **path[AVL_MAX_HEIGHT];
+	size_t depth = 0, n_depth;
+	int ret;
+
+	for (link = &(t->root); (n = *link); link = (ret < 0) ? &(n->l) : &(n->r)) {
+
+		if ((ret = avl_cmp(map, key, n->fkey)) == 0)
+			break;
+
+		path[depth++] = link;
+	}
+
+	if (n == NULL)
+		return 0;
+
+	if (n->l && n->r) {
+		/* Replace the node with its successor, the leftmost node of its right subtree */
+
+		path[(n_depth = depth++)] = link;
+
+		for (slink = &(n->r); (*slink)->l; slink = &((*slink)->l))
+			path[depth++] = slink;
+
+		s = *slink;
+		*slink = s->r;
+
+		s->l = n->l;
+		s->r = n->r;
+		s->height = n->height;
+
+		*link = s;
+
+		/* The path through n's right subtree now starts at the successor */
+		if (depth > n_depth + 1)
+			path[n_depth + 1] = &(s->r);
+
+	} else {
+		*link = (n->l) ? n->l : n->r;
+	}
+
+	avl_rebalance(path, depth);
+
+	if (val)
+		*val = n->val;
+	else
+		free(n->val);
+
+	avl_pool_put(&(t->pool), n);
+
+	return 1;
+}
+
+size_t
+avl_build(avl_tree *t, casemapping_t cm, struct avl_entry *e, size_t n, void (*val_free)(void*))
+{
+	/* Add n entries to an AVL tree, returning the number added
+	 *
+	 * The sorted entries are merged with the tree's nodes in order, and the tree
+	 * is relinked as a perfectly balanced tree in linear time, rather than with
+	 * n rebalancing inserts. Values of keys already in the tree or duplicated in
+	 * the entries are passed to val_free */
+
+	avl_node **nodes, **merged, *node;
+	size_t i, j, k, m, added = 0;
+	int old;
+
+	if (n == 0)
+		return 0;
+
+	m = avl_weight(t->root, -1);
+
+	if ((nodes = malloc(sizeof(*nodes) * (m + n))) == NULL)
+		fatal("malloc");
+
+	if ((merged = malloc(sizeof(*merged) * (m + n))) == NULL)
+		fatal("malloc");
+
+	avl_flatten(t->root, nodes);
+
+	for (i = 0; i < n; i++) {
+		nodes[m + i] = avl_new_node(&(t->pool), casemap[cm], e[i].key, e[i].val);
+		nodes[m + i]->class = e[i].class;
+	}
+
+	qsort(nodes + m, n, sizeof(*nodes), avl_node_cmp);
+
+	/* The tree's nodes precede equal entries, so only entries are discarded */
+	for (i = 0, j = m, k = 0; i < m || j < m + n; ) {
+
+		old = (j == m + n || (i < m && strcmp(nodes[i]->fkey, nodes[j]->fkey) <= 0));
+
+		node = (old) ? nodes[i++] : nodes[j++];
+
+		if (k && !strcmp(node->fkey, merged[k - 1]->fkey)) {
+			val_free(node->val);
+			avl_pool_put(&(t->pool), node);
+		} else {
+			merged[k++] = node;
+			added += !old;
+		}
+	}
+
+	t->root = avl_link(merged, k);
+
+	free(nodes);
+	free(merged);
+
+	return added;
+}
+
+const avl_node*
+avl_get(avl_tree *t, casemapping_t cm, const char *key, size_t len)
+{
+	/* Search for a node whose key is prefixed by key, NULL if not found */
+
+	const unsigned char *map = casemap[cm];
+
+	avl_node *n = t->root;
+	int ret;
+
+	while (n && (ret = avl_ncmp(map, key, n->fkey, len)))
+		n = (ret < 0) ? n->l : n->r;
+
+	return n;
+}
+
+const avl_node*
+avl_select(avl_tree *t, size_t k, int class)
+{
+	/* Returns the kth node in order, counting from 0, of a class or of any
+	 * class if class is negative. NULL if there are fewer nodes */
+
+	avl_node *n = t->root;
+	size_t l;
+
+	while (n) {
+
+		if (k < (l = avl_weight(n->l, class))) {
+			n = n->l;
+			continue;
+		}
+
+		k -= l;
+
+		if (class < 0 || n->class == class) {
+			if (k == 0)
+				return n;
+			k--;
+		}
+
+		n = n->r;
+	}
+
+	return NULL;
+}
+
+size_t
+avl_rank(avl_tree *t, casemapping_t cm, const char *key, int class)
+{
+	/* Returns the number of nodes of a class, or of any class if class is
+	 * negative, ordered before key */
+
+	const unsigned char *map = casemap[cm];
+
+	avl_node *n = t->root;
+	size_t rank = 0;
+	int ret;
+
+	while (n) {
+
+		if ((ret = avl_cmp(map, key, n->fkey)) <= 0) {
+
+			if (ret == 0)
+				return rank + avl_weight(n->l, class);
+
+			n = n->l;
+		} else {
+			rank += avl_weight(n->l, class) + (class < 0 || n->class == class);
+			n = n->r;
+		}
+	}
+
+	return rank;
+}
+
+size_t
+avl_prefix(avl_tree *t, casemapping_t cm, const char *key, size_t len, size_t *k)
+{
+	/* Returns the number of nodes whose keys are prefixed by the first len
+	 * characters of key, setting k to the rank of the first. The matches are
+	 * contiguous in order, so each bound is found in a single descent */
+
+	const unsigned char *map = casemap[cm];
+
+	avl_node *n;
+	size_t lower = 0, upper = 0;
+
+	for (n = t->root; n;) {
+		if (avl_ncmp(map, key, n->fkey, len) > 0) {
+			lower += avl_weight(n->l, -1) + 1;
+			n = n->r;
+		} else {
+			n = n->l;
+		}
+	}
+
+	for (n = t->root; n;) {
+		if (avl_ncmp(map, key, n->fkey, len) >= 0) {
+			upper += avl_weight(n->l, -1) + 1;
+			n = n->r;
+		} else {
+			n = n->l;
+		}
+	}
+
+	*k = lower;
+
+	return upper - lower;
+}
+
+size_t
+avl_range(avl_tree *t, size_t k, int class, const avl_node **nodes, size_t n)
+{
+	/* Write up to n nodes of a class in order to an array, starting from the
+	 * kth, returning the number written. Subtrees without nodes of the class
+	 * are skipped, so only O(log N + n) nodes are visited */
+
+	avl_node *m = t->root, *stack[AVL_MAX_HEIGHT];
+	size_t depth = 0, i = 0, l;
+
+	if (k >= avl_weight(m, class))
+		return 0;
+
+	/* Descend to the kth node, stacking the nodes that follow it in order */
+	while (m) {
+
+		if (k < (l = avl_weight(m->l, class))) {
+			stack[depth++] = m;
+			m = m->l;
+			continue;
+		}
+
+		k -= l;
+
+		if (class < 0 || m->class == class) {
+			if (k == 0) {
+				stack[depth++] = m;
+				break;
+			}
+			k--;
+		}
+
+		m = m->r;
+	}
+
+	while (depth && i < n) {
+
+		m = stack[--depth];
+
+		if (class < 0 || m->class == class)
+			nodes[i++] = m;
+
+		for (m = m->r; m && avl_weight(m, class); m = m->l)
+			stack[depth++] = m;
+	}
+
+	return i;
+}
+
+int
+avl_set_class(avl_tree *t, casemapping_t cm, const char *key, unsigned char class)
+{
+	/* Set a node's class, updating the counts of its ancestors
+	 *
+	 * Returns 0 if the key isn't found */
+
+	const unsigned char *map = casemap[cm];
+
+	avl_node *n, *path[AVL_MAX_HEIGHT];
+	size_t depth = 0;
+	int ret;
+
+	for (n = t->root; n; n = (ret < 0) ? n->l : n->r) {
+
+		path[depth++] = n;
+
+		if ((ret = avl_cmp(map, key, n->fkey)) == 0)
+			break;
+	}
+
+	if (n == NULL)
+		return 0;
+
+	while (depth--) {
+		path[depth]->count[n->class]--;
+		path[depth]->count[class]++;
+	}
+
+	n->class = class;
+
+	return 1;
+}
+
+size_t
+avl_size(avl_tree *t, int class)
+{
+	/* Returns the number of nodes of a class, or of any class if class is negative */
+
+	return avl_weight(t->root, class);
+}
+
+void
+avl_remap(avl_tree *t, casemapping_t cm, void (*val_free)(void*))
+{
+	/* Rebuild an AVL tree under a new casemapping.
+	 *
+	 * Nodes are refolded in place and relinked into the new tree. Keys that
+	 * become duplicates under the new casemapping are discarded and their
+	 * values passed to val_free */
+
+	const unsigned char *map = casemap[cm];
+
+	avl_node *n, *m, **link, **path[AVL_MAX_HEIGHT], *stack[AVL_STACK_SIZE];
+	size_t i, depth, sdepth = 0;
+	int ret;
+
+	if (t->root)
+		stack[sdepth++] = t->root;
+
+	t->root = NULL;
+
+	while (sdepth) {
+		n = stack[--sdepth];
+
+		if (n->l) stack[sdepth++] = n->l;
+		if (n->r) stack[sdepth++] = n->r;
+
+		n->l = NULL;
+		n->r = NULL;
+
+		avl_update(n);
+
+		for (i = 0; n->key[i]; i++)
+			n->fkey[i] = map[(unsigned char)n->key[i]];
+
+		depth = 0;
+
+		for (link = &(t->root); (m = *link); link = (ret < 0) ? &(m->l) : &(m->r)) {
+
+			if ((ret = strcmp(n->fkey, m->fkey)) == 0)
+				break;
+
+			path[depth++] = link;
+		}
+
+		if (m) {
+			val_free(n->val);
+			avl_pool_put(&(t->pool), n);
+		} else {
+			*link = n;
+			avl_rebalance(path, depth);
+		}
+	}
+}
+
+static avl_node*
+avl_link(avl_node **nodes, size_t n)
+{
+	/* Link a sorted array of nodes into a perfectly balanced tree */
+
+	avl_node *r;
+
+	if (n == 0)
+		return NULL;
+
+	r = nodes[n / 2];
+
+	r->l = avl_link(nodes, n / 2);
+	r->r = avl_link(nodes + n / 2 + 1, n - n / 2 - 1);
+
+	avl_update(r);
+
+	return r;
+}
+
+static avl_node**
+avl_flatten(avl_node *n, avl_node **nodes)
+{
+	/* Write a tree's nodes to an array in order, returning the end of the array */
+
+	if (n == NULL)
+		return nodes;
+
+	nodes = avl_flatten(n->l, nodes);
+	*nodes++ = n;
+
+	return avl_flatten(n->r, nodes);
+}
+
+static size_t
+avl_weight(const avl_node *n, int class)
+{
+	/* Number of nodes of a class in a subtree, or of any class if negative */
+
+	size_t i, w = 0;
+
+	if (n == NULL)
+		return 0;
+
+	if (class >= 0)
+		return n->count[class];
+
+	for (i = 0; i < AVL_CLASSES; i++)
+		w += n->count[i];
+
+	return w;
+}
+
+static void
+avl_update(avl_node *n)
+{
+	/* Recalculate a node's height and counts from its children */
+
+	size_t i;
+
+	n->height = MAX(H(n->l), H(n->r)) + 1;
+
+	for (i = 0; i < AVL_CLASSES; i++)
+		n->count[i] = (n->l ? n->l->count[i] : 0) + (n->r ? n->r->count[i] : 0) + (n->class == i);
+}
+
+static avl_node*
+avl_new_node(struct avl_pool *p, const unsigned char *map, const char *key, void *val)
+{
+	/* The folded key is stored inline in the node, the key itself is borrowed */
+
+	avl_node *n;
+	size_t i, len = strlen(key) + 1;
+
+	n = avl_pool_get(p, len);
+
+	for (i = 0; i < len; i++)
+		n->fkey[i] = map[(unsigned char)key[i]];
+
+	n->key = key;
+	n->val = val;
+	n->class = 0;
+	n->l = NULL;
+	n->r = NULL;
+
+	avl_update(n);
+
+	return n;
+}
+
+static int
+avl_node_cmp(const void *n1, const void *n2)
+{
+	/* qsort comparison of nodes by folded key */
+
+	return strcmp((*(avl_node * const *)n1)->fkey, (*(avl_node * const *)n2)->fkey);
+}
+
+static int
+avl_cmp(const unsigned char *map, const char *key, const char *fkey)
+{
+	/* Compare a key with a node's folded key, folding only the key */
+
+	const unsigned char *p1 = (const unsigned char *)key;
+	const unsigned char *p2 = (const unsigned char *)fkey;
+
+	while (*p1 && map[*p1] == *p2)
+		p1++, p2++;
+
+	return map[*p1] - *p2;
+}
+
+static int
+avl_ncmp(const unsigned char *map, const char *key, const char *fkey, size_t n)
+{
+	/* Compare at most n characters of a key with a node's folded key */
+
+	const unsigned char *p1 = (const unsigned char *)key;
+	const unsigned char *p2 = (const unsigned char *)fkey;
+
+	if (n == 0)
+		return 0;
+
+	while (--n && *p1 && map[*p1] == *p2)
+		p1++, p2++;
+
+	return map[*p1] - *p2;
+}
+
+static void
+avl_rebalance(avl_node ***path, size_t depth)
+{
+	/* Recalculate heights and rebalance each node on the path from an
+	 * added or removed node back to the root */
+
+	avl_node *n;
+	int balance;
+
+	while (depth--) {
+
+		n = *path[depth];
+
+		avl_update(n);
+
+		balance = H(n->l) - H(n->r);
+
+		/* right rotation */
+		if (balance > 1) {
+
+			/* left-right rotation */
+			if (H(n->l->l) - H(n->l->r) < 0)
+				n->l = avl_rotate_L(n->l);
+
+			*path[depth] = avl_rotate_R(n);
+		}
+
+		/* left rotation */
+		if (balance < -1) {
+
+			/* right-left rotation */
+			if (H(n->r->l) - H(n->r->r) > 0)
+				n->r = avl_rotate_R(n->r);
+
+			*path[depth] = avl_rotate_L(n);
+		}
+	}
+}
+
+static avl_node*
+avl_rotate_R(avl_node *r)
+{
+	/* Rotate right for root r and pivot p
+	 *
+	 *     r          p
+	 *    / \   ->   / \
+	 *   p   c      a   r
+	 *  / \            / \
+	 * a   b          b   c
+	 *
+	 */
+
+	avl_node *p = r->l;
+	avl_node *b = p->r;
+
+	p->r = r;
+	r->l = b;
+
+	avl_update(r);
+	avl_update(p);
+
+	return p;
+}
+
+static avl_node*
+avl_rotate_L(avl_node *r)
+{
+	/* Rotate left for root r and pivot p
+	 *
+	 *   r            p
+	 *  / \    ->    / \
+	 * a   p        r   c
+	 *    / \      / \
+	 *   b   c    a   b
+	 *
+	 */
+
+	avl_node *p = r->r;
+	avl_node *b = p->l;
+
+	p->l = r;
+	r->r = b;
+
+	avl_update(r);
+	avl_update(p);
+
+	return p;
+}
+
+/* AVL node pool
+ *
+ * Nodes are carved from slabs of growing size, freed nodes are kept on lists by
+ * size class for reuse and all slabs are released at once when the tree is freed */
+
+static avl_node*
+avl_pool_get(struct avl_pool *p, size_t len)
+{
+	/* Get a node with space for len bytes of inline key */
+
+	avl_node *n, **np;
+	size_t class, size = AVL_NODE_SIZE(len);
+	struct avl_slab *s;
+
+	class = MIN(size / AVL_POOL_ALIGN, AVL_POOL_CLASSES) - 1;
+
+	/* The last class holds nodes of any larger size, so must be searched */
+	for (np = &(p->free[class]); (n = *np); np = &(n->l)) {
+		if (n->size >= size) {
+			*np = n->l;
+			return n;
+		}
+	}
+
+	if ((s = p->slabs) == NULL || s->size - s->used < size) {
+
+		size_t slab_size = (s == NULL) ? AVL_SLAB_MIN : MIN(s->size * 2, AVL_SLAB_MAX);
+
+		if (slab_size < size)
+			slab_size = size;
+
+		if ((s = malloc(AVL_SLAB_HDR + slab_size)) == NULL)
+			fatal("malloc");
+
+		s->next = p->slabs;
+		s->size = slab_size;
+		s->used = 0;
+
+		p->slabs = s;
+	}
+
+	n = (avl_node *)((char *)s + AVL_SLAB_HDR + s->used);
+	n->size = size;
+
+	s->used += size;
+
+	return n;
+}
+
+static void
+avl_pool_put(struct avl_pool *p, avl_node *n)
+{
+	/* Return a node to its pool's free list for its size class */
+
+	size_t class = MIN(n->size / AVL_POOL_ALIGN, AVL_POOL_CLASSES) - 1;
+
+	n->l = p->free[class];
+	p->free[class] = n;
+}
+
+static void
+avl_pool_free(struct avl_pool *p)
+{
+	struct avl_slab *s, *t;
+
+	for (s = p->slabs; s; s = t) {
+		t = s->next;
+		free(s);
+	}
+
+	memset(p, 0, sizeof(*p));
+}
+
+/* Hash table functions */
+
+int
+hash_add(hash_table *t, casemapping_t cm, const char *key, void *val)
+{
+	/* Add a value to a hash table, keyed by the casemapped folding of key.
+	 *
+	 * Returns 0 if the key already exists */
+
+	return hash_insert(t, casemap[cm], hash_key(casemap[cm], key), key, val);
+}
+
+void*
+hash_get(hash_table *t, casemapping_t cm, const char *key)
+{
+	/* Return the value stored for key, or NULL if not found */
+
+	if (t->count == 0)
+		return NULL;
+
+	const unsigned char *map = casemap[cm];
+
+	return t->entries[hash_find(t, map, hash_key(map, key), key)].val;
+}
+
+void*
+hash_del(hash_table *t, casemapping_t cm, const char *key)
+{
+	/* Remove a key from a hash table, returning its value or NULL if not found */
+
+	return hash_remove(t, casemap[cm], hash_key(casemap[cm], key), key);
+}
+
+int
+hash_add_exact(hash_table *t, const char *key, void *val)
+{
+	/* Add a value to a hash table, keyed case sensitively.
+	 *
+	 * Returns 0 if the key already exists */
+
+	return hash_insert(t, casemap_exact, hash_key(casemap_exact, key), key, val);
+}
+
+void*
+hash_get_exact(hash_table *t, const char *key)
+{
+	if (t->count == 0)
+		return NULL;
+
+	return t->entries[hash_find(t, casemap_exact, hash_key(casemap_exact, key), key)].val;
+}
+
+void*
+hash_del_exact(hash_table *t, const char *key)
+{
+	return hash_remove(t, casemap_exact, hash_key(casemap_exact, key), key);
+}
+
+void
+hash_remap(hash_table *t, casemapping_t cm, void (*val_free)(void*))
+{
+	/* Rehash a table under a new casemapping.
+	 *
+	 * Keys that become duplicates under the new casemapping are discarded,
+	 * and their values passed to val_free if non-NULL */
+
+	hash_table old = *t;
+	size_t i;
+
+	t->count = 0;
+	t->size = 0;
+	t->entries = NULL;
+
+	for (i = 0; i < old.size; i++) {
+		if (old.entries[i].key && !hash_add(t, cm, old.entries[i].key, old.entries[i].val) && val_free)
+			val_free(old.entries[i].val);
+	}
+
+	free(old.entries);
+}
+
+void
+free_hash(hash_table *t)
+{
+	/* Free a hash table's buckets, the keys and values are owned by the caller */
+
+	free(t->entries);
+
+	t->count = 0;
+	t->size = 0;
+	t->entries = NULL;
+}
+
+static int
+hash_insert(hash_table *t, const unsigned char *map, unsigned int hash, const char *key, void *val)
+{
+	size_t i;
+
+	/* Keep the load factor below 3/4 */
+	if ((t->count + 1) * 4 > t->size * 3)
+		hash_resize(t, t->size ? t->size * 2 : HASH_SIZE_MIN);
+
+	if (t->entries[(i = hash_find(t, map, hash, key))].key)
+		return 0;
+
+	t->entries[i].hash = hash;
+	t->entries[i].key = key;
+	t->entries[i].val = val;
+	t->count++;
+
+	return 1;
+}
+
+static void*
+hash_remove(hash_table *t, const unsigned char *map, unsigned int hash, const char *key)
+{
+	/* Entries following the removed entry in its probe sequence are shifted back,
+	 * so no tombstones are left behind */
+
+	size_t i, j, k, mask = t->size - 1;
+	void *val;
+
+	if (t->count == 0)
+		return NULL;
+
+	i = hash_find(t, map, hash, key);
+
+	if (t->entries[i].key == NULL)
+		return NULL;
+
+	val = t->entries[i].val;
+
+	for (j = i;;) {
+
+		j = (j + 1) & mask;
+
+		if (t->entries[j].key == NULL)
+			break;
+
+		k = t->entries[j].hash & mask;
+
+		/* The entry at j can fill the gap at i only if its home bucket k
+		 * doesn't fall cyclically within (i, j] */
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		t->entries[i] = t->entries[j];
+		i = j;
+	}
+
+	t->entries[i].key = NULL;
+	t->entries[i].val = NULL;
+	t->count--;
+
+	return val;
+}
+
+static size_t
+hash_find(hash_table *t, const unsigned char *map, unsigned int hash, const char *key)
+{
+	/* Linear probe for key, returning the index of its entry or of the empty
+	 * bucket where it would be inserted */
+
+	size_t i, mask = t->size - 1;
+
+	for (i = hash & mask; t->entries[i].key; i = (i + 1) & mask) {
+
+		const unsigned char *p1 = (const unsigned char *)key;
+		const unsigned char *p2 = (const unsigned char *)t->entries[i].key;
+
+		if (t->entries[i].hash != hash)
+			continue;
+
+		while (*p1 && map[*p1] == map[*p2])
+			p1++, p2++;
+
+		if (map[*p1] == map[*p2])
+			break;
+	}
+
+	return i;
+}
+
+static unsigned int
+hash_key(const unsigned char *map, const char *key)
+{
+	/* FNV-1a hash of the casemapped folding of key */
+
+	unsigned int hash = 2166136261u;
+
+	while (*key)
+		hash = (hash ^ map[(unsigned char)*key++]) * 16777619u;
+
+	return hash;
+}
+
+static void
+hash_resize(hash_table *t, size_t size)
+{
+	/* Reinsert all entries into a table of size buckets, hashes are retained */
+
+	struct hash_entry *old = t->entries;
+	size_t i, j, mask = size - 1, old_size = t->size;
+
+	if ((t->entries = calloc(size, sizeof(*t->entries))) == NULL)
+		fatal("calloc");
+
+	t->size = size;
+
+	for (i = 0; i < old_size; i++) {
+
+		if (old[i].key == NULL)
+			continue;
+
+		for (j = old[i].hash & mask; t->entries[j].key; j = (j + 1) & mask)
+			;
+
+		t->entries[j] = old[i];
+	}
+
+	free(old);
+}
+
+/* String interning functions */
+
+const char*
+intern(hash_table *pool, const char *str)
+{
+	/* Return a reference to the unique copy of str in pool, creating it if needed.
+	 *
+	 * Each call must be balanced by intern_release */
+
+	struct intern *i;
+	unsigned int hash = hash_key(casemap_exact, str);
+	size_t len;
+
+	if (pool->count && (i = pool->entries[hash_find(pool, casemap_exact, hash, str)].val)) {
+		i->refcount++;
+		return i->str;
+	}
+
+	len = strlen(str);
+
+	if ((i = malloc(sizeof(*i) + len + 1)) == NULL)
+		fatal("malloc");
+
+	memcpy(i->str, str, len + 1);
+
+	i->pool = pool;
+	i->colour = -1;
+	i->hash = hash;
+	i->refcount = 1;
+
+	hash_insert(pool, casemap_exact, hash, i->str, i);
+
+	return i->str;
+}
+
+void
+intern_release(const char *str)
+{
+	/* Release a reference to an interned string, freeing it when unreferenced */
+
+	struct intern *i = INTERN(str);
+
+	if (--i->refcount)
+		return;
+
+	hash_remove(i->pool, casemap_exact, i->hash, i->str);
+
+	free(i);
+}
+
+void
+free_intern_pool(hash_table *pool)
+{
+	/* Free a pool and any strings remaining in it */
+
+	size_t i;
+
+	for (i = 0; i < pool->size; i++)
+		free(pool->entries[i].val);
+
+	free_hash(pool);
+}
+
+/* Ignore list functions
+ *
+ * Masks are normalized to nick!user@host and matched against the sender of a
+ * message under the server's casemapping, eg:
+ *
+ *   nick      -> nick!*@*
+ *   nick!user -> nick!user@*
+ *   user@host -> *!user@host
+ *
+ * Wildcards '*' and '?' match any sequence of characters and any single
+ * character. Masks that can't be matched by hash lookup are compiled to a
+ * bit-parallel NFA: bit k of the state is set when the first k tokens of
+ * the mask match the subject so far. Each glob also has a signature of its
+ * literal characters, so subjects missing any of them are rejected with a
+ * single AND */
+
+struct glob
+{
+	char *mask;
+	char *fmask;          /* Mask folded by the casemapping, consecutive '*' collapsed */
+	size_t len;           /* Number of tokens in fmask */
+	uint64_t sig;         /* Signature of the literal characters */
+	uint64_t star;        /* Bit k set if token k is '*' */
+	uint64_t *table;      /* State transitions by character class */
+	unsigned char class[256];
+	struct glob *next;
+};
+
+int
+ignore_add(struct ignore *i, casemapping_t cm, const char *mask)
+{
+	/* Add a mask to an ignore list
+	 *
+	 * Returns 0 if the mask is already in the list */
+
+	struct hash_table *t;
+	struct glob *g;
+	const char *key;
+	char *m = ignore_mask(mask);
+
+	if ((t = ignore_table(i, m, &key))) {
+		if (hash_add(t, cm, key, m))
+			return 1;
+	} else {
+		for (g = i->globs; g && irc_strcmp(cm, g->mask, m); g = g->next)
+			;
+
+		if (g == NULL) {
+			g = glob_compile(casemap[cm], m);
+			g->next = i->globs;
+			i->globs = g;
+			return 1;
+		}
+	}
+
+	free(m);
+
+	return 0;
+}
+
+int
+ignore_del(struct ignore *i, casemapping_t cm, const char *mask)
+{
+	/* Remove a mask from an ignore list
+	 *
+	 * Returns 0 if the mask isn't in the list */
+
+	struct hash_table *t;
+	struct glob *g, **gp;
+	const char *key;
+	char *m = ignore_mask(mask), *val = NULL;
+
+	if ((t = ignore_table(i, m, &key))) {
+		val = hash_del(t, cm, key);
+	} else {
+		for (gp = &(i->globs); (g = *gp) && irc_strcmp(cm, g->mask, m); gp = &(g->next))
+			;
+
+		if (g) {
+			*gp = g->next;
+			free_glob(g);
+			val = m;
+		}
+	}
+
+	if (val != m)
+		free(val);
+
+	free(m);
+
+	return (val != NULL);
+}
+
+int
+ignore_match(struct ignore *i, casemapping_t cm, const char *nick, const char *hostinfo)
+{
+	/* Returns 1 if a message sender's nick and hostinfo (user@host) are
+	 * matched by any mask in an ignore list */
+
+	char subject[BUFFSIZE];
+	const char *host;
+	const struct glob *g;
+	uint64_t sig = 0;
+	size_t n;
+
+	if (nick == NULL)
+		return 0;
+
+	if (i->nicks.count) {
+		snprintf(subject, sizeof(subject), "%s!*@*", nick);
+
+		if (hash_get(&(i->nicks), cm, subject))
+			return 1;
+	}
+
+	if (hostinfo == NULL)
+		hostinfo = "*@*";
+
+	if (i->hosts.count && (host = strchr(hostinfo, '@')) && hash_get(&(i->hosts), cm, host + 1))
+		return 1;
+
+	if (i->exact.count == 0 && i->globs == NULL)
+		return 0;
+
+	snprintf(subject, sizeof(subject), "%s!%s", nick, hostinfo);
+
+	if (i->exact.count && hash_get(&(i->exact), cm, subject))
+		return 1;
+
+	for (n = 0; subject[n]; n++) {
+		subject[n] = casemap[cm][(unsigned char)subject[n]];
+		sig |= SIG(subject[n]);
+	}
+
+	for (g = i->globs; g; g = g->next) {
+		if (!(g->sig & ~sig) && glob_match(g, subject))
+			return 1;
+	}
+
+	return 0;
+}
+
+void
+ignore_remap(struct ignore *i, casemapping_t cm)
+{
+	/* Rebuild an ignore list under a new casemapping
+	 *
+	 * Masks that become duplicates under the new casemapping are discarded */
+
+	struct hash_table *tables[] = { &(i->exact), &(i->hosts), &(i->nicks) };
+	struct glob *g, *globs = i->globs;
+	size_t n;
+
+	for (n = 0; n < sizeof(tables) / sizeof(tables[0]); n++)
+		hash_remap(tables[n], cm, free);
+
+	for (i->globs = NULL; (g = globs); ) {
+
+		globs = g->next;
+
+		ignore_add(i, cm, g->mask);
+
+		free_glob(g);
+	}
+}
+
+size_t
+ignore_list(struct ignore *i, const char **masks)
+{
+	/* Write an ignore list's masks to an array, unless NULL, returning the
+	 * number of masks */
+
+	struct hash_table *tables[] = { &(i->exact), &(i->hosts), &(i->nicks) };
+	struct glob *g;
+	size_t j, k, n = 0;
+
+	for (j = 0; j < sizeof(tables) / sizeof(tables[0]); j++) {
+
+		if (masks == NULL) {
+			n += tables[j]->count;
+			continue;
+		}
+
+		for (k = 0; k < tables[j]->size; k++) {
+			if (tables[j]->entries[k].key)
+				masks[n++] = tables[j]->entries[k].val;
+		}
+	}
+
+	for (g = i->globs; g; g = g->next, n++) {
+		if (masks)
+			masks[n] = g->mask;
+	}
 
-	/* Match found */
 	return n;
 }
+
+void
+free_ignore(struct ignore *i)
+{
+	struct hash_table *tables[] = { &(i->exact), &(i->hosts), &(i->nicks) };
+	struct glob *g;
+	size_t n, e;
+
+	for (n = 0; n < sizeof(tables) / sizeof(tables[0]); n++) {
+
+		for (e = 0; e < tables[n]->size; e++)
+			free(tables[n]->entries[e].val);
+
+		free_hash(tables[n]);
+	}
+
+	while ((g = i->globs)) {
+		i->globs = g->next;
+		free_glob(g);
+	}
+}
+
+static char*
+ignore_mask(const char *mask)
+{
+	/* Return a newly allocated copy of mask, normalized to nick!user@host */
+
+	const char *fmt;
+	char *ret;
+	size_t len = strlen(mask) + sizeof("!*@*");
+
+	if (!strchr(mask, '!') && !strchr(mask, '@'))
+		fmt = "%s!*@*";
+	else if (!strchr(mask, '!'))
+		fmt = "*!%s";
+	else if (!strchr(mask, '@'))
+		fmt = "%s@*";
+	else
+		fmt = "%s";
+
+	if ((ret = malloc(len)) == NULL)
+		fatal("malloc");
+
+	snprintf(ret, len, fmt, mask);
+
+	return ret;
+}
+
+static struct hash_table*
+ignore_table(struct ignore *i, const char *mask, const char **key)
+{
+	/* Return the hash table a normalized mask is stored in, and its key,
+	 * or NULL if the mask must be compiled */
+
+	const char *bang = strchr(mask, '!');
+
+	if (!strpbrk(mask, "*?")) {
+		*key = mask;
+		return &(i->exact);
+	}
+
+	if (!strncmp(mask, "*!*@", 4) && !strpbrk(mask + 4, "*?")) {
+		*key = mask + 4;
+		return &(i->hosts);
+	}
+
+	if (!strcmp(bang, "!*@*") && bang != mask && !strpbrk(mask, "?") && strchr(mask, '*') == bang + 1) {
+		*key = mask;
+		return &(i->nicks);
+	}
+
+	return NULL;
+}
+
+static struct glob*
+glob_compile(const unsigned char *map, char *mask)
+{
+	/* Compile a mask for matching subjects folded by map. The glob takes
+	 * ownership of mask */
+
+	struct glob *g;
+	const char *p;
+	char *f;
+	size_t k, classes = 1;
+
+	if ((g = calloc(1, sizeof(*g))) == NULL)
+		fatal("calloc");
+
+	if ((g->fmask = malloc(strlen(mask) + 1)) == NULL)
+		fatal("malloc");
+
+	g->mask = mask;
+
+	for (f = g->fmask, p = mask; *p; p++) {
+
+		/* Consecutive '*' are equivalent to one */
+		if (*p == '*' && f > g->fmask && *(f - 1) == '*')
+			continue;
+
+		*f++ = map[(unsigned char)*p];
+	}
+
+	*f = '\0';
+
+	g->len = f - g->fmask;
+
+	for (p = g->fmask; *p; p++) {
+		if (*p != '*' && *p != '?')
+			g->sig |= SIG(*p);
+	}
+
+	/* Long globs are matched with fmask only */
+	if (g->len > GLOB_BITS)
+		return g;
+
+	for (p = g->fmask; *p; p++) {
+		if (*p != '*' && *p != '?' && g->class[(unsigned char)*p] == 0)
+			g->class[(unsigned char)*p] = classes++;
+	}
+
+	if ((g->table = calloc(classes, sizeof(*g->table))) == NULL)
+		fatal("calloc");
+
+	/* Wildcards match any character, in every class. Literals only their own */
+	for (k = 0, p = g->fmask; *p; k++, p++) {
+
+		if (*p == '*')
+			g->star |= ((uint64_t)1 << k);
+
+		if (*p == '*' || *p == '?') {
+			size_t c;
+
+			for (c = 0; c < classes; c++)
+				g->table[c] |= ((uint64_t)1 << (k + 1));
+		} else {
+			g->table[g->class[(unsigned char)*p]] |= ((uint64_t)1 << (k + 1));
+		}
+	}
+
+	return g;
+}
+
+static int
+glob_match(const struct glob *g, const char *s)
+{
+	/* Match a folded subject against a compiled glob */
+
+	uint64_t d = 1;
+
+	if (g->len > GLOB_BITS)
+		return glob_match_slow(g->fmask, s);
+
+	/* '*' also matches the empty string, so its state also enables the next */
+	d |= (d & g->star) << 1;
+
+	for (; *s && d; s++) {
+		d = ((d << 1) & g->table[g->class[(unsigned char)*s]]) | (d & (g->star << 1));
+		d |= (d & g->star) << 1;
+	}
+
+	return !!(d & ((uint64_t)1 << g->len));
+}
+
+static int
+glob_match_slow(const char *p, const char *s)
+{
+	/* Match a subject against a glob, backtracking to the last '*' on mismatch */
+
+	const char *star = NULL, *ss = s;
+
+	while (*s) {
+		if (*p == '?' || (*p != '*' && *p == *s)) {
+			p++, s++;
+		} else if (*p == '*') {
+			star = p++;
+			ss = s;
+		} else if (star) {
+			p = star + 1;
+			s = ++ss;
+		} else {
+			return 0;
+		}
+	}
+
+	while (*p == '*')
+		p++;
+
+	return (*p == '\0');
+}
+
+static void
+free_glob(struct glob *g)
+{
+	free(g->mask);
+	free(g->fmask);
+	free(g->table);
+	free(g);
+}
+
+/* Highlights
+ *
+ * The nick and words are folded by the casemapping and inserted in a trie
+ * over the classes of characters they contain, all other characters sharing
+ * class 0. Failure links are then resolved into the transition table, so
+ * matching takes exactly one transition per character of the message */
+
+struct highlight_state
+{
+	unsigned int fail;
+	unsigned int dict; /* Nearest state on the failure path that ends a word */
+	unsigned int word; /* Index + 1 of the first word ending at this state */
+};
+
+struct highlight_word
+{
+	size_t len;
+	int bound;
+	unsigned int next; /* Index + 1 of the next word ending at the same state */
+};
+
+void
+highlight_compile(struct highlight *h, casemapping_t cm, const char *nick, const char *words)
+{
+	/* Compile a nick, and a comma and/or space separated list of words to
+	 * highlight, eg: "rirc, *bot*" */
+
+	const unsigned char *map = casemap[cm];
+	const char *lists[2], *l, *p;
+	unsigned int *queue, c, s, t, w;
+	size_t i, n, len, head, tail, nstates = 1, nwords = 0;
+	int bound;
+
+	free_highlight(h);
+
+	h->cm = cm;
+	h->classes = 1;
+	memset(h->class, 0, sizeof(h->class));
+	snprintf(h->nick, sizeof(h->nick), "%s", nick);
+
+	lists[0] = h->nick;
+	lists[1] = words ? words : "";
+
+	/* Size the trie and assign character classes */
+	for (i = 0; i < 2; i++) {
+		for (l = lists[i]; (p = highlight_token(&l, &len, &bound)); ) {
+
+			nstates += len;
+			nwords++;
+
+			for (n = 0; n < len; n++) {
+				if (h->class[map[(unsigned char)p[n]]] == 0)
+					h->class[map[(unsigned char)p[n]]] = h->classes++;
+			}
+		}
+	}
+
+	if (nwords == 0)
+		return;
+
+	if ((h->delta = calloc(nstates * h->classes, sizeof(*h->delta))) == NULL)
+		fatal("calloc");
+
+	if ((h->states = calloc(nstates, sizeof(*h->states))) == NULL)
+		fatal("calloc");
+
+	if ((h->words = calloc(nwords, sizeof(*h->words))) == NULL)
+		fatal("calloc");
+
+	if ((queue = malloc(nstates * sizeof(*queue))) == NULL)
+		fatal("malloc");
+
+	/* Build the trie, state 0 is the root and never the target of a trie edge */
+	for (nstates = 1, w = 0, i = 0; i < 2; i++) {
+		for (l = lists[i]; (p = highlight_token(&l, &len, &bound)); w++) {
+
+			for (s = 0, n = 0; n < len; n++, s = t) {
+
+				c = h->class[map[(unsigned char)p[n]]];
+
+				if ((t = h->delta[s * h->classes + c]) == 0)
+					t = h->delta[s * h->classes + c] = nstates++;
+			}
+
+			h->words[w].len = len;
+			h->words[w].bound = bound;
+			h->words[w].next = h->states[s].word;
+			h->states[s].word = w + 1;
+		}
+	}
+
+	/* Breadth first, so failure states are complete before they're followed */
+	for (head = tail = 0, c = 0; c < h->classes; c++) {
+		if ((t = h->delta[c]))
+			queue[tail++] = t;
+	}
+
+	while (head < tail) {
+
+		s = queue[head++];
+
+		if (h->states[h->states[s].fail].word)
+			h->states[s].dict = h->states[s].fail;
+		else
+			h->states[s].dict = h->states[h->states[s].fail].dict;
+
+		for (c = 0; c < h->classes; c++) {
+
+			unsigned int f = h->delta[h->states[s].fail * h->classes + c];
+
+			if ((t = h->delta[s * h->classes + c])) {
+				h->states[t].fail = f;
+				queue[tail++] = t;
+			} else {
+				h->delta[s * h->classes + c] = f;
+			}
+		}
+	}
+
+	free(queue);
+}
+
+int
+highlight_match(const struct highlight *h, const char *mesg)
+{
+	/* Returns 1 if any highlight word occurs in the message within its
+	 * word boundaries */
+
+	const unsigned char *map = casemap[h->cm];
+	const struct highlight_word *word;
+	unsigned int s, t, w;
+	size_t i, start;
+
+	if (h->delta == NULL)
+		return 0;
+
+	for (s = 0, i = 0; mesg[i]; i++) {
+
+		s = h->delta[s * h->classes + h->class[map[(unsigned char)mesg[i]]]];
+
+		for (t = s; t; t = h->states[t].dict) {
+			for (w = h->states[t].word; w; w = word->next) {
+
+				word = &(h->words[w - 1]);
+				start = i + 1 - word->len;
+
+				if ((word->bound & HIGHLIGHT_L) && start && irc_isnickchar(mesg[start - 1]))
+					continue;
+
+				if ((word->bound & HIGHLIGHT_R) && irc_isnickchar(mesg[i + 1]))
+					continue;
+
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void
+free_highlight(struct highlight *h)
+{
+	free(h->delta);
+	free(h->states);
+	free(h->words);
+
+	h->delta = NULL;
+	h->states = NULL;
+	h->words = NULL;
+}
+
+static const char*
+highlight_token(const char **list, size_t *len, int *bound)
+{
+	/* Return the next word in a list and its length without any leading or
+	 * trailing '*', and set the word boundaries it must match at */
+
+	const char *p;
+	size_t n;
+
+	do {
+		p = *list + strspn(*list, ", ");
+		n = strcspn(p, ", ");
+
+		*list = p + n;
+		*bound = HIGHLIGHT_L | HIGHLIGHT_R;
+
+		if (n == 0)
+			return NULL;
+
+		for (; n && *p == '*'; p++, n--)
+			*bound &= ~HIGHLIGHT_L;
+
+		for (; n && p[n - 1] == '*'; n--)
+			*bound &= ~HIGHLIGHT_R;
+
+	} while (n == 0);
+
+	*len = n;
+
+	return p;
+}
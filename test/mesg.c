@@ -187,12 +187,12 @@ test_send_ignore(void)
 {
 	/* /ignore [nick] */
 
-	nicklist_print__called__ = 0;
+	ignore_print__called__ = 0;
 
 	char str1[] = "";
 	send_ignore(err, str1, c);
 
-	assert_equals(nicklist_print__called__, 1);
+	assert_equals(ignore_print__called__, 1);
 
 
 	newlinef__called__ = 0;
@@ -220,6 +220,27 @@ test_send_join(void)
 	/* TODO */ ;
 }
 
+static void
+test_send_list(void)
+{
+	/* /list [channels] [server] */
+
+	*sendf__buff__ = 0;
+
+	char str1[] = "";
+	send_list(err, str1, c);
+
+	assert_strcmp(sendf__buff__, "LIST");
+
+
+	*sendf__buff__ = 0;
+
+	char str2[] = "#chan1,#chan2";
+	send_list(err, str2, c);
+
+	assert_strcmp(sendf__buff__, "LIST #chan1,#chan2");
+}
+
 static void
 test_send_me(void)
 {
@@ -232,6 +253,67 @@ test_send_msg(void)
 	/* TODO */ ;
 }
 
+static void
+test_send_names(void)
+{
+	/* /names [channel] */
+
+	*err = 0;
+
+	char str1[] = "";
+	send_names(err, str1, c);
+
+	assert_strcmp(err, "Error: /names <channel>");
+
+
+	*sendf__buff__ = 0;
+
+	char str2[] = "#chan";
+	send_names(err, str2, c);
+
+	assert_strcmp(sendf__buff__, "NAMES #chan");
+
+
+	/* The current channel's nicklist is printed locally */
+	c->buffer_type = BUFFER_CHANNEL;
+	nicklist_print__called__ = 0;
+	*sendf__buff__ = 0;
+
+	char str3[] = "";
+	send_names(err, str3, c);
+
+	assert_equals(nicklist_print__called__, 1);
+	assert_strcmp(sendf__buff__, "");
+
+
+	/* Lazy nicklists are loaded, and printed once loaded */
+	c->lazy = 1;
+	nicklist_load__called__ = 0;
+	nicklist_print__called__ = 0;
+
+	char str4[] = "";
+	send_names(err, str4, c);
+
+	assert_equals(nicklist_load__called__, 1);
+	assert_equals(nicklist_print__called__, 0);
+	assert_equals(c->load_print, 1);
+	assert_strcmp(sendf__buff__, "");
+
+
+	/* Parted channels are queried */
+	c->parted = 1;
+
+	char str5[] = "";
+	send_names(err, str5, c);
+
+	assert_strcmp(sendf__buff__, "NAMES mock-channel");
+
+	c->buffer_type = BUFFER_OTHER;
+	c->lazy = 0;
+	c->load_print = 0;
+	c->parted = 0;
+}
+
 static void
 test_send_nick(void)
 {
@@ -257,6 +339,101 @@ test_send_nick(void)
 	assert_strcmp(sendf__buff__, "NICK nick_test");
 }
 
+static void
+test_send_nicklist(void)
+{
+	/* /nicklist [auto | full | lazy] */
+
+	*err = 0;
+	nicklist_set_policy__called__ = 0;
+
+	char str1[] = "lazy";
+	send_nicklist(err, str1, c);
+
+	assert_strcmp(err, "Error: /nicklist is only available in channels");
+	assert_equals(nicklist_set_policy__called__, 0);
+
+	c->buffer_type = BUFFER_CHANNEL;
+
+
+	*err = 0;
+
+	char str2[] = "sometimes";
+	send_nicklist(err, str2, c);
+
+	assert_strcmp(err, "Error: /nicklist [auto | full | lazy]");
+	assert_equals(nicklist_set_policy__called__, 0);
+
+
+	char str3[] = "LAZY";
+	send_nicklist(err, str3, c);
+
+	assert_equals(nicklist_set_policy__called__, 1);
+	assert_equals(nicklist_set_policy__policy__, NICKLIST_LAZY);
+	assert_strcmp(newlinef__buff__, "Nicklist policy set to lazy");
+
+
+	/* No args prints the policy and state */
+	c->lazy = 1;
+	c->nick_count = 12345;
+	nicklist_set_policy__called__ = 0;
+
+	char str4[] = "";
+	send_nicklist(err, str4, c);
+
+	assert_equals(nicklist_set_policy__called__, 0);
+	assert_strcmp(newlinef__buff__, "Nicklist policy: auto, lazy with 12345 users");
+
+	c->buffer_type = BUFFER_OTHER;
+	c->lazy = 0;
+	c->nick_count = 0;
+}
+
+static void
+test_send_notify(void)
+{
+	/* /notify [nick[,nick]* ...] */
+
+	watch_print__called__ = 0;
+
+	char str1[] = "";
+	send_notify(err, str1, c);
+
+	assert_equals(watch_print__called__, 1);
+
+
+	watch_add__called__ = 0;
+
+	char str2[] = "alice,bob carol";
+	send_notify(err, str2, c);
+
+	assert_equals(watch_add__called__, 3);
+	assert_strcmp(newlinef__buff__, "Watching 'carol'");
+
+
+	watch_add__return__ = 0;
+
+	char str3[] = "alice";
+	send_notify(err, str3, c);
+
+	assert_strcmp(newlinef__buff__, "Error: Already watching 'alice'");
+
+	watch_add__return__ = 1;
+
+
+	/* Nicks longer than the server's NICKLEN aren't watched */
+	watch_add__called__ = 0;
+	mock_s.isupport.nicklen = 4;
+
+	char str4[] = "alice";
+	send_notify(err, str4, c);
+
+	assert_equals(watch_add__called__, 0);
+	assert_strcmp(newlinef__buff__, "Error: Nicks are limited to 4 characters");
+
+	mock_s.isupport.nicklen = 0;
+}
+
 static void
 test_send_part(void)
 {
@@ -266,7 +443,68 @@ test_send_part(void)
 static void
 test_send_privmsg(void)
 {
-	/* TODO */ ;
+	/* /(priv | msg) <target[,targets]*> <message> */
+
+	*err = 0;
+
+	char str1[] = "";
+	send_privmsg(err, str1, c);
+
+	assert_strcmp(err, "Error: Private messages require a target");
+
+
+	/* Without TARGMAX, targets are sent one per line */
+	sendf__count__ = 0;
+
+	char str2[] = "a,b,c hello";
+	send_privmsg(err, str2, c);
+
+	assert_equals(sendf__count__, 3);
+	assert_strcmp(sendf__lines__[0], "PRIVMSG a :hello");
+	assert_strcmp(sendf__lines__[2], "PRIVMSG c :hello");
+
+
+	/* Packed by TARGMAX */
+	mock_s.isupport.targmax_privmsg = 2;
+	sendf__count__ = 0;
+
+	char str3[] = "a,b,c hello";
+	send_privmsg(err, str3, c);
+
+	assert_equals(sendf__count__, 2);
+	assert_strcmp(sendf__lines__[0], "PRIVMSG a,b :hello");
+	assert_strcmp(sendf__lines__[1], "PRIVMSG c :hello");
+
+
+	/* Split at words to fit LINELEN as relayed with our prefix, 27 bytes of
+	 * ":mock-nick!u@h PRIVMSG  :\r\n" leaving 32 for the target and text */
+	user u = { .nick = "mock-nick", .hostinfo = "u@h" };
+
+	user_get__user__ = &u;
+	mock_s.isupport.linelen = 60;
+	sendf__count__ = 0;
+
+	char str4[] = "a the quick brown fox jumps over the lazy dog";
+	send_privmsg(err, str4, c);
+
+	assert_equals(sendf__count__, 2);
+	assert_strcmp(sendf__lines__[0], "PRIVMSG a :the quick brown fox jumps over");
+	assert_strcmp(sendf__lines__[1], "PRIVMSG a :the lazy dog");
+
+
+	/* Packing targets would need more lines of text than it saves */
+	sendf__count__ = 0;
+
+	char str5[] = "target1,target2 ab cdefghijklmnopqrs tuvw";
+	send_privmsg(err, str5, c);
+
+	assert_equals(sendf__count__, 2);
+	assert_strcmp(sendf__lines__[0], "PRIVMSG target1 :ab cdefghijklmnopqrs tuvw");
+	assert_strcmp(sendf__lines__[1], "PRIVMSG target2 :ab cdefghijklmnopqrs tuvw");
+
+	user_get__user__ = NULL;
+	mock_s.isupport.linelen = 0;
+	mock_s.isupport.targmax_privmsg = 0;
 }
 
 static void
@@ -281,6 +519,19 @@ test_send_raw(void)
 	/* TODO */ ;
 }
 
+static void
+test_send_sort(void)
+{
+	/* /sort [users | name] */
+
+	*err = 0;
+
+	char str1[] = "users";
+	send_sort(err, str1, c);
+
+	assert_strcmp(err, "Error: /sort is only available in the /list buffer");
+}
+
 static void
 test_send_topic(void)
 {
@@ -293,14 +544,285 @@ test_send_unignore(void)
 	/* TODO */ ;
 }
 
+static void
+test_send_unnotify(void)
+{
+	/* /unnotify [nick[,nick]* ...] */
+
+	watch_print__called__ = 0;
+
+	char str1[] = "";
+	send_unnotify(err, str1, c);
+
+	assert_equals(watch_print__called__, 1);
+
+
+	char str2[] = "alice";
+	send_unnotify(err, str2, c);
+
+	assert_strcmp(newlinef__buff__, "No longer watching 'alice'");
+
+
+	watch_del__return__ = 0;
+
+	char str3[] = "alice";
+	send_unnotify(err, str3, c);
+
+	assert_strcmp(newlinef__buff__, "Error: 'alice' not on watch list");
+
+	watch_del__return__ = 1;
+}
+
 static void
 test_send_version(void)
 {
 	/* TODO */ ;
 }
 
+static void
+test_send_whois(void)
+{
+	/* /whois <nick> [nick] */
+
+	*err = 0;
+
+	char str1[] = "";
+	send_whois(err, str1, c);
+
+	assert_strcmp(err, "Error: /whois <nick>");
+
+
+	/* Unknown users are queried */
+	user_get__user__ = NULL;
+	*sendf__buff__ = 0;
+
+	char str2[] = "nick";
+	send_whois(err, str2, c);
+
+	assert_strcmp(sendf__buff__, "WHOIS nick");
+
+
+	/* Users without a WHO reply are queried */
+	user u = {
+		.nick = "nick",
+		.hostinfo = "user@host",
+	};
+
+	user_get__user__ = &u;
+	*sendf__buff__ = 0;
+
+	char str3[] = "nick";
+	send_whois(err, str3, c);
+
+	assert_strcmp(sendf__buff__, "WHOIS nick");
+
+
+	/* Cached users are described locally */
+	u.realname = "real name";
+	u.account = "acct";
+	u.away = 1;
+
+	*sendf__buff__ = 0;
+	*newlinef__buff__ = 0;
+
+	char str4[] = "nick";
+	send_whois(err, str4, c);
+
+	assert_strcmp(sendf__buff__, "");
+	assert_strcmp(newlinef__buff__, "nick is away");
+
+
+	/* A second argument always queries the server */
+	char str5[] = "nick nick";
+	send_whois(err, str5, c);
+
+	assert_strcmp(sendf__buff__, "WHOIS nick nick");
+
+	user_get__user__ = NULL;
+}
+
+static void
+test_send_mesg(void)
+{
+	/* Exact commands are preferred over abbreviations of longer commands */
+
+	init_mesg();
+
+	*sendf__buff__ = 0;
+
+	char str1[] = "/nick foo";
+	send_mesg(str1, c);
+
+	assert_strcmp(sendf__buff__, "NICK foo");
+
+
+	/* Abbreviations are matched */
+	user_get__user__ = NULL;
+	*sendf__buff__ = 0;
+
+	char str2[] = "/whoi foo";
+	send_mesg(str2, c);
+
+	assert_strcmp(sendf__buff__, "WHOIS foo");
+
+	free_mesg();
+}
+
+static void
+test_send_paste(void)
+{
+	/* Pastes are queued line by line, split to fit LINELEN */
+
+	sendq_add__called__ = 0;
+
+	char str1[] = "line one\r\nline two\r\n";
+	send_paste(str1, c);
+
+	assert_equals(sendq_add__called__, 0);
+
+
+	c->buffer_type = BUFFER_CHANNEL;
+
+	char str2[] = "line one\r\n\r\nline two\r\n";
+	send_paste(str2, c);
+
+	assert_equals(sendq_add__called__, 2);
+	assert_strcmp(sendq_add__text__, "line two");
+
+
+	/* 15 + 9 + 3 + 12 bytes of ":mock-nick!u@h PRIVMSG mock-channel :\r\n"
+	 * leave 21 for text */
+	user u = { .nick = "mock-nick", .hostinfo = "u@h" };
+
+	user_get__user__ = &u;
+	mock_s.isupport.linelen = 60;
+	sendq_add__called__ = 0;
+
+	char str3[] = "the quick brown fox jumps over the lazy dog";
+	send_paste(str3, c);
+
+	assert_equals(sendq_add__called__, 3);
+	assert_strcmp(sendq_add__text__, "dog");
+
+	user_get__user__ = NULL;
+	mock_s.isupport.linelen = 0;
+	c->buffer_type = BUFFER_OTHER;
+}
+
 /* recv handler tests */
 
+static void
+test_recv_mesg(void)
+{
+	/* Tags are received beyond the 512 bytes of a message */
+
+	char mesg[TAGSIZE + BUFFSIZE], body[BUFFSIZE - 16];
+	int len;
+
+	memset(body, 'x', sizeof(body) - 1);
+	body[sizeof(body) - 1] = 0;
+
+	len = snprintf(mesg, sizeof(mesg), "@time=2020-01-01T00:00:00.000Z;msgid=%0*d;a=%0*d "
+		":mock-host PING :%s\r\n", 400, 1, 3000, 2, body);
+
+	mock_s.iptr = mock_s.input;
+	*sendf__buff__ = 0;
+
+	recv_mesg(mesg, len, &mock_s);
+
+	assert_equals((int)strlen(sendf__buff__), (int)strlen("PONG ") + (int)strlen(body));
+	assert_strcmp(sendf__buff__ + strlen("PONG "), body);
+	assert_equals(mock_s.iptr == mock_s.input, 1);
+}
+
+static void
+test_recv_mode(void)
+{
+	/* Prefix modes, and modes with modeparams under CHANMODES */
+
+	char mesg[BUFFSIZE];
+	int len;
+
+	strcpy(mock_s.prefix_chars, "@+");
+	strcpy(mock_s.prefix_modes, "ov");
+	mock_s.chanmodes.A = mode_bit('b');
+	mock_s.chanmodes.B = mode_bit('k');
+	mock_s.chanmodes.C = mode_bit('l');
+	mock_s.chanmodes.D = mode_bit('n') | mode_bit('t');
+	channel_get__channel__ = c;
+
+	/* Each prefix mode takes a nick */
+	len = snprintf(mesg, sizeof(mesg), ":op!u@h MODE #chan +ov nick1 nick2\r\n");
+
+	mock_s.iptr = mock_s.input;
+	nicklist_set_prefix__count__ = 0;
+	channel_set_mode__count__ = 0;
+
+	recv_mesg(mesg, len, &mock_s);
+
+	assert_equals(nicklist_set_prefix__count__, 2);
+	assert_strcmp(nicklist_set_prefix__modes__[0], "+o nick1");
+	assert_strcmp(nicklist_set_prefix__modes__[1], "+v nick2");
+	assert_equals(channel_set_mode__count__, 0);
+
+	/* +k always takes a modeparam, +l only when set, +b is a list mode
+	 * and +nt never take one */
+	len = snprintf(mesg, sizeof(mesg), ":op!u@h MODE #chan -kl+nbtlo-v key *!*@h 10 nick1 :nick2\r\n");
+
+	mock_s.iptr = mock_s.input;
+	nicklist_set_prefix__count__ = 0;
+	channel_set_mode__count__ = 0;
+
+	recv_mesg(mesg, len, &mock_s);
+
+	assert_equals(channel_set_mode__count__, 5);
+	assert_strcmp(channel_set_mode__modes__[0], "-k key");
+	assert_strcmp(channel_set_mode__modes__[1], "-l");
+	assert_strcmp(channel_set_mode__modes__[2], "+n");
+	assert_strcmp(channel_set_mode__modes__[3], "+t");
+	assert_strcmp(channel_set_mode__modes__[4], "+l 10");
+	assert_equals(nicklist_set_prefix__count__, 2);
+	assert_strcmp(nicklist_set_prefix__modes__[0], "+o nick1");
+	assert_strcmp(nicklist_set_prefix__modes__[1], "-v nick2");
+
+	*mock_s.prefix_chars = 0;
+	*mock_s.prefix_modes = 0;
+	memset(&(mock_s.chanmodes), 0, sizeof(mock_s.chanmodes));
+	channel_get__channel__ = NULL;
+}
+
+static void
+test_recv_names(void)
+{
+	/* With multi-prefix, all of a user's prefixes precede the nick */
+
+	char mesg[BUFFSIZE];
+	int len;
+
+	strcpy(mock_s.prefix_chars, "@%+");
+	channel_get__channel__ = c;
+
+	len = snprintf(mesg, sizeof(mesg), ":mock-host 353 mock-nick = #chan :@+nick1 %%nick2 nick3 @%%+nick4\r\n");
+
+	mock_s.iptr = mock_s.input;
+	nicklist_stage__count__ = 0;
+
+	recv_mesg(mesg, len, &mock_s);
+
+	assert_equals(nicklist_stage__count__, 4);
+	assert_strcmp(nicklist_stage__nicks__[0], "nick1");
+	assert_equals(nicklist_stage__prefixes__[0], 0x5);
+	assert_strcmp(nicklist_stage__nicks__[1], "nick2");
+	assert_equals(nicklist_stage__prefixes__[1], 0x2);
+	assert_strcmp(nicklist_stage__nicks__[2], "nick3");
+	assert_equals(nicklist_stage__prefixes__[2], 0x0);
+	assert_strcmp(nicklist_stage__nicks__[3], "nick4");
+	assert_equals(nicklist_stage__prefixes__[3], 0x7);
+
+	*mock_s.prefix_chars = 0;
+	channel_get__channel__ = NULL;
+}
+
 static void
 test_recv_join(void)
 {
@@ -316,7 +838,13 @@ main(void)
 		HANDLED_SEND_CMDS
 		#undef X
 
+		&test_send_mesg,
+		&test_send_paste,
+
 		/* TODO: all the other recv commands */
+		&test_recv_mesg,
+		&test_recv_mode,
+		&test_recv_names,
 		&test_recv_join,
 	};
 
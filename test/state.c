@@ -0,0 +1,321 @@
+#include "../src/state.c"
+#include "../src/utils.c"
+
+#include "test.h"
+
+/* Mock stuff */
+
+unsigned int term_cols = 80, term_rows = 24;
+
+void
+action(int (*fn)(char), const char *fmt, ...)
+{
+	UNUSED(fn);
+	UNUSED(fmt);
+}
+
+input*
+new_input(void)
+{
+	return NULL;
+}
+
+void
+free_input(input *in)
+{
+	UNUSED(in);
+}
+
+server*
+get_server_head(void)
+{
+	return NULL;
+}
+
+int
+sendf(char *err, server *s, const char *fmt, ...)
+{
+	UNUSED(err);
+	UNUSED(s);
+	UNUSED(fmt);
+
+	return 0;
+}
+
+void
+server_disconnect(server *s, int err, int kill, char *mesg)
+{
+	UNUSED(s);
+	UNUSED(err);
+	UNUSED(kill);
+	UNUSED(mesg);
+}
+
+static server*
+mock_server(void)
+{
+	server *s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		fatal("calloc");
+
+	s->soc = -1;
+	s->iptr = s->input;
+	strcpy(s->nick, "mock-nick");
+
+	server_set_chanmodes(s, NULL);
+	server_set_prefix(s, NULL);
+
+	s->channel = new_channel("mock-host", s, NULL, BUFFER_SERVER);
+
+	return s;
+}
+
+static void
+mock_server_free(server *s)
+{
+	channel *t, *c = s->channel;
+
+	do {
+		t = c;
+		c = c->next;
+		free_channel(t);
+	} while (c != s->channel);
+
+	free_netsplits(s);
+	free_floods(s);
+	free_hash(&(s->chan_table));
+	free_hash(&(s->user_table));
+	free_intern_pool(&(s->intern_pool));
+	free(s);
+}
+
+/* State tests */
+
+static void
+test_server_set_casemapping(void)
+{
+	/* Test merging users whose nicks collide under a new casemapping */
+
+	server *s = mock_server();
+	channel *c1, *c2, *c3;
+	membership *m;
+	user *u;
+
+	config.lazy_nicklist_threshold = 100;
+
+	server_set_casemapping(s, CASEMAPPING_ASCII);
+
+	c1 = new_channel("#c1", s, s->channel, BUFFER_CHANNEL);
+	c2 = new_channel("#c2", s, s->channel, BUFFER_CHANNEL);
+	c3 = new_channel("#c3", s, s->channel, BUFFER_CHANNEL);
+
+	/* Distinct under ascii, the same nick under rfc1459 */
+	nicklist_add(c1, "nick[1]", NULL);
+	nicklist_add(c1, "nick{1}", NULL);
+	nicklist_add(c2, "nick{1}", NULL);
+	nicklist_add(c2, "nick2", NULL);
+	nicklist_set_prefix(c2, "nick{1}", 'o', 1);
+	nicklist_stage(c3, "nick[1]", 0);
+	nicklist_stage(c3, "nick{1}", 0);
+
+	assert_equals((int)s->user_table.count, 3);
+	assert_equals(c1->nick_count, 2);
+
+	server_set_casemapping(s, CASEMAPPING_RFC1459);
+
+	/* Merged into one user, in each channel once */
+	assert_equals((int)s->user_table.count, 2);
+
+	if ((u = user_get(s, "NICK[1]")) == NULL)
+		fail_test("merged user not found");
+
+	assert_equals(c1->nick_count, 1);
+	assert_equals((int)avl_size(&(c1->nicklist), -1), 1);
+	assert_equals(c2->nick_count, 2);
+	assert_equals((int)avl_size(&(c2->nicklist), -1), 2);
+	assert_equals((int)c3->names.count, 1);
+
+	if ((m = membership_get(c1, "nick{1}")) == NULL || m->user != u)
+		fail_test("merged user's membership not found");
+
+	if ((m = membership_get(c2, "nick[1]")) == NULL || m->user != u)
+		fail_test("moved membership not found");
+
+	/* Nicklist nodes are keyed by the merged user's nick, and keep their class */
+	if (avl_get(&(c2->nicklist), s->casemapping, "NICK{1}", 7)->key != u->nick)
+		fail_test("moved membership's node not rekeyed");
+
+	assert_equals((int)avl_size(&(c2->nicklist), 1), 1);
+
+	/* The merged user is freed with its last membership */
+	nicklist_del(c1, "nick{1}");
+	nicklist_del(c2, "nick[1]");
+
+	assert_equals((int)s->user_table.count, 2);
+
+	nicklist_commit(c3);
+	nicklist_del(c3, "nick[1]");
+
+	assert_equals((int)s->user_table.count, 1);
+
+	if (user_get(s, "nick[1]") != NULL)
+		fail_test("merged user not freed");
+
+	mock_server_free(s);
+}
+
+static void
+test_netsplit(void)
+{
+	/* Test counting users quitting in netsplits and rejoining after them */
+
+	server *s = mock_server();
+	channel *c1 = new_channel("#c1", s, s->channel, BUFFER_CHANNEL);
+	channel *c2 = new_channel("#c2", s, s->channel, BUFFER_CHANNEL);
+	buffer_line *head;
+	time_t t;
+
+	/* Users' own QUIT messages aren't counted */
+	assert_equals(netsplit_quit(c1, "nick1", "Quit: irc.a.net irc.b.net"), 0);
+	assert_equals(netsplit_quit(c1, "nick1", NULL), 0);
+
+	/* QUITs of a netsplit are counted together, per channel */
+	assert_equals(netsplit_quit(c1, "nick1", "irc.a.net irc.b.net"), 1);
+	assert_equals(netsplit_quit(c1, "nick2", "irc.a.net irc.b.net"), 1);
+	assert_equals(netsplit_quit(c2, "nick1", "irc.a.net irc.b.net"), 1);
+	assert_equals(netsplit_quit(c2, "nick3", "irc.a.net irc.c.net"), 1);
+
+	t = time(NULL);
+	head = c1->buffer_head;
+
+	/* Printed once no QUIT was counted for NETSPLIT_WINDOW seconds */
+	netsplit_flush(s, t);
+
+	if (c1->buffer_head != head)
+		fail_test("netsplit printed within NETSPLIT_WINDOW");
+
+	netsplit_flush(s, t + NETSPLIT_WINDOW);
+
+	assert_strcmp(buffer_line_text(c1->buffer_head), "Netsplit irc.a.net <-> irc.b.net: 2 users");
+	assert_strcmp(buffer_line_text(c2->buffer_head - 1), "Netsplit irc.a.net <-> irc.c.net: 1 user");
+	assert_strcmp(buffer_line_text(c2->buffer_head), "Netsplit irc.a.net <-> irc.b.net: 1 user");
+
+	/* Only printed once */
+	head = c1->buffer_head;
+
+	netsplit_flush(s, t + NETSPLIT_WINDOW * 2);
+
+	if (c1->buffer_head != head)
+		fail_test("netsplit printed twice");
+
+	/* Users lost in a netsplit are counted rejoining, under the server's
+	 * casemapping */
+	assert_equals(netsplit_join(c1, "NICK1"), 1);
+	assert_equals(netsplit_join(c1, "nick2"), 1);
+	assert_equals(netsplit_join(c1, "nick4"), 0);
+
+	t = time(NULL);
+
+	netsplit_flush(s, t + NETSPLIT_WINDOW);
+
+	assert_strcmp(buffer_line_text(c1->buffer_head), "Netjoin irc.a.net <-> irc.b.net: 2 users");
+
+	/* Netsplits are forgotten after NETSPLIT_TIMEOUT */
+	if (s->netsplits == NULL)
+		fail_test("netsplit forgotten before NETSPLIT_TIMEOUT");
+
+	netsplit_flush(s, t + NETSPLIT_TIMEOUT);
+
+	if (s->netsplits != NULL)
+		fail_test("netsplit not forgotten after NETSPLIT_TIMEOUT");
+
+	assert_equals(netsplit_join(c2, "nick3"), 0);
+
+	mock_server_free(s);
+}
+
+static void
+test_speakers(void)
+{
+	/* Test a channel's recent speakers */
+
+	server *s = mock_server();
+	channel *c = new_channel("#c", s, s->channel, BUFFER_CHANNEL);
+	struct speakers *sp = &(c->speakers);
+	char nick[NICKSIZE];
+	int i;
+
+	speaker_add(c, "nick1");
+	speaker_add(c, "nick2");
+	speaker_add(c, "nick3");
+
+	/* Speakers are found under the server's casemapping */
+	assert_equals(speaker_recent(c, "nick1"), 1);
+	assert_equals(speaker_recent(c, "NICK2"), 1);
+	assert_equals(speaker_recent(c, "nick4"), 0);
+
+	/* Most recent first, speaking again moves a speaker to the front */
+	assert_strcmp(sp->head->nick, "nick3");
+	assert_strcmp(sp->tail->nick, "nick1");
+
+	speaker_add(c, "nick1");
+
+	assert_strcmp(sp->head->nick, "nick1");
+	assert_strcmp(sp->tail->nick, "nick2");
+	assert_equals((int)sp->count, 3);
+
+	/* Speakers older than SPEAKERS_WINDOW aren't recent, and are evicted */
+	sp->tail->time -= SPEAKERS_WINDOW;
+
+	assert_equals(speaker_recent(c, "nick2"), 0);
+	assert_equals(speaker_recent(c, "nick3"), 1);
+
+	speaker_add(c, "nick4");
+
+	assert_equals((int)sp->count, 3);
+	assert_strcmp(sp->tail->nick, "nick3");
+
+	/* Renamed speakers keep their place */
+	speaker_rename(c, "nick3", "nick5");
+
+	assert_equals(speaker_recent(c, "nick3"), 0);
+	assert_equals(speaker_recent(c, "nick5"), 1);
+	assert_strcmp(sp->tail->nick, "nick5");
+
+	/* Renamed to a speaker's nick, that speaker is replaced */
+	speaker_rename(c, "nick5", "NICK4");
+
+	assert_equals(speaker_recent(c, "nick4"), 1);
+	assert_equals(speaker_recent(c, "nick5"), 0);
+	assert_strcmp(sp->head->nick, "nick1");
+	assert_strcmp(sp->tail->nick, "NICK4");
+	assert_equals((int)sp->count, 2);
+
+	/* The least recent beyond SPEAKERS_MAX are evicted */
+	for (i = 0; i < SPEAKERS_MAX; i++) {
+		snprintf(nick, sizeof(nick), "user%d", i);
+		speaker_add(c, nick);
+	}
+
+	assert_equals((int)sp->count, SPEAKERS_MAX);
+	assert_equals(speaker_recent(c, "nick1"), 0);
+	assert_equals(speaker_recent(c, "NICK4"), 0);
+	assert_equals(speaker_recent(c, "user0"), 1);
+	assert_strcmp(sp->tail->nick, "user0");
+	assert_strcmp(sp->head->nick, nick);
+
+	mock_server_free(s);
+}
+
+int
+main(void)
+{
+	testcase tests[] = {
+		&test_server_set_casemapping,
+		&test_netsplit,
+		&test_speakers,
+	};
+
+	return run_tests(tests);
+}
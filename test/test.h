@@ -8,7 +8,7 @@ typedef void (*testcase)(void);
 
 static int _failures_, _failures_t_, _failure_printed_;
 
-static int _assert_strcmp(char*, char*);
+static int _assert_strcmp(const char*, const char*);
 
 #define fail_test(M) \
 	do { \
@@ -45,7 +45,7 @@ static int _assert_strcmp(char*, char*);
 	} while (0)
 
 static int
-_assert_strcmp(char *p1, char *p2)
+_assert_strcmp(const char *p1, const char *p2)
 {
 	if (p1 == NULL || p2 == NULL)
 		return p1 != p2;
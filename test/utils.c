@@ -27,10 +27,10 @@ _avl_is_binary(avl_node *n)
 	if (n == NULL)
 		return 1;
 
-	if (n->l && (strcmp(n->key, n->l->key) <= 0))
+	if (n->l && (strcmp(n->fkey, n->l->fkey) <= 0))
 		return 0;
 
-	if (n->r && (strcmp(n->key, n->r->key) >= 0))
+	if (n->r && (strcmp(n->fkey, n->r->fkey) >= 0))
 		return 0;
 
 	return 1 & _avl_is_binary(n->l) & _avl_is_binary(n->r);
@@ -45,6 +45,24 @@ _avl_height(avl_node *n)
 	return 1 + MAX(_avl_height(n->l), _avl_height(n->r));
 }
 
+static int
+_avl_is_counted(avl_node *n)
+{
+	/* Check that each node's class counts are those of its subtree */
+
+	int i;
+
+	if (n == NULL)
+		return 1;
+
+	for (i = 0; i < AVL_CLASSES; i++) {
+		if (n->count[i] != (n->l ? n->l->count[i] : 0) + (n->r ? n->r->count[i] : 0) + (n->class == i))
+			return 0;
+	}
+
+	return 1 & _avl_is_counted(n->l) & _avl_is_counted(n->r);
+}
+
 /*
  * Tests
  * */
@@ -54,7 +72,7 @@ test_avl(void)
 {
 	/* Test AVL tree functions */
 
-	avl_node *root = NULL;
+	avl_tree t = {0};
 
 	/* Insert strings a-z, zz-za, aa-az to hopefully excersize all combinations of rotations */
 	const char **ptr, *strings[] = {
@@ -71,62 +89,629 @@ test_avl(void)
 
 	/* Add all strings to the tree */
 	for (ptr = strings; *ptr; ptr++) {
-		if (!avl_add(&root, *ptr, NULL))
+		if (!avl_add(&t, CASEMAPPING_ASCII, *ptr, NULL))
 			fail_testf("avl_add() failed to add %s", *ptr);
 		else
 			count++;
 	}
 
 	/* Check that all were added correctly */
-	if ((ret = _avl_count(root)) != count)
+	if ((ret = _avl_count(t.root)) != count)
 		fail_testf("_avl_count() returned %d, expected %d", ret, count);
 
 	/* Check that the binary properties of the tree hold */
-	if (!_avl_is_binary(root))
+	if (!_avl_is_binary(t.root))
 		fail_test("_avl_is_binary() failed");
 
 	/* Check that the height of root stays within the mathematical bounds AVL trees allow */
 	double max_height = 1.44 * log2(count + 2) - 0.328;
 
-	if ((ret = _avl_height(root)) >= max_height)
+	if ((ret = _avl_height(t.root)) >= max_height)
 		fail_testf("_avl_height() returned %d, expected strictly less than %f", ret, max_height);
 
 	/* Test adding a duplicate and case sensitive duplicate */
-	if (avl_add(&root, "aa", NULL) && count++)
+	if (avl_add(&t, CASEMAPPING_ASCII, "aa", NULL) && count++)
 		fail_test("avl_add() failed to detect duplicate 'aa'");
 
-	if (avl_add(&root, "aA", NULL) && count++)
+	if (avl_add(&t, CASEMAPPING_ASCII, "aA", NULL) && count++)
 		fail_test("avl_add() failed to detect case sensitive duplicate 'aA'");
 
 	/* Delete about half of the strings */
 	int num_delete = count / 2;
 
 	for (ptr = strings; *ptr && num_delete > 0; ptr++, num_delete--) {
-		if (!avl_del(&root, *ptr))
+		if (!avl_del(&t, CASEMAPPING_ASCII, *ptr, NULL))
 			fail_testf("avl_del() failed to delete %s", *ptr);
 		else
 			count--;
 	}
 
 	/* Check that all were deleted correctly */
-	if ((ret = _avl_count(root)) != count)
+	if ((ret = _avl_count(t.root)) != count)
 		fail_testf("_avl_count() returned %d, expected %d", ret, count);
 
 	/* Check that the binary properties of the tree still hold */
-	if (!_avl_is_binary(root))
+	if (!_avl_is_binary(t.root))
 		fail_test("_avl_is_binary() failed");
 
 	/* Check that the height of root is still within the mathematical bounds AVL trees allow */
 	max_height = 1.44 * log2(count + 2) - 0.328;
 
-	if ((ret = _avl_height(root)) >= max_height)
+	if ((ret = _avl_height(t.root)) >= max_height)
 		fail_testf("_avl_height() returned %d, expected strictly less than %f", ret, max_height);
 
 	/* Test deleting string that was previously deleted */
-	if (avl_del(&root, *strings))
+	if (avl_del(&t, CASEMAPPING_ASCII, *strings, NULL))
 		fail_testf("_avl_del() should have failed to delete %s", *strings);
 }
 
+void
+test_avl_casemapping(void)
+{
+	/* Test AVL tree keys are compared under the given casemapping */
+
+	avl_tree t = {0};
+
+	if (!avl_add(&t, CASEMAPPING_RFC1459, "nick[away]", NULL))
+		fail_test("avl_add() failed to add 'nick[away]'");
+
+	if (avl_add(&t, CASEMAPPING_RFC1459, "NICK{AWAY}", NULL))
+		fail_test("avl_add() failed to detect rfc1459 duplicate 'NICK{AWAY}'");
+
+	if (!avl_get(&t, CASEMAPPING_RFC1459, "Nick{a", strlen("Nick{a")))
+		fail_test("avl_get() failed to find rfc1459 prefix 'Nick{a'");
+
+	/* Rebuilding under ascii, '[' and '{' are no longer equivalent */
+	avl_remap(&t, CASEMAPPING_ASCII, free);
+
+	if (!avl_add(&t, CASEMAPPING_ASCII, "NICK{AWAY}", NULL))
+		fail_test("avl_add() failed to add ascii distinct 'NICK{AWAY}'");
+
+	if (!avl_del(&t, CASEMAPPING_ASCII, "nick[AWAY]", NULL))
+		fail_test("avl_del() failed to delete 'nick[AWAY]'");
+
+	if (!avl_del(&t, CASEMAPPING_ASCII, "nick{away}", NULL))
+		fail_test("avl_del() failed to delete 'nick{away}'");
+
+	assert_equals(_avl_count(t.root), 0);
+
+	free_avl(&t, free);
+}
+
+static int avl_val_free_count;
+
+static void
+_avl_val_free(void *val)
+{
+	(void)val;
+	avl_val_free_count++;
+}
+
+void
+test_avl_pool(void)
+{
+	/* Test AVL tree node reuse, remapping and bulk freeing */
+
+	avl_tree t = {0};
+
+	char keys[200][16];
+	const avl_node *n;
+	void *val;
+	int i;
+
+	for (i = 0; i < 200; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "Nick[%03d]", i);
+
+		if (!avl_add(&t, CASEMAPPING_ASCII, keys[i], keys[i]))
+			fail_testf("avl_add() failed to add %s", keys[i]);
+	}
+
+	/* Freed nodes are reused for keys of the same size */
+	if ((n = avl_get(&t, CASEMAPPING_ASCII, "nick[042]", strlen("nick[042]"))) == NULL)
+		fail_test("avl_get() failed to find 'nick[042]'");
+
+	if (!avl_del(&t, CASEMAPPING_ASCII, "nick[042]", &val) || val != keys[42])
+		fail_test("avl_del() failed to delete 'nick[042]'");
+
+	if (!avl_add(&t, CASEMAPPING_ASCII, "Nick{042}", NULL))
+		fail_test("avl_add() failed to add 'Nick{042}'");
+
+	if (avl_get(&t, CASEMAPPING_ASCII, "nick{042}", strlen("nick{042}")) != n)
+		fail_test("avl_add() failed to reuse a freed node");
+
+	/* Under rfc1459 'Nick{043}' and 'Nick[043]' are duplicates */
+	if (!avl_add(&t, CASEMAPPING_ASCII, "Nick{043}", NULL))
+		fail_test("avl_add() failed to add 'Nick{043}'");
+
+	assert_equals(_avl_count(t.root), 201);
+
+	avl_val_free_count = 0;
+
+	avl_remap(&t, CASEMAPPING_RFC1459, _avl_val_free);
+
+	assert_equals(avl_val_free_count, 1);
+	assert_equals(_avl_count(t.root), 200);
+
+	if (!_avl_is_binary(t.root))
+		fail_test("_avl_is_binary() failed after avl_remap()");
+
+	for (i = 0; i < 200; i++) {
+		if (!avl_get(&t, CASEMAPPING_RFC1459, keys[i], strlen(keys[i])))
+			fail_testf("avl_get() failed to find %s after avl_remap()", keys[i]);
+	}
+
+	avl_val_free_count = 0;
+
+	free_avl(&t, _avl_val_free);
+
+	assert_equals(avl_val_free_count, 200);
+
+	if (t.root || t.pool.slabs)
+		fail_test("free_avl() failed to reset the tree");
+}
+
+void
+test_avl_build(void)
+{
+	/* Test building AVL trees in bulk */
+
+	avl_tree t = {0};
+
+	struct avl_entry e[1000];
+	char keys[1000][16];
+	double max_height;
+	int i, ret;
+
+	/* Entries in reverse order, with every 100th key duplicated under rfc1459 */
+	for (i = 0; i < 1000; i++) {
+		if (i % 100 == 99)
+			snprintf(keys[i], sizeof(keys[i]), "NICK{%03d}", 1000 - i);
+		else
+			snprintf(keys[i], sizeof(keys[i]), "nick[%03d]", 999 - i);
+
+		e[i].key = keys[i];
+		e[i].val = NULL;
+		e[i].class = 0;
+	}
+
+	avl_val_free_count = 0;
+
+	if ((ret = (int)avl_build(&t, CASEMAPPING_RFC1459, e, 1000, _avl_val_free)) != 990)
+		fail_testf("avl_build() returned %d, expected 990", ret);
+
+	assert_equals(avl_val_free_count, 10);
+	assert_equals(_avl_count(t.root), 990);
+
+	if (!_avl_is_binary(t.root))
+		fail_test("_avl_is_binary() failed");
+
+	/* A perfectly balanced tree of n nodes has height ceil(log2(n + 1)) */
+	assert_equals(_avl_height(t.root), 10);
+
+	/* Heights must be correct for subsequent rebalancing */
+	for (i = 0; i < 1000; i += 2) {
+		if (i % 100 != 99 && !avl_del(&t, CASEMAPPING_RFC1459, keys[i], NULL))
+			fail_testf("avl_del() failed to delete %s", keys[i]);
+	}
+
+	max_height = 1.44 * log2(_avl_count(t.root) + 2) - 0.328;
+
+	if ((ret = _avl_height(t.root)) >= max_height)
+		fail_testf("_avl_height() returned %d, expected strictly less than %f", ret, max_height);
+
+	/* Building into a non-empty tree merges the entries with its nodes, and
+	 * relinks it perfectly balanced */
+	avl_val_free_count = 0;
+
+	if ((ret = (int)avl_build(&t, CASEMAPPING_RFC1459, e, 1000, _avl_val_free)) != 500)
+		fail_testf("avl_build() returned %d, expected 500", ret);
+
+	assert_equals(avl_val_free_count, 500);
+	assert_equals(_avl_count(t.root), 990);
+	assert_equals(_avl_height(t.root), 10);
+
+	if (!_avl_is_binary(t.root))
+		fail_test("_avl_is_binary() failed");
+
+	free_avl(&t, _avl_val_free);
+}
+
+void
+test_mode(void)
+{
+	/* Test mode flag and parameter functions */
+
+	struct mode m = {0};
+	char buf[MAX_ERROR];
+
+	if (mode_bit('A') != 1 || mode_bit('a') != ((uint64_t)1 << 26) || mode_bit('z') != ((uint64_t)1 << 51))
+		fail_test("mode_bit() returned unexpected bits");
+
+	if (mode_bit('0') || mode_bit('@') || mode_set(&m, '#', 1, NULL))
+		fail_test("mode_bit() accepted invalid flag");
+
+	mode_set(&m, 'n', 1, NULL);
+	mode_set(&m, 't', 1, NULL);
+	mode_set(&m, 'l', 1, "10");
+	mode_set(&m, 'k', 1, "key");
+	mode_set(&m, 'C', 1, NULL);
+
+	mode_str(&m, buf, sizeof(buf));
+	assert_strcmp(buf, "Cklnt key 10");
+
+	/* Setting a flag again replaces its parameter */
+	mode_set(&m, 'l', 1, "20");
+	mode_set(&m, 'k', 0, NULL);
+	mode_set(&m, 't', 0, NULL);
+
+	mode_str(&m, buf, sizeof(buf));
+	assert_strcmp(buf, "Cln 20");
+
+	/* Output is truncated to the buffer size */
+	mode_str(&m, buf, 5);
+	assert_strcmp(buf, "Cln ");
+
+	mode_reset(&m);
+
+	mode_str(&m, buf, sizeof(buf));
+	assert_strcmp(buf, "");
+}
+
+void
+test_hash(void)
+{
+	/* Test hash table functions */
+
+	hash_table t = {0};
+
+	char keys[500][8];
+	int i, vals[500];
+
+	/* Add enough keys to force several resizes */
+	for (i = 0; i < 500; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "#C[%d]", i);
+		vals[i] = i;
+
+		if (!hash_add(&t, CASEMAPPING_RFC1459, keys[i], &vals[i]))
+			fail_testf("hash_add() failed to add %s", keys[i]);
+	}
+
+	assert_equals((int)t.count, 500);
+
+	/* Test duplicate detection under casemapping */
+	if (hash_add(&t, CASEMAPPING_RFC1459, "#c{42}", NULL))
+		fail_test("hash_add() failed to detect rfc1459 duplicate '#c{42}'");
+
+	int *val;
+
+	if ((val = hash_get(&t, CASEMAPPING_RFC1459, "#c{42}")) == NULL || *val != 42)
+		fail_test("hash_get() failed to find '#c{42}'");
+
+	if (hash_get(&t, CASEMAPPING_RFC1459, "#c{500}"))
+		fail_test("hash_get() found nonexistent key '#c{500}'");
+
+	/* Delete every other key, the remaining keys must still be found */
+	for (i = 0; i < 500; i += 2) {
+		if ((val = hash_del(&t, CASEMAPPING_RFC1459, keys[i])) == NULL || *val != i)
+			fail_testf("hash_del() failed to delete %s", keys[i]);
+	}
+
+	assert_equals((int)t.count, 250);
+
+	for (i = 0; i < 500; i++) {
+		if ((hash_get(&t, CASEMAPPING_RFC1459, keys[i]) == NULL) != !(i % 2))
+			fail_testf("hash_get() returned wrong result for %s", keys[i]);
+	}
+
+	if (hash_del(&t, CASEMAPPING_RFC1459, keys[0]))
+		fail_testf("hash_del() should have failed to delete %s", keys[0]);
+
+	/* Rehashed under ascii, '[' and '{' are no longer equivalent */
+	hash_remap(&t, CASEMAPPING_ASCII, NULL);
+
+	if (hash_get(&t, CASEMAPPING_ASCII, "#c{1}"))
+		fail_test("hash_get() found ascii distinct key '#c{1}'");
+
+	if (hash_get(&t, CASEMAPPING_ASCII, "#c[1]") == NULL)
+		fail_test("hash_get() failed to find '#c[1]'");
+
+	free_hash(&t);
+
+	assert_equals((int)t.count, 0);
+	if (hash_get(&t, CASEMAPPING_ASCII, "#c[1]"))
+		fail_test("hash_get() found key in freed table");
+
+	/* Exact keys are case sensitive, eg: msgids */
+	if (!hash_add_exact(&t, "AbC", "1") || !hash_add_exact(&t, "abc", "2"))
+		fail_test("hash_add_exact() failed to add case distinct keys");
+
+	if (hash_add_exact(&t, "AbC", "3"))
+		fail_test("hash_add_exact() added duplicate key 'AbC'");
+
+	assert_strcmp((char *)hash_get_exact(&t, "AbC"), "1");
+	assert_strcmp((char *)hash_get_exact(&t, "abc"), "2");
+	assert_strcmp((char *)hash_get_exact(&t, "ABC"), NULL);
+	assert_strcmp((char *)hash_del_exact(&t, "abc"), "2");
+	assert_strcmp((char *)hash_get_exact(&t, "abc"), NULL);
+	assert_strcmp((char *)hash_get_exact(&t, "AbC"), "1");
+
+	free_hash(&t);
+}
+
+void
+test_ignore(void)
+{
+	/* Test ignore list masks and matching */
+
+	struct ignore i = {0};
+	char long_mask[128];
+
+	/* Bare nicks are normalized to nick!*@* */
+	if (!ignore_add(&i, CASEMAPPING_RFC1459, "bob"))
+		fail_test("ignore_add() failed to add 'bob'");
+
+	if (ignore_add(&i, CASEMAPPING_RFC1459, "BOB!*@*"))
+		fail_test("ignore_add() failed to detect duplicate 'BOB!*@*'");
+
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "Bob", "user@host"), 1);
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "bo", "user@host"), 0);
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "bobby", "user@host"), 0);
+
+	/* Literal masks, and any nick at a literal host */
+	ignore_add(&i, CASEMAPPING_RFC1459, "nick[a]!user@host.tld");
+	ignore_add(&i, CASEMAPPING_RFC1459, "*@spam.host");
+
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "NICK{A}", "user@HOST.tld"), 1);
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "nick[a]", "resu@host.tld"), 0);
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "anyone", "any@spam.host"), 1);
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "anyone", "any@spam.hosts"), 0);
+
+	/* Wildcard masks */
+	ignore_add(&i, CASEMAPPING_RFC1459, "*!*@*.example.com");
+	ignore_add(&i, CASEMAPPING_RFC1459, "gu?st*!~*@*");
+
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "x", "y@a.b.example.com"), 1);
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "x", "y@example.com"), 0);
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "Guest42", "~u@h"), 1);
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "Gust42", "~u@h"), 0);
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "Guest42", "u@h"), 0);
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "Guest42", NULL), 0);
+
+	/* Masks too long to match bit-parallel */
+	memset(long_mask, 'a', sizeof(long_mask));
+	memcpy(long_mask, "*!*@*", 5);
+	long_mask[100] = '*';
+	long_mask[sizeof(long_mask) - 1] = 0;
+
+	ignore_add(&i, CASEMAPPING_RFC1459, long_mask);
+
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "x", long_mask + 3), 1);
+	assert_equals(ignore_match(&i, CASEMAPPING_RFC1459, "x", long_mask + 5), 0);
+
+	if (!ignore_del(&i, CASEMAPPING_RFC1459, long_mask))
+		fail_test("ignore_del() failed to delete long mask");
+
+	/* Rebuilding under ascii, '[' and '{' are no longer equivalent */
+	ignore_remap(&i, CASEMAPPING_ASCII);
+
+	assert_equals(ignore_match(&i, CASEMAPPING_ASCII, "NICK{A}", "user@host.tld"), 0);
+	assert_equals(ignore_match(&i, CASEMAPPING_ASCII, "NICK[A]", "user@host.tld"), 1);
+	assert_equals(ignore_match(&i, CASEMAPPING_ASCII, "GUEST", "~u@h"), 1);
+
+	if (!ignore_del(&i, CASEMAPPING_ASCII, "*!*@*.EXAMPLE.com"))
+		fail_test("ignore_del() failed to delete '*!*@*.EXAMPLE.com'");
+
+	if (ignore_del(&i, CASEMAPPING_ASCII, "*!*@*.example.com"))
+		fail_test("ignore_del() deleted '*!*@*.example.com' twice");
+
+	if (!ignore_del(&i, CASEMAPPING_ASCII, "*@spam.host"))
+		fail_test("ignore_del() failed to delete '*@spam.host'");
+
+	assert_equals(ignore_match(&i, CASEMAPPING_ASCII, "x", "y@a.example.com"), 0);
+	assert_equals(ignore_match(&i, CASEMAPPING_ASCII, "anyone", "any@spam.host"), 0);
+
+	/* Listing the remaining normalized masks, in any order */
+	const char *masks[3], *expected[] = { "bob!*@*", "nick[a]!user@host.tld", "gu?st*!~*@*" };
+	int j, k, found;
+
+	assert_equals((int)ignore_list(&i, NULL), 3);
+	assert_equals((int)ignore_list(&i, masks), 3);
+
+	for (j = 0; j < 3; j++) {
+
+		for (k = 0, found = 0; k < 3; k++)
+			found |= !strcmp(masks[k], expected[j]);
+
+		if (!found)
+			fail_testf("ignore_list() failed to list '%s'", expected[j]);
+	}
+
+	free_ignore(&i);
+
+	assert_equals(ignore_match(&i, CASEMAPPING_ASCII, "bob", "user@host"), 0);
+}
+
+void
+test_intern(void)
+{
+	/* Test string interning functions */
+
+	hash_table pool = {0};
+
+	char buf[] = "nick";
+	const char *s1, *s2, *s3;
+
+	s1 = intern(&pool, "nick");
+	s2 = intern(&pool, buf);
+	s3 = intern(&pool, "NICK");
+
+	/* Equal strings are interned once, interning is case sensitive */
+	if (s1 != s2)
+		fail_test("intern() returned distinct copies of 'nick'");
+
+	if (s1 == s3)
+		fail_test("intern() returned the same copy of 'nick' and 'NICK'");
+
+	if (s1 == buf)
+		fail_test("intern() returned the string being interned");
+
+	if (strcmp(s1, "nick"))
+		fail_testf("intern() returned '%s', expected 'nick'", s1);
+
+	assert_equals((int)INTERN(s1)->refcount, 2);
+	assert_equals((int)pool.count, 2);
+
+	/* Strings are removed from the pool when no longer referenced */
+	intern_release(s1);
+	intern_release(s3);
+
+	assert_equals((int)pool.count, 1);
+
+	intern_release(s2);
+
+	assert_equals((int)pool.count, 0);
+
+	s1 = intern(&pool, "nick");
+
+	assert_equals((int)INTERN(s1)->refcount, 1);
+	assert_equals(INTERN(s1)->colour, -1);
+
+	free_intern_pool(&pool);
+
+	assert_equals((int)pool.count, 0);
+}
+
+void
+test_avl_rank(void)
+{
+	/* Test selecting AVL tree nodes by rank, overall and by class */
+
+	avl_tree t = {0};
+
+	const avl_node *nodes[100];
+	struct avl_entry e[1000];
+	char keys[1000][16];
+	int i, j, k, class;
+	size_t first, n;
+
+	/* Keys nick000-nick999, classed by their value modulo 3 */
+	for (i = 0; i < 1000; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "nick%03d", i);
+		e[i].key = keys[i];
+		e[i].val = NULL;
+		e[i].class = i % 3;
+	}
+
+	avl_build(&t, CASEMAPPING_RFC1459, e, 1000, _avl_val_free);
+
+	/* Deleting every 5th key, and adding keys rebalances the counts */
+	for (i = 0; i < 1000; i += 5)
+		avl_del(&t, CASEMAPPING_RFC1459, keys[i], NULL);
+
+	for (i = 0; i < 1000; i += 10)
+		avl_add(&t, CASEMAPPING_RFC1459, keys[i], NULL);
+
+	/* Re-added keys are class 0, reclass the keys ending in 1 to class 2 */
+	for (i = 1; i < 1000; i += 10) {
+		if (!avl_set_class(&t, CASEMAPPING_RFC1459, keys[i], 2))
+			fail_testf("avl_set_class() failed to find %s", keys[i]);
+	}
+
+	assert_equals(avl_set_class(&t, CASEMAPPING_RFC1459, "nick005", 1), 0);
+
+	if (!_avl_is_counted(t.root))
+		fail_test("_avl_is_counted() failed");
+
+	assert_equals((int)avl_size(&t, -1), 900);
+
+	/* Compare to the expected order of each class */
+	for (class = -1; class < 3; class++) {
+
+		for (i = 0, k = 0; i < 1000; i++) {
+
+			int c = (i % 10 == 1) ? 2 : (i % 10 == 0) ? 0 : i % 3;
+
+			if (i % 5 == 0 && i % 10 != 0)
+				continue;
+
+			if (class >= 0 && c != class)
+				continue;
+
+			if (avl_select(&t, k, class)->key != keys[i])
+				fail_testf("avl_select() %d of class %d failed, expected %s", k, class, keys[i]);
+
+			if ((int)avl_rank(&t, CASEMAPPING_RFC1459, keys[i], class) != k)
+				fail_testf("avl_rank() of %s in class %d failed, expected %d", keys[i], class, k);
+
+			/* Ranges from each node up to the end of the class */
+			n = avl_range(&t, k, class, nodes, 100);
+
+			for (j = 0; j < (int)n; j++) {
+				if (nodes[j] != avl_select(&t, k + j, class))
+					fail_testf("avl_range() from %d of class %d failed at %d", k, class, j);
+			}
+
+			if ((int)n != MIN(100, (int)avl_size(&t, class) - k))
+				fail_testf("avl_range() from %d of class %d returned %d", k, class, (int)n);
+
+			k++;
+		}
+
+		assert_equals(k, (int)avl_size(&t, class));
+
+		if (avl_select(&t, k, class) || avl_range(&t, k, class, nodes, 100))
+			fail_testf("avl_select() %d of class %d should have failed", k, class);
+	}
+
+	/* Keys not in the tree are ranked by their position */
+	assert_equals((int)avl_rank(&t, CASEMAPPING_RFC1459, "nick005x", -1), 5);
+	assert_equals((int)avl_rank(&t, CASEMAPPING_RFC1459, "a", -1), 0);
+	assert_equals((int)avl_rank(&t, CASEMAPPING_RFC1459, "z", -1), 900);
+
+	/* Prefixes match contiguous ranges, nick005 having been deleted */
+	assert_equals((int)avl_prefix(&t, CASEMAPPING_RFC1459, "NICK00xyz", 6, &first), 9);
+	assert_equals((int)first, 0);
+
+	assert_equals((int)avl_prefix(&t, CASEMAPPING_RFC1459, "nick1", 5, &first), 90);
+	assert_equals((int)first, 90);
+	assert_strcmp(avl_select(&t, first, -1)->key, "nick100");
+
+	assert_equals((int)avl_prefix(&t, CASEMAPPING_RFC1459, "nick005", 7, &first), 0);
+	assert_equals((int)first, 5);
+
+	assert_equals((int)avl_prefix(&t, CASEMAPPING_RFC1459, "x", 0, &first), 900);
+	assert_equals((int)first, 0);
+
+	assert_equals((int)avl_prefix(&t, CASEMAPPING_RFC1459, "z", 1, &first), 0);
+	assert_equals((int)first, 900);
+
+	free_avl(&t, _avl_val_free);
+}
+
+void
+test_irc_strcmp(void)
+{
+	/* Test string comparison under each casemapping */
+
+	assert_equals(irc_strcmp(CASEMAPPING_ASCII, "abc", "ABC"), 0);
+	assert_equals(!irc_strcmp(CASEMAPPING_ASCII, "a[]\\~", "A{}|^"), 0);
+
+	assert_equals(irc_strcmp(CASEMAPPING_RFC1459, "a[]\\~", "A{}|^"), 0);
+	assert_equals(!irc_strcmp(CASEMAPPING_RFC1459, "abc", "abcd"), 0);
+
+	assert_equals(irc_strcmp(CASEMAPPING_STRICT_RFC1459, "a[]\\", "A{}|"), 0);
+	assert_equals(!irc_strcmp(CASEMAPPING_STRICT_RFC1459, "~", "^"), 0);
+
+	assert_equals(irc_strncmp(CASEMAPPING_RFC1459, "nick[1]", "NICK{2}", 5), 0);
+	assert_equals(!irc_strncmp(CASEMAPPING_RFC1459, "nick[1]", "NICK{2}", 6), 0);
+	assert_equals(irc_strncmp(CASEMAPPING_RFC1459, "a", "b", 0), 0);
+
+	assert_equals(casemapping_get("ascii"), CASEMAPPING_ASCII);
+	assert_equals(casemapping_get("strict-rfc1459"), CASEMAPPING_STRICT_RFC1459);
+	assert_equals(casemapping_get("rfc1459"), CASEMAPPING_RFC1459);
+	assert_equals(casemapping_get("unknown"), CASEMAPPING_RFC1459);
+}
+
 void
 test_getarg(void)
 {
@@ -279,42 +864,247 @@ test_parse(void)
 
 	if ((parse(&p, mesg9)) != NULL)
 		fail_test("parse() was expected to fail");
+
+	/* Test message tags, with escaped and missing values */
+	char mesg10[] = "@time=2011-10-19T16:40:51.620Z;+a=b\\:c\\sd\\\\e\\;empty=;flag :nick!user@host CMD arg :trailing";
+
+	if ((parse(&p, mesg10)) == NULL)
+		fail_test("Failed to parse message");
+	assert_equals(p.tag_count, 4);
+	assert_strcmp(mesg_tag(&p, "time"),  "2011-10-19T16:40:51.620Z");
+	assert_strcmp(mesg_tag(&p, "+a"),    "b;c d\\e");
+	assert_strcmp(mesg_tag(&p, "empty"), "");
+	assert_strcmp(mesg_tag(&p, "flag"),  "");
+	assert_strcmp(mesg_tag(&p, "batch"), NULL);
+	assert_strcmp(p.from,     "nick");
+	assert_strcmp(p.hostinfo, "user@host");
+	assert_strcmp(p.command,  "CMD");
+	assert_strcmp(p.params,   "arg");
+	assert_strcmp(p.trailing, "trailing");
+
+	/* Test message tags without prefix */
+	char mesg11[] = "@batch=ref CMD";
+
+	if ((parse(&p, mesg11)) == NULL)
+		fail_test("Failed to parse message");
+	assert_strcmp(mesg_tag(&p, "batch"), "ref");
+	assert_strcmp(p.from,    NULL);
+	assert_strcmp(p.command, "CMD");
+}
+
+static void
+test_parse_time(void)
+{
+	/* Test parsing IRCv3 server-time timestamps */
+
+	time_t t;
+
+	if (!parse_time("1970-01-01T00:00:00.000Z", &t))
+		fail_test("parse_time() failed");
+	assert_equals((int)t, 0);
+
+	if (!parse_time("2011-10-19T16:40:51.620Z", &t))
+		fail_test("parse_time() failed");
+	assert_equals((int)t, 1319042451);
+
+	if (!parse_time("2000-02-29T23:59:59Z", &t))
+		fail_test("parse_time() failed");
+	assert_equals((int)t, 951868799);
+
+	if (parse_time("2011-13-19T16:40:51.620Z", &t))
+		fail_test("parse_time() was expected to fail");
+
+	if (parse_time("2011-10-19", &t))
+		fail_test("parse_time() was expected to fail");
 }
 
 void
-test_check_pinged(void)
+test_highlight(void)
 {
-	/* Test detecting user's nick in message */
+	/* Test detecting the user's nick and highlight words in messages */
+
+	struct highlight h = {0};
+
+	/* No words, nothing matched */
+	highlight_compile(&h, CASEMAPPING_RFC1459, "", " ,* ");
+	assert_equals(highlight_match(&h, "testing testnick testing"), 0);
 
-	char *nick = "testnick";
+	highlight_compile(&h, CASEMAPPING_RFC1459, "testnick", NULL);
 
 	/* Test message contains username */
-	char *mesg1 = "testing testnick testing";
-	assert_equals(check_pinged(mesg1, nick), 1);
+	assert_equals(highlight_match(&h, "testing testnick testing"), 1);
 
 	/* Test common way of addressing messages to users */
-	char *mesg2 = "testnick: testing";
-	assert_equals(check_pinged(mesg2, nick), 1);
+	assert_equals(highlight_match(&h, "testnick: testing"), 1);
 
 	/* Test non-nick char prefix */
-	char *mesg3 = "testing !@#testnick testing";
-	assert_equals(check_pinged(mesg3, nick), 1);
+	assert_equals(highlight_match(&h, "testing !@#testnick testing"), 1);
 
 	/* Test non-nick char suffix */
-	char *mesg4 = "testing testnick!@#$ testing";
-	assert_equals(check_pinged(mesg4, nick), 1);
+	assert_equals(highlight_match(&h, "testing testnick!@#$ testing"), 1);
 
 	/* Test non-nick char prefix and suffix */
-	char *mesg5 = "testing !testnick! testing";
-	assert_equals(check_pinged(mesg5, nick), 1);
+	assert_equals(highlight_match(&h, "testing !testnick! testing"), 1);
 
 	/* Error: message doesn't contain username */
-	char *mesg6 = "testing testing";
-	assert_equals(check_pinged(mesg6, nick), 0);
+	assert_equals(highlight_match(&h, "testing testing"), 0);
 
 	/* Error: message contains username prefix */
-	char *mesg7 = "testing testnickshouldfail testing";
-	assert_equals(check_pinged(mesg7, nick), 0);
+	assert_equals(highlight_match(&h, "testing testnickshouldfail testing"), 0);
+
+	/* Error: message contains username suffix */
+	assert_equals(highlight_match(&h, "testing shouldfailtestnick testing"), 0);
+
+	/* Error: message ends in a partial match */
+	assert_equals(highlight_match(&h, "testing testnic"), 0);
+
+	/* Test nick matched under rfc1459 casemapping */
+	highlight_compile(&h, CASEMAPPING_RFC1459, "test[nick]", NULL);
+	assert_equals(highlight_match(&h, "testing TEST{NICK}: testing"), 1);
+
+	/* Error: nick not matched under ascii casemapping */
+	highlight_compile(&h, CASEMAPPING_ASCII, "test[nick]", NULL);
+	assert_equals(highlight_match(&h, "testing TEST{NICK}: testing"), 0);
+
+	/* Test words, with and without word boundaries */
+	highlight_compile(&h, CASEMAPPING_RFC1459, "nick", "nick_, rirc,*bot* *ing, she");
+
+	assert_equals(highlight_match(&h, "nick_: hello"), 1);
+	assert_equals(highlight_match(&h, "a RIRC question"), 1);
+	assert_equals(highlight_match(&h, "rircs"), 0);
+	assert_equals(highlight_match(&h, "the robots are here"), 1);
+	assert_equals(highlight_match(&h, "testing"), 1);
+	assert_equals(highlight_match(&h, "ingest"), 0);
+
+	/* Test overlapping words found through failure links */
+	assert_equals(highlight_match(&h, "ushe"), 0);
+	assert_equals(highlight_match(&h, "u-she"), 0);
+	assert_equals(highlight_match(&h, "u she"), 1);
+	assert_equals(highlight_match(&h, "nicnick"), 0);
+	assert_equals(highlight_match(&h, "nicnick nicnick_ nick"), 1);
+
+	free_highlight(&h);
+
+	assert_equals(highlight_match(&h, "nick"), 0);
+}
+
+void
+test_split_text(void)
+{
+	/* Test splitting text at words and UTF-8 characters */
+
+	const char *t1 = "the quick brown fox";
+
+	/* Text that fits isn't split */
+	assert_equals((int)split_text(t1, 19, 19), 19);
+	assert_equals((int)split_text(t1, 19, 100), 19);
+	assert_equals((int)split_text("", 0, 1), 0);
+
+	/* Split at the last space that fits, the space leads the remainder */
+	assert_equals((int)split_text(t1, 19, 18), 15);
+	assert_equals((int)split_text(t1, 19, 15), 15);
+	assert_equals((int)split_text(t1, 19, 14), 9);
+	assert_equals((int)split_text(t1, 19, 4), 3);
+
+	/* Without a space, split at the max or before a multibyte character */
+	assert_equals((int)split_text(t1, 19, 2), 2);
+	assert_equals((int)split_text("abcdef", 6, 4), 4);
+
+	/* "aé€" is 61 C3 A9 E2 82 AC */
+	const char *t2 = "a\xC3\xA9\xE2\x82\xAC";
+
+	assert_equals((int)split_text(t2, 6, 1), 1);
+	assert_equals((int)split_text(t2, 6, 2), 1);
+	assert_equals((int)split_text(t2, 6, 3), 3);
+	assert_equals((int)split_text(t2, 6, 4), 3);
+	assert_equals((int)split_text(t2, 6, 5), 3);
+	assert_equals((int)split_text(t2 + 1, 5, 1), 1);
+}
+
+void
+test_check_netsplit(void)
+{
+	/* Test detecting netsplit QUIT messages */
+
+	assert_equals(check_netsplit("irc.a.net irc.b.net"), 1);
+	assert_equals(check_netsplit("a.b c-d.e"), 1);
+	assert_equals(check_netsplit("a.b.c.d e.f"), 1);
+
+	/* Two words, each with a dot, neither leading nor trailing */
+	assert_equals(check_netsplit("irc.a.net"), 0);
+	assert_equals(check_netsplit("irc.a.net irc"), 0);
+	assert_equals(check_netsplit("irc a.net"), 0);
+	assert_equals(check_netsplit(".irc.a.net irc.b.net"), 0);
+	assert_equals(check_netsplit("irc.a.net. irc.b.net"), 0);
+	assert_equals(check_netsplit("irc.a.net .irc.b.net"), 0);
+	assert_equals(check_netsplit("irc.a.net irc.b.net."), 0);
+	assert_equals(check_netsplit(". ."), 0);
+
+	/* Terminated after the second word */
+	assert_equals(check_netsplit("irc.a.net irc.b.net irc.c.net"), 0);
+	assert_equals(check_netsplit("irc.a.net irc.b.net "), 0);
+	assert_equals(check_netsplit("irc.a.net  irc.b.net"), 0);
+	assert_equals(check_netsplit(" irc.a.net irc.b.net"), 0);
+	assert_equals(check_netsplit(""), 0);
+
+	/* Users' quit messages */
+	assert_equals(check_netsplit("Quit: irc.a.net irc.b.net"), 0);
+	assert_equals(check_netsplit("Ping timeout: 240 seconds"), 0);
+	assert_equals(check_netsplit("irc.a.net/irc.b.net"), 0);
+}
+
+void
+test_flood_take(void)
+{
+	/* Test taking tokens from token buckets */
+
+	time_t sender = 0, other = 0, server = 0;
+	int i;
+
+	struct flood_bucket b1[] = {
+		{ &sender, 3, 2 },
+		{ &server, 5, 1 },
+	};
+
+	struct flood_bucket b2[] = {
+		{ &other, 3, 2 },
+		{ &server, 5, 1 },
+	};
+
+	/* A burst of tokens can be taken at once */
+	for (i = 0; i < 3; i++)
+		assert_equals((int)flood_take(b1, 1, 100), 1);
+
+	assert_equals((int)flood_take(b1, 1, 100), 0);
+	assert_equals((int)sender, 106);
+
+	/* A token is refilled every refill seconds */
+	assert_equals((int)flood_take(b1, 1, 101), 0);
+	assert_equals((int)flood_take(b1, 1, 102), 1);
+	assert_equals((int)flood_take(b1, 1, 102), 0);
+
+	/* Idle buckets are full, not more than full */
+	for (i = 0; i < 3; i++)
+		assert_equals((int)flood_take(b1, 1, 1000), 1);
+
+	assert_equals((int)flood_take(b1, 1, 1000), 0);
+
+	/* Dropped over the sender's bucket, the server's token isn't taken */
+	sender = 0;
+	server = 0;
+
+	for (i = 0; i < 3; i++)
+		assert_equals((int)flood_take(b1, 2, 200), 2);
+
+	assert_equals((int)flood_take(b1, 2, 200), 0);
+	assert_equals((int)server, 203);
+
+	/* Dropped over the server's bucket, the sender's token isn't taken */
+	assert_equals((int)flood_take(b2, 2, 200), 2);
+	assert_equals((int)flood_take(b2, 2, 200), 2);
+	assert_equals((int)flood_take(b2, 2, 200), 1);
+	assert_equals((int)other, 204);
+	assert_equals((int)server, 205);
 }
 
 void
@@ -395,16 +1185,149 @@ test_count_line_rows(void)
 	/* TODO */
 }
 
+void
+test_directory(void)
+{
+	/* Test channel directory filtering and incremental sorting */
+
+	char name[32];
+	size_t i;
+	struct directory d = {0};
+
+	directory_add(&d, "#Rirc", 10, "IRC client");
+	directory_add(&d, "#c", 300, "The C language");
+	directory_add(&d, "#linux", 300, "");
+
+	directory_update(&d);
+
+	assert_equals((int)d.view_count, 3);
+	assert_strcmp(d.text + d.names[d.view[0]], "#c");
+	assert_strcmp(d.text + d.names[d.view[1]], "#linux");
+	assert_strcmp(d.text + d.names[d.view[2]], "#Rirc");
+
+	directory_sort(&d, DIRECTORY_SORT_NAME);
+	directory_update(&d);
+
+	assert_strcmp(d.text + d.names[d.view[0]], "#c");
+	assert_strcmp(d.text + d.names[d.view[1]], "#linux");
+	assert_strcmp(d.text + d.names[d.view[2]], "#Rirc");
+
+	/* Filter on name or topic, ignoring case */
+	directory_filter(&d, "IRC");
+	directory_update(&d);
+
+	assert_equals((int)d.view_count, 1);
+	assert_strcmp(d.text + d.names[d.view[0]], "#Rirc");
+
+	directory_filter(&d, "c");
+	directory_update(&d);
+
+	assert_equals((int)d.view_count, 2);
+
+	/* Entries streamed in are merged into the sorted view */
+	directory_filter(&d, "");
+	directory_sort(&d, DIRECTORY_SORT_USERS);
+
+	for (i = 0; i < 5000; i++) {
+
+		snprintf(name, sizeof(name), "#chan%zu", i);
+		directory_add(&d, name, (i * 7919) % 1000, "");
+
+		if (i % 1000 == 0)
+			directory_update(&d);
+	}
+
+	directory_update(&d);
+
+	assert_equals((int)d.view_count, 5003);
+
+	for (i = 1; i < d.view_count; i++) {
+		if (d.users[d.view[i - 1]] < d.users[d.view[i]])
+			fail_testf("directory view not sorted at %zu", i);
+	}
+
+	directory_reset(&d);
+
+	assert_equals((int)d.count, 0);
+	assert_equals((int)d.view_count, 0);
+
+	free_directory(&d);
+}
+
+void
+test_buffer_line_text(void)
+{
+	/* Test event lines are formatted once, on first use */
+
+	char *text;
+	buffer_line l = {0};
+
+	l.event.kind = EVENT_JOIN;
+	l.event.nick = "nick";
+	l.event.host = "user@host";
+	l.event.chan = "#chan";
+
+	text = buffer_line_text(&l);
+	assert_strcmp(text, "nick!user@host has joined #chan");
+	assert_equals((int)l.len, (int)strlen(text));
+
+	if (buffer_line_text(&l) != text)
+		fail_test("buffer_line_text() formatted a line twice");
+
+	free(l.text);
+	l.text = NULL;
+
+	l.event.kind = EVENT_PART;
+	assert_strcmp(buffer_line_text(&l), "nick!user@host has left #chan");
+
+	free(l.text);
+	l.text = NULL;
+
+	l.event.arg = "reason";
+	assert_strcmp(buffer_line_text(&l), "nick!user@host has left #chan (reason)");
+
+	free(l.text);
+	l.text = NULL;
+
+	l.event.kind = EVENT_QUIT;
+	l.event.host = NULL;
+	assert_strcmp(buffer_line_text(&l), "nick has quit (reason)");
+
+	free(l.text);
+	l.text = NULL;
+
+	l.event.kind = EVENT_NICK;
+	l.event.arg = "new_nick";
+	assert_strcmp(buffer_line_text(&l), "nick  >>  new_nick");
+
+	free(l.text);
+}
+
 int
 main(void)
 {
 	testcase tests[] = {
 		&test_avl,
+		&test_avl_casemapping,
+		&test_avl_pool,
+		&test_avl_build,
+		&test_avl_rank,
+		&test_irc_strcmp,
+		&test_hash,
+		&test_mode,
+		&test_intern,
+		&test_ignore,
 		&test_parse,
+		&test_parse_time,
 		&test_getarg,
-		&test_check_pinged,
+		&test_highlight,
+		&test_split_text,
+		&test_check_netsplit,
+		&test_flood_take,
 		&test_word_wrap,
 		&test_count_line_rows,
+		&test_buffer_line_text,
+		&test_directory,
 	};
 
 	return run_tests(tests);